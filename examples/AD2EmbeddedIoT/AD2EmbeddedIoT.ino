@@ -142,12 +142,63 @@ static unsigned long time_laps = 0;
 // raw mode allows direct access to the AD2* device and disables internal processing.
 static bool raw_mode = false;
 
-// AlarmDecoder parser
-AlarmDecoderParser AD2Parse;
+// AlarmDecoder parser. Decoded messages are queued by put() and handed
+// to the consumers below by ad2Drain() so parsing the AD2* stream is not
+// held up by network sends.
+AD2QueueParser AD2Parse;
+
+// Commands to the AD2*. Whole commands from every source are queued,
+// duplicates merged and written paced by ad2Loop().
+AD2CommandQueue AD2Send;
+enum { CMD_SRC_HOST, CMD_SRC_WS, CMD_SRC_MQTT };
+
+#if defined(AD2_TASK_CORE)
+// Records from ad2Task() to loop() and the parser counters ad2Task()
+// takes each second. AD2Parse is only used by ad2Task().
+AD2SpscQueue<AD2QueuedMessage, AD2_TASK_QUEUE_SIZE> ad2Queue;
+AD2SpscQueue<AD2ParserStats, 4> ad2StatsQueue;
+// Commands from loop() to ad2Task() which owns AD2Send.
+typedef struct {
+  uint8_t source;
+  uint16_t len;
+  char data[AD2_CMD_MAX_SIZE];
+} ad2_cmd_item_t;
+AD2SpscQueue<ad2_cmd_item_t, 4> ad2CmdQueue;
+// Owned by loop(). Counters since the last MQTT PING and the last state
+// of each partition for !SYNC.
+AD2ParserStats ad2Stats = {};
+AD2VirtualPartitionState ad2States[AD2_MAX_PARTITIONS];
+uint8_t ad2StatesCount = 0;
+#endif
+
+// Records handed to the consumers per ad2Drain() batch.
+#define AD2_DRAIN_BATCH 4
+
+// Events each consumer is interested in.
+#define LOG_EVENTS (AD2_EVENT_MASK(AD2_EV_MESSAGE) | \
+                    AD2_EVENT_MASK(AD2_EV_LRR))
+#define WS_EVENTS (AD2_EVENT_MASK(AD2_EV_MESSAGE))
+#define MQTT_EVENTS (AD2_EVENT_MASK(AD2_EV_ARM) | \
+                     AD2_EVENT_MASK(AD2_EV_DISARM) | \
+                     AD2_EVENT_MASK(AD2_EV_ALARM) | \
+                     AD2_EVENT_MASK(AD2_EV_ALARM_RESTORED) | \
+                     AD2_EVENT_MASK(AD2_EV_FIRE) | \
+                     AD2_EVENT_MASK(AD2_EV_POWER_CHANGE) | \
+                     AD2_EVENT_MASK(AD2_EV_ZONE_FAULT) | \
+                     AD2_EVENT_MASK(AD2_EV_ZONE_RESTORE) | \
+                     AD2_EVENT_MASK(AD2_EV_LRR))
 #if defined(AD2_SOCK)
 WiFiClient AD2Sock;
 #endif
 
+#if defined(AD2_CAPTURE_FILE)
+// raw AD2* stream capture see captureWrite()
+File captureFile;
+static unsigned long capture_last_us = 0;
+static unsigned long capture_flush_ms = 0;
+static size_t capture_size = 0;
+#endif
+
 // MQTT client
 #if defined(EN_MQTT_CLIENT)
 #if defined(SECRET_MQTT_SERVER) && defined(SECRET_MQTT_SERVER_CERT)
@@ -172,6 +223,7 @@ String mqtt_root;
 
 // REST service
 #if defined(EN_REST)
+#include <map>
 
 // subscriber storage structure
 typedef struct {
@@ -192,6 +244,18 @@ std::map<String, uint32_t> TIME_MULTIPLIER = {{"SECONDS", 1 * 1000},{"MINUTES",
 #if defined(EN_HTTP) || defined(EN_HTTPS)
 using namespace httpsserver;
 
+// Websocket outbound queue entry. States name a snapshot slot and are
+// sent from the snapshot when the entry is drained.
+enum {
+  WS_OUT_STATE,    // state update, delta if the client can apply it
+  WS_OUT_SYNC,     // full state
+  WS_OUT_PONG
+};
+typedef struct {
+  uint8_t type;
+  uint8_t slot;
+} ws_out_item_t;
+
 // Websocket handler class
 class WSClientHandler : public WebsocketHandler {
 public:
@@ -208,6 +272,36 @@ public:
   // Handler function on connection errors
   void onError(std::string error);
 
+  // Send only changed fields. Set with !DELTA:1
+  bool delta = false;
+
+  // Send states as binary records. Set with !BIN:1
+  bool binary = false;
+
+  // Add a message to the outbound queue. A state for a partition that is
+  // already waiting is merged into that entry. Returns false if the queue
+  // is full.
+  bool queue(uint8_t type, uint8_t slot = 0);
+
+  // Outbound queue drained by wsFlush().
+  ws_out_item_t out[HTTP_WS_QUEUE_SIZE];
+  uint8_t out_head = 0;
+  uint8_t out_count = 0;
+  uint32_t slow_since = 0;   // millis() of the first send that blocked or 0
+  uint32_t stall_ms = 0;     // millis() of the last send that blocked
+  uint32_t full_since = 0;   // millis() when the queue filled or dropped or 0
+  bool dropped = false;      // an entry was dropped since the last wsFlush()
+
+  // Snapshot version last sent from each snapshot slot.
+  uint32_t sent_version[AD2_MAX_PARTITIONS] = {0};
+
+  // Counters since the last STATS report.
+  uint32_t sent = 0;
+  uint32_t coalesced = 0;
+  uint32_t drops = 0;
+  uint32_t stalls = 0;
+  uint8_t max_depth = 0;
+
 };
 
 // Simple array to store the active web socket clients:
@@ -276,76 +370,84 @@ void genUUID(uint32_t n, String &ret) {
 }
 
 /**
- * simple reverse string missing in std libs?
+ * Serialized partition state shared by ws clients, !SYNC and MQTT. It is
+ * rebuilt only when the state changes and version counts the rebuilds.
+ * delta holds the fields that changed from version - 1 for ws clients in
+ * delta mode. delta_len is 0 if it did not fit. record is the same state
+ * for binary ws clients.
  */
-char *strrev(char *str)
-{
-    if (!str || ! *str)
-        return str;
-
-    int i = strlen(str) - 1, j = 0;
-
-    char ch;
-    while (i > j)
-    {
-        ch = str[i];
-        str[i] = str[j];
-        str[j] = ch;
-        i--;
-        j++;
-    }
-    return str;
-}
+#define AD2_JSON_SIZE 1024
+#define AD2_DELTA_SIZE 256
+typedef struct {
+  uint8_t partition;
+  uint32_t version;
+  uint16_t len;
+  uint16_t delta_len;
+  AD2VirtualPartitionState last;
+  char json[AD2_JSON_SIZE];
+  char delta[AD2_DELTA_SIZE];
+  uint8_t record[AD2_STATE_RECORD_SIZE];
+} ad2_snapshot_t;
+
+ad2_snapshot_t ad2Snapshots[AD2_MAX_PARTITIONS];
+uint8_t ad2SnapshotsCount = 0;
 
 /**
- * Create a json state structure from AD2VirtualPartitionState
+ * Current snapshot of a partition. Built from s if anything the json
+ * shows, except uptime, changed from the last state it was built from.
+ * Returns nullptr if no snapshot slot is free.
  */
-void jsonAD2VirtualPartitionState(AD2VirtualPartitionState *s, std::string &json) {
-    // Allocate JsonBuffer
-  DynamicJsonDocument doc(500);
-
-  // Add elements
-  String szTime; uptimeString(szTime);
-  doc["uptime"] = szTime;
-
-  // Build simple address mask for use by js client.
-  // The 32 byte string represents each address or partition
-  // from 0 to 31 from left to right.
-  // Example: 0100000000000000100000000000010
-  //           |              |
-  //           |              Addrss 16(Ademco) Partition 16(DSC)
-  //           Address 1(Ademco) or Partition 1(DSC)
-  String szmask = "00000000000000000000000000000000";
-  szmask += String(s->address_mask_filter, BIN);
-  doc["address_mask_filter"] = strrev((char *)szmask.substring(szmask.length()-32,szmask.length()).c_str());
-
-  // Alarm panel states from section #1 of the AlarmDecoder API
-  doc["display_cursor_type"] = s->display_cursor_type;
-  doc["display_cursor_location"] = s->display_cursor_location;
-  doc["ready"] = s->ready;
-  doc["armed_away"] = s->armed_away;
-  doc["armed_home"] = s->armed_home;
-  doc["backlight_on"] = s->backlight_on;
-  doc["programming_mode"] = s->programming_mode;
-  doc["zone_bypassed"] = s->zone_bypassed;
-  doc["ac_power"] = s->ac_power;
-  doc["chime_on"] = s->chime_on;
-  doc["alarm_event_occured"] = s->alarm_event_occurred;
-  doc["alarm_sounding"] = s->alarm_sounding;
-  doc["battery_low"] = s->battery_low;
-  doc["entry_delay_off"] = s->entry_delay_off;
-  doc["fire_alarm"] = s->fire_alarm;
-  doc["system_issue"] = s->system_issue;
-  doc["perimeter_only"] = s->perimeter_only;
-  doc["exit_now"] = s->exit_now;
-  doc["system_specific"] = s->system_specific;
-  doc["beeps"] = String((char)s->beeps);
-  doc["panel_type"] = String((char)s->panel_type);
-  doc["last_alpha_message"] = s->last_alpha_message;
-  doc["last_numeric_message"] = s->last_numeric_message;
-
-  // create std::string for websocket lib and fill it with final json string
-  serializeJson(doc, json);
+ad2_snapshot_t *ad2Snapshot(AD2VirtualPartitionState *s) {
+  ad2_snapshot_t *snap = nullptr;
+  for (uint8_t i = 0; i < ad2SnapshotsCount; i++) {
+    if (ad2Snapshots[i].partition == s->partition) {
+      snap = &ad2Snapshots[i];
+      break;
+    }
+  }
+  AD2VirtualPartitionState *prev = nullptr;
+  if (!snap) {
+    if (ad2SnapshotsCount >= AD2_MAX_PARTITIONS) {
+      return nullptr;
+    }
+    snap = &ad2Snapshots[ad2SnapshotsCount++];
+    snap->partition = s->partition;
+    snap->version = 0;
+  } else if (!ad2_json_state_changed(s, &snap->last)) {
+    return snap;
+  } else {
+    prev = &snap->last;
+  }
+  snap->version++;
+
+  AD2JsonWriter w;
+  ad2_json_begin(&w, snap->json, sizeof(snap->json));
+  ad2_json_uint(&w, "partition", snap->partition);
+  ad2_json_uint(&w, "version", snap->version);
+
+  // Uptime when this state was seen.
+  String szTime;
+  uptimeString(szTime);
+  ad2_json_string(&w, "uptime", szTime.c_str(), szTime.length());
+  ad2_json_state(&w, s, nullptr);
+  snap->len = ad2_json_end(&w);
+
+  // Changed fields only. Delta clients need the full state first.
+  snap->delta_len = 0;
+  if (prev) {
+    ad2_json_begin(&w, snap->delta, sizeof(snap->delta));
+    ad2_json_bool(&w, "delta", true);
+    ad2_json_uint(&w, "partition", snap->partition);
+    ad2_json_uint(&w, "version", snap->version);
+    ad2_json_state(&w, s, prev);
+    size_t len = ad2_json_end(&w);
+    if (!w.full) {
+      snap->delta_len = len;
+    }
+  }
+  ad2_encode_state(snap->record, s, snap->version);
+  snap->last = *s;
+  return snap;
 }
 
 /**
@@ -378,8 +480,9 @@ void setup()
   // The ESP32 uart driver has its own interrupt and buffers for processing
   // rx bytes. Give it plenty of space. 1024 gave about 1 minute storage of
   // normal messages from AD2 on Vista 50PUL panel with one partition.
-  // If any loop() method is busy too long alarm panel state data will be lost.
-  Serial2.setRxBufferSize(2048);
+  // If ingest runs in loop()(AD2_TASK_CORE not set) and any loop() method
+  // is busy too long alarm panel state data will be lost.
+  Serial2.setRxBufferSize(AD2_RX_BUFFER_SIZE);
   // A small chance of corruption on serial line exists during 
   // the initial flashing of the ESP32. Just in case force AD2
   // into run mode by forcing it out of any potential input states.
@@ -395,6 +498,10 @@ void setup()
     Serial.println("success");
   }
 
+#if defined(AD2_CAPTURE_FILE)
+  captureStart();
+#endif
+
 #if defined(EN_ETH) || defined(EN_WIFI)
   WiFi.onEvent(networkEvent);
 #endif
@@ -473,10 +580,24 @@ void setup()
 #endif // EN_HTTPS
 #endif // EN_HTTP || EN_HTTPS
 
-  // AlarmDecoder wiring.
-  AD2Parse.setCB_ON_RAW_MESSAGE(my_ON_RAW_MESSAGE_CB);
-  AD2Parse.setCB_ON_MESSAGE(my_ON_MESSAGE_CB);
-  AD2Parse.setCB_ON_LRR(my_ON_LRR_CB);
+  // AlarmDecoder wiring. Only queue the events a consumer uses and
+  // fold keypad updates for the same partition into one record so a
+  // slow drain sends the latest state instead of every step.
+  uint32_t events = LOG_EVENTS;
+#if defined(EN_HTTP) || defined(EN_HTTPS)
+  events |= WS_EVENTS;
+#endif
+#if defined(EN_MQTT_CLIENT)
+  events |= MQTT_EVENTS;
+#endif
+  AD2Parse.setQueueEvents(events);
+  AD2Parse.setMerge(true);
+
+#if defined(AD2_TASK_CORE)
+  // Start AD2* ingest. From here on only ad2Task() uses AD2Parse.
+  xTaskCreatePinnedToCore(ad2Task, "ad2", AD2_TASK_STACK_SIZE, nullptr, 2,
+                          nullptr, AD2_TASK_CORE);
+#endif
 }
 
 /**
@@ -505,8 +626,13 @@ void loop()
   }
 #endif
 
+#if !defined(AD2_TASK_CORE)
   // AD2* message processing
   ad2Loop();
+#endif
+
+  // Hand queued AD2* messages to the consumers
+  ad2Drain();
 
   // Networking ETH/WiFi persistent connection state machine cycles
   networkLoop();
@@ -603,6 +729,11 @@ void networkLoop() {
     }
 #endif
 
+#if defined(EN_HTTP) || defined(EN_HTTPS)
+    // Send what the ws clients have waiting
+    wsFlush();
+#endif
+
   }
 }
 
@@ -612,34 +743,117 @@ void networkLoop() {
  *  2) read from host uart/sock and send to AD2* uart.
  *  3) process message from AD2* uart and update AD2* state machine.
  */
+#if defined(AD2_CAPTURE_FILE)
+/**
+ * Start a new capture file replacing any previous capture.
+ */
+void captureStart() {
+  uint8_t hdr[AD2_CAPTURE_HEADER_SIZE];
+
+  captureFile = SPIFFS.open(AD2_CAPTURE_FILE, FILE_WRITE);
+  if (!captureFile) {
+    Serial.println("!DBG:AD2EMB,capture open failed");
+    return;
+  }
+  capture_size = captureFile.write(hdr, ad2_capture_header(hdr));
+  capture_last_us = micros();
+  capture_flush_ms = millis();
+}
+
+/**
+ * Append a chunk read from the AD2* to the capture file.
+ */
+void captureWrite(const uint8_t *buf, int len) {
+  uint8_t rec[AD2_CAPTURE_RECORD_SIZE];
+
+  if (!captureFile) {
+    return;
+  }
+  if (capture_size + sizeof(rec) + len > AD2_CAPTURE_MAX_SIZE) {
+    captureFile.close();
+    Serial.println("!DBG:AD2EMB,capture full");
+    return;
+  }
+
+  unsigned long now = micros();
+  ad2_capture_record(rec, now - capture_last_us, len);
+  capture_last_us = now;
+  capture_size += captureFile.write(rec, sizeof(rec));
+  capture_size += captureFile.write(buf, len);
+
+  // Keep what was captured if power is lost.
+  if (millis() - capture_flush_ms > 1000) {
+    capture_flush_ms = millis();
+    captureFile.flush();
+  }
+}
+#endif
+
 void ad2Loop() {
   int len;
-  static uint8_t buff[100];
+  static uint8_t buff[AD2_RX_BUFFER_SIZE];
 
 #if defined(AD2_SOCK)
+  static size_t sock_budget = AD2_SOCK_BUDGET;
+  static unsigned long sock_retry_ms = 0;
+  static unsigned long sock_backoff_ms = AD2_SOCK_RETRY_MS;
+
   // if we have an interface active process network service states
   if (eth_connected || wifi_connected) {
-      if (!AD2Sock.connected()) {
-        AD2Sock.connect(AD2_SOCKIP,AD2_SOCKPORT);
-      } else {
-        int8_t maxread = 100;
-        while (AD2Sock.available() && (maxread--)>0) {
+    if (!AD2Sock.connected()) {
+      // connect() blocks so back off while the server is down.
+      if ((long)(millis() - sock_retry_ms) >= 0) {
+        if (AD2Sock.connect(AD2_SOCKIP, AD2_SOCKPORT)) {
+          // Drop any partial message from the last connection.
+          AD2Parse.reset_parser();
+          sock_backoff_ms = AD2_SOCK_RETRY_MS;
+          sock_budget = AD2_SOCK_BUDGET;
+        } else {
+          sock_retry_ms = millis() + sock_backoff_ms;
+          sock_backoff_ms = min(sock_backoff_ms * 2, (unsigned long)AD2_SOCK_RETRY_MAX_MS);
+        }
+      }
+    } else if (raw_mode || AD2Parse.pending() < AD2_QUEUE_SIZE / 2) {
+      // Read whole chunks and parse each with one put() until the budget
+      // is used or the socket is empty.
+      size_t budget = sock_budget;
+      while (budget && (len = AD2Sock.available()) > 0) {
+        if ((size_t)len > sizeof(buff)) {
+          len = sizeof(buff);
+        }
+        if ((size_t)len > budget) {
+          len = budget;
+        }
+        int res = AD2Sock.read(buff, len);
+        if (res <= 0) {
+          break;
+        }
+        budget -= res;
+#if defined(AD2_CAPTURE_FILE)
+        captureWrite(buff, res);
+#endif
+        if (raw_mode) {
+          // Raw mode just echo data to the host.
+          Serial.write(buff, res);
+        } else {
           // Parse data from AD2* and report back to host.
-          int8_t rx = buff[0] = AD2Sock.read();
-          if (rx>0) {
-            if (raw_mode) {
-              // Raw mode just echo data to the host.
-              Serial.write(buff, len);
-            } else {
-              AD2Parse.put(buff, 1);
-            }
-          }
+          AD2Parse.put(buff, res);
         }
       }
+
+      // Catch up faster while a backlog remains.
+      if (!budget && AD2Sock.available() > 0) {
+        sock_budget = min(sock_budget * 2, (size_t)AD2_SOCK_BUDGET_MAX);
+      } else {
+        sock_budget = AD2_SOCK_BUDGET;
+      }
     }
+  }
 #endif
 #if defined(AD2_UART)
   // Read any data from the AD2* device echo to the HOST uart and parse it.
+  // buff is as large as the uart rx buffer so a backlog is drained in one
+  // read and one put().
   while ((len = Serial2.available())>0) {
     // avoid consuming more than our storage.
     if (len > sizeof(buff)) {
@@ -648,29 +862,229 @@ void ad2Loop() {
 
     int res = Serial2.readBytes(buff, len);
     if (res > 0) {
+#if defined(AD2_CAPTURE_FILE)
+      captureWrite(buff, res);
+#endif
       if (raw_mode) {
         // Raw mode just echo data to the host.
-        Serial.write(buff, len);
+        Serial.write(buff, res);
       } else {
         // Parse data from AD2* and report back to host.
-        AD2Parse.put(buff, len);
+        AD2Parse.put(buff, res);
       }
     }
   }
 #endif
-  // Send any host data to the AD2*
-  // WARNING! AVOID multiple systems sending data at the same time to the panel.
-  while (Serial.available()>0) {
+
+  // Collect host input into whole commands. A command ends with its CR
+  // or LF, when it fills the buffer or after 250ms with no input.
+  static char host_cmd[AD2_CMD_MAX_SIZE];
+  static uint16_t host_len = 0;
+  static unsigned long host_ms = 0;
+  bool host_done = false;
+  while (!host_done && Serial.available()>0) {
     int res = Serial.read();
-    if (res > -1) {
-      Serial.printf("sending %c to AD2*\r\n",res);
+    if (res < 0) {
+      break;
+    }
+    bool eol = (res == '\r' || res == '\n');
+    // Skip the LF of a CRLF and empty lines.
+    if (eol && !host_len) {
+      continue;
+    }
+    host_cmd[host_len++] = res;
+    host_ms = millis();
+    host_done = eol || host_len == sizeof(host_cmd);
+  }
+  if (host_len && (host_done || millis() - host_ms > 250)) {
+    Serial.printf("!DBG:AD2EMB,sending '%.*s' to AD2*\r\n", host_len, host_cmd);
+    AD2Send.send(host_cmd, host_len, CMD_SRC_HOST);
+    host_len = 0;
+  }
+
+#if defined(AD2_TASK_CORE)
+  // Commands from loop().
+  ad2_cmd_item_t *cmd;
+  while ((cmd = ad2CmdQueue.front())) {
+    AD2Send.send(cmd->data, cmd->len, cmd->source);
+    ad2CmdQueue.pop();
+  }
+#endif
+
+  // Write the next command when the AD2* is ready for it. Only
+  // AD2Send writes to the AD2* so commands never interleave.
 #if defined(AD2_UART)
-      Serial2.write((uint8_t)res);
+  AD2Send.poll(Serial2);
 #endif
 #if defined(AD2_SOCK)
+  if (AD2Sock.connected()) {
+    AD2Send.poll(AD2Sock);
+  }
 #endif
+}
+
+#if defined(AD2_TASK_CORE)
+/**
+ * AD2* ingest task. Reads and parses the AD2* and moves queued records
+ * to ad2Queue for loop(). While ad2Queue is full records wait in the
+ * parser queue where updates for the same partition merge.
+ */
+void ad2Task(void *arg) {
+  unsigned long stats_ms = millis();
+
+  for (;;) {
+    ad2Loop();
+
+    AD2QueuedMessage *m;
+    while ((m = ad2Queue.claim()) && AD2Parse.drain(m, 1)) {
+      ad2Queue.push();
+    }
+
+    if (millis() - stats_ms > 1000) {
+      AD2ParserStats *st = ad2StatsQueue.claim();
+      if (st) {
+        AD2Parse.getStats(st, true);
+        ad2StatsQueue.push();
+        stats_ms = millis();
+      }
     }
+
+    // Let lower priority tasks on this core run.
+    vTaskDelay(1);
+  }
+}
+#endif
+
+/**
+ * Pass queued AD2* messages to the consumers. From ad2Queue when
+ * ingest runs in ad2Task() otherwise straight from the parser.
+ */
+void ad2Drain() {
+#if defined(AD2_TASK_CORE)
+  AD2QueuedMessage *m;
+  for (int i = 0; i < AD2_DRAIN_BATCH && (m = ad2Queue.front()); i++) {
+    ad2Dispatch(m);
+    ad2Queue.pop();
   }
+
+  AD2ParserStats *st;
+  while ((st = ad2StatsQueue.front())) {
+    ad2_stats_add(&ad2Stats, st);
+    ad2StatsQueue.pop();
+  }
+#else
+  static AD2QueuedMessage batch[AD2_DRAIN_BATCH];
+  size_t n = AD2Parse.drain(batch, AD2_DRAIN_BATCH);
+  for (size_t i = 0; i < n; i++) {
+    ad2Dispatch(&batch[i]);
+  }
+#endif
+}
+
+/**
+ * Pass a record to the consumers that want one of its events. A
+ * consumer is called once per record with the first event it is
+ * interested in so a merged record does not send the same partition
+ * state more than once.
+ */
+void ad2Dispatch(AD2QueuedMessage *m) {
+  AD2MessageView view = {m->data, m->len};
+  AD2VirtualPartitionState *s = m->has_state ? &m->state : nullptr;
+  uint8_t ev;
+
+#if defined(AD2_TASK_CORE)
+  // Keep the last state of each partition for !SYNC.
+  if (s) {
+    uint8_t i;
+    for (i = 0; i < ad2StatesCount; i++) {
+      if (ad2States[i].partition == s->partition) {
+        break;
+      }
+    }
+    if (i == ad2StatesCount && ad2StatesCount < AD2_MAX_PARTITIONS) {
+      ad2StatesCount++;
+    }
+    if (i < ad2StatesCount) {
+      ad2States[i] = *s;
+    }
+  }
+#endif
+
+  if ((ev = ad2FirstEvent(m->events & LOG_EVENTS)) < AD2_EVENT_COUNT) {
+    my_LOG_SUB(nullptr, ev, &view, s);
+  }
+#if defined(EN_HTTP) || defined(EN_HTTPS)
+  if ((ev = ad2FirstEvent(m->events & WS_EVENTS)) < AD2_EVENT_COUNT) {
+    my_WS_SUB(activeWSClients, ev, &view, s);
+  }
+#endif
+#if defined(EN_MQTT_CLIENT)
+  if ((ev = ad2FirstEvent(m->events & MQTT_EVENTS)) < AD2_EVENT_COUNT) {
+    my_MQTT_SUB(&mqttClient, ev, &view, s);
+  }
+#endif
+}
+
+/**
+ * Lowest event set in mask or AD2_EVENT_COUNT if none.
+ */
+uint8_t ad2FirstEvent(uint32_t mask) {
+  uint8_t ev = 0;
+  while (ev < AD2_EVENT_COUNT && !(mask & AD2_EVENT_MASK(ev))) {
+    ev++;
+  }
+  return ev;
+}
+
+/**
+ * Partition state for an address mask or nullptr if none matches.
+ */
+AD2VirtualPartitionState *ad2FindState(uint32_t mask) {
+#if defined(AD2_TASK_CORE)
+  // The parser belongs to ad2Task(). Use the copies from the records.
+  for (uint8_t i = 0; i < ad2StatesCount; i++) {
+    uint32_t filter = ad2States[i].address_mask_filter;
+    if (mask ? (filter & mask) != 0 : filter == 0) {
+      return &ad2States[i];
+    }
+  }
+  return nullptr;
+#else
+  return AD2Parse.getAD2PState(&mask);
+#endif
+}
+
+/**
+ * Queue a command for the AD2* from loop().
+ */
+bool ad2Command(const char *cmd, size_t len, uint8_t source) {
+#if defined(AD2_TASK_CORE)
+  // AD2Send belongs to ad2Task(). Hand the command over.
+  ad2_cmd_item_t *item = ad2CmdQueue.claim();
+  if (!item || !len || len > AD2_CMD_MAX_SIZE) {
+    Serial.printf("!DBG:AD2EMB,CMD dropped '%.*s'\r\n", (int)len, cmd);
+    return false;
+  }
+  item->source = source;
+  item->len = len;
+  memcpy(item->data, cmd, len);
+  ad2CmdQueue.push();
+  return true;
+#else
+  return AD2Send.send(cmd, len, source);
+#endif
+}
+
+/**
+ * Parser counters since the last call.
+ */
+void ad2GetStats(AD2ParserStats *st) {
+#if defined(AD2_TASK_CORE)
+  *st = ad2Stats;
+  memset(&ad2Stats, 0, sizeof(ad2Stats));
+#else
+  AD2Parse.getStats(st, true);
+#endif
 }
 
 /**
@@ -814,6 +1228,12 @@ void mqttSetup() {
  */
 void mqttCallback(char* topic, byte* payload, unsigned int length) {
   Serial.printf("!DBG:AD2EMB,MQTT RX topic: '%s' payload: '%.*s'\r\n", topic, length, payload);
+
+  // CONTROL/CMD payload is sent to the AD2* as is.
+  String cmdtopic = mqtt_root + MQTT_CMD_SUB_TOPIC;
+  if (cmdtopic.equals(topic)) {
+    ad2Command((const char *)payload, length, CMD_SRC_MQTT);
+  }
 }
 
 /**
@@ -897,6 +1317,28 @@ void mqttLoop() {
         if (!mqttClient.publish(pubtopic.c_str(), mqtt_clientId.c_str())) {
           Serial.printf("!DBG:AD2EMB,MQTT publish PING fail rc(%i)\r\n", mqttClient.state());
         }
+
+        // Parser health since the last PING.
+        AD2ParserStats st;
+        ad2GetStats(&st);
+        char stats[768];
+        size_t len = snprintf(stats, sizeof(stats),
+          "{\"bytes_in\":%u,\"lines\":%u,\"keypad\":%u,\"repeats\":%u,"
+          "\"drops\":%u,\"overflow\":%u,\"corrupt\":%u,\"length_rejects\":%u,"
+          "\"bad_prefix\":%u,\"max_line\":%u,\"max_dispatch_us\":%u,"
+          "\"queue_drops\":%u",
+          st.bytes_in, st.lines, st.keypad, st.repeats, st.drops, st.overflow,
+          st.corrupt, st.length_rejects, st.bad_prefix, st.max_line, st.max_dispatch_us,
+          st.queue_drops);
+#if defined(EN_HTTP) || defined(EN_HTTPS)
+        // ws client queues since the last PING
+        len += wsStatsJson(stats + len, sizeof(stats) - len - 1);
+#endif
+        snprintf(stats + len, sizeof(stats) - len, "}");
+        pubtopic = mqtt_root + MQTT_STATS_PUB_TOPIC;
+        if (!mqttClient.publish(pubtopic.c_str(), stats)) {
+          Serial.printf("!DBG:AD2EMB,MQTT publish STATS fail rc(%i)\r\n", mqttClient.state());
+        }
         mqtt_ping_delay = MQTT_CONNECT_PING_INTERVAL;
       }
     }
@@ -967,6 +1409,152 @@ void WSClientHandler::onError(std::string error) {
   }
 }
 
+/**
+ * Queue a message for this client.
+ */
+bool WSClientHandler::queue(uint8_t type, uint8_t slot) {
+  for (uint8_t i = 0; i < out_count; i++) {
+    ws_out_item_t *item = &out[(out_head + i) % HTTP_WS_QUEUE_SIZE];
+    if (type == WS_OUT_PONG ? item->type == WS_OUT_PONG
+                            : item->type != WS_OUT_PONG && item->slot == slot) {
+      // A full state request wins over an update.
+      if (type == WS_OUT_SYNC) {
+        item->type = WS_OUT_SYNC;
+      }
+      coalesced++;
+      return true;
+    }
+  }
+  if (out_count == HTTP_WS_QUEUE_SIZE) {
+    drops++;
+    dropped = true;
+    return false;
+  }
+  ws_out_item_t *item = &out[(out_head + out_count) % HTTP_WS_QUEUE_SIZE];
+  item->type = type;
+  item->slot = slot;
+  if (++out_count > max_depth) {
+    max_depth = out_count;
+  }
+  return true;
+}
+
+/**
+ * Send the snapshot in a slot to a ws client in the form it asked for.
+ * Binary clients get the AD2_STATE_RECORD_SIZE record. For a state
+ * update delta clients get only the changed fields if they have the
+ * version before it. Merged updates skip versions so those go out as the
+ * full state.
+ */
+void wsSendState(WSClientHandler *client, uint8_t slot, bool update) {
+  ad2_snapshot_t *snap = &ad2Snapshots[slot];
+  if (client->binary) {
+    client->send(snap->record, sizeof(snap->record), WebsocketHandler::SEND_TYPE_BINARY);
+  } else if (update && client->delta && snap->delta_len &&
+             client->sent_version[slot] + 1 == snap->version) {
+    client->send((uint8_t *)snap->delta, snap->delta_len, 0x02);
+  } else {
+    client->send((uint8_t *)snap->json, snap->len, 0x02);
+  }
+  client->sent_version[slot] = snap->version;
+}
+
+/**
+ * Drain the ws client queues. Runs from networkLoop() so parser callbacks
+ * only queue. Each client gets up to HTTP_WS_SEND_BUDGET messages per
+ * call.
+ *
+ * send() blocks until the socket takes the data and the server library
+ * does not expose the socket to check for room first. A send that took
+ * HTTP_WS_STALL_MS or more means the client is not reading. That client
+ * gets no more sends for HTTP_WS_STALL_BACKOFF_MS so it holds up the loop
+ * at most once per back off. A client that keeps stalling for
+ * HTTP_WS_SLOW_TIMEOUT_MS or whose queue stays full or keeps dropping for
+ * HTTP_WS_FULL_TIMEOUT_MS is closed.
+ */
+void wsFlush() {
+  for (int i = 0; i < HTTP_MAX_WS_CLIENTS; i++) {
+    WSClientHandler *client = activeWSClients[i];
+    if (client == nullptr) {
+      continue;
+    }
+    bool stalled = false;
+    int n = 0;
+    if (!client->slow_since || millis() - client->stall_ms >= HTTP_WS_STALL_BACKOFF_MS) {
+      for (; n < HTTP_WS_SEND_BUDGET && client->out_count && !stalled; n++) {
+        ws_out_item_t item = client->out[client->out_head];
+        client->out_head = (client->out_head + 1) % HTTP_WS_QUEUE_SIZE;
+        client->out_count--;
+        uint32_t start = millis();
+        if (item.type == WS_OUT_PONG) {
+          client->send("!PONG:00000000", 0x02);
+        } else {
+          wsSendState(client, item.slot, item.type == WS_OUT_STATE);
+        }
+        client->sent++;
+        stalled = millis() - start >= HTTP_WS_STALL_MS;
+      }
+    }
+    if (stalled) {
+      client->stalls++;
+      client->stall_ms = millis();
+      if (!client->slow_since) {
+        client->slow_since = millis() | 1;
+      }
+    } else if (n) {
+      // A send that went through quickly clears a stall.
+      client->slow_since = 0;
+    }
+
+    if (client->dropped || client->out_count == HTTP_WS_QUEUE_SIZE) {
+      if (!client->full_since) {
+        client->full_since = millis() | 1;
+      }
+    } else {
+      client->full_since = 0;
+    }
+    client->dropped = false;
+
+    if ((client->slow_since && millis() - client->slow_since > HTTP_WS_SLOW_TIMEOUT_MS) ||
+        (client->full_since && millis() - client->full_since > HTTP_WS_FULL_TIMEOUT_MS)) {
+      Serial.printf("!DBG:AD2EMB,WS close slow client %i stalls %u drops %u\r\n",
+                    i, client->stalls, client->drops);
+      activeWSClients[i] = nullptr;
+      client->close();
+    }
+  }
+}
+
+/**
+ * Append the ws client queue counters to a STATS json object as
+ * ,"ws":[...] and reset them. Returns the length written.
+ */
+size_t wsStatsJson(char *buf, size_t size) {
+  size_t len = snprintf(buf, size, ",\"ws\":[");
+  bool first = true;
+  for (int i = 0; i < HTTP_MAX_WS_CLIENTS && len < size; i++) {
+    WSClientHandler *client = activeWSClients[i];
+    if (client == nullptr) {
+      continue;
+    }
+    len += snprintf(buf + len, size - len,
+      "%s{\"client\":%i,\"depth\":%u,\"max_depth\":%u,\"sent\":%u,"
+      "\"coalesced\":%u,\"drops\":%u,\"stalls\":%u}",
+      first ? "" : ",", i, client->out_count, client->max_depth, client->sent,
+      client->coalesced, client->drops, client->stalls);
+    first = false;
+    client->max_depth = client->out_count;
+    client->sent = 0;
+    client->coalesced = 0;
+    client->drops = 0;
+    client->stalls = 0;
+  }
+  if (len < size) {
+    len += snprintf(buf + len, size - len, "]");
+  }
+  return len < size ? len : size - 1;
+}
+
 /**
  * Handle WS client messages
  */
@@ -979,42 +1567,50 @@ void WSClientHandler::onMessage(WebsocketInputStreambuf * inbuf) {
 
   // '!PING' ping network test.
   if (msg.find("!PING:") == 0) {
-    for(int i = 0; i < HTTP_MAX_WS_CLIENTS; i++) {
-      if (activeWSClients[i] == this) {
-        // Send json string to the client
-        activeWSClients[i]->send("!PONG:00000000", 0x02);
-        // all done just sending to this client.
+    queue(WS_OUT_PONG);
+  }
+
+  // '!SYNC:P<n>' request send the current state of partition n. Clients
+  // in delta mode use it on a version gap.
+  if (msg.find("!SYNC:P") == 0) {
+    uint8_t partition = strtoul(msg.c_str() + 7, nullptr, 10);
+    for (uint8_t i = 0; i < ad2SnapshotsCount; i++) {
+      if (ad2Snapshots[i].partition == partition) {
+        queue(WS_OUT_SYNC, i);
         break;
       }
     }
-  }
-
+  } else
   // '!SYNC' request send current state.
   if (msg.find("!SYNC:") == 0) {
 
     // Get state by mask
-    uint32_t amask = atoi(msg.substr(msg.find(':') + 1).c_str());
-    AD2VirtualPartitionState *s = AD2Parse.getAD2PState(&amask);
+    uint32_t amask = strtoul(msg.substr(msg.find(':') + 1).c_str(), nullptr, 10);
+    AD2VirtualPartitionState *s = ad2FindState(amask);
 
     // will return nullptr if no match is found for the mask.
-    if (s) {
-      // catpure the current state as json string
-      std::string json;
-      jsonAD2VirtualPartitionState(s, json);
-
-      for(int i = 0; i < HTTP_MAX_WS_CLIENTS; i++) {
-        if (activeWSClients[i] == this) {
-          // Send json string to the client
-          activeWSClients[i]->send(json, 0x02);
-          // all done just sending to this client.
-          break;
-        }
-      }
+    ad2_snapshot_t *snap = s ? ad2Snapshot(s) : nullptr;
+    if (snap) {
+      queue(WS_OUT_SYNC, snap - ad2Snapshots);
     }
   }
 
+  // '!DELTA' 1 to get only changed fields with state updates, 0 for the
+  // full state. Full states still arrive after !SYNC or if the changes
+  // are too large.
+  if (msg.find("!DELTA:") == 0) {
+    delta = msg.c_str()[7] == '1';
+  }
+
+  // '!BIN' 1 to get states as binary AD2_STATE_RECORD_SIZE records, 0
+  // for JSON.
+  if (msg.find("!BIN:") == 0) {
+    binary = msg.c_str()[5] == '1';
+  }
+
   // '!SEND' Send message to the AD2*
   if (msg.find("!SEND:") == 0) {
+    ad2Command(msg.c_str() + 6, msg.length() - 6, CMD_SRC_WS);
   }
 
   // '!RESTART' reboot!
@@ -1327,54 +1923,73 @@ void handleEventUNSUBSCRIBE(HTTPRequest *req, HTTPResponse *res) {
  * AlarmDecoder callbacks.
  * As the AlarmDecoder receives data via put() data is validated.
  * When a complete messages is received or a specific stream of
- * bytes is received event(s) will be called.
+ * bytes is received event(s) are queued and ad2Drain() calls these
+ * with a view of the queued copy of the message.
+ * The message view is only valid until the callback returns.
  */
 
 /**
- * ON_RAW_MESSAGE
- * When a full standard alarm state message is received before it is parsed.
- * WARNING: It may be invalid.
+ * Debug log of keypad messages and LRR messages.
+ * WARNING: LRR messages may be invalid.
  */
-void my_ON_RAW_MESSAGE_CB(String *msg, AD2VirtualPartitionState *s) {
-  Serial.printf("!DBG:ON_RAW_MESSAGE_CB: '%s'\r\n", msg->c_str());
+void my_LOG_SUB(void *ctx, uint8_t event, const AD2MessageView *msg, AD2VirtualPartitionState *s) {
+  Serial.printf("!DBG:AD2EMB,EV(%u) '%s'\r\n", event, msg->data);
 }
 
+#if defined(EN_HTTP) || defined(EN_HTTPS)
 /**
- * ON_MESSAGE
- * When a full standard alarm state message is received before it is parsed.
- * WARNING: It may be invalid.
+ * ON_MESSAGE to every ws client.
+ * ctx: the activeWSClients table.
+ * Identical repeats of the last message are not passed on so the ws
+ * clients only get an update when the keypad message changes.
  */
-void my_ON_MESSAGE_CB(String *msg, AD2VirtualPartitionState *s) {
-  Serial.printf("!DBG:ON_MESSAGE_CB: '%s'\r\n", msg->c_str());
-  // catpure the current state as json string
-  std::string json;
-  jsonAD2VirtualPartitionState(s, json);
+void my_WS_SUB(void *ctx, uint8_t event, const AD2MessageView *msg, AD2VirtualPartitionState *s) {
+  WSClientHandler **clients = (WSClientHandler **)ctx;
 
-#if defined(EN_HTTP) || defined(EN_HTTPS)
-  // Send updated state to every ws client
+  // The same serialized state goes to every client.
+  ad2_snapshot_t *snap = ad2Snapshot(s);
+  if (!snap) {
+    return;
+  }
+
+  // Queue the update for every ws client. wsFlush() sends it.
   for(int i = 0; i < HTTP_MAX_WS_CLIENTS; i++) {
-    if (activeWSClients[i] != nullptr) {
-      Serial.printf("!DBG:Send to WS %i\r\n",activeWSClients[i]);
-      // Send json string to the client
-      activeWSClients[i]->send(json, 0x02);
+    if (clients[i] != nullptr) {
+      clients[i]->queue(WS_OUT_STATE, snap - ad2Snapshots);
     }
   }
-#endif
 }
+#endif
 
+#if defined(EN_MQTT_CLIENT)
 /**
- * ON_LRR
- * When a LRR message is received.
- * WARNING: It may be invalid.
+ * Partition state changes and LRR messages to MQTT.
+ * ctx: the PubSubClient.
+ * State changes are called once per real change and not for every keypad
+ * refresh from the panel.
+ * WARNING: LRR messages may be invalid.
  */
-void my_ON_LRR_CB(String *msg, AD2VirtualPartitionState *s) {
-#if defined(EN_MQTT_CLIENT)
-  String pubtopic = mqtt_root + MQTT_LRR_PUB_TOPIC;
-  if (!mqttClient.publish(pubtopic.c_str(), msg->c_str())) {
-    Serial.printf("!DBG:AD2EMB,MQTT publish LRR fail rc(%i)\r\n", mqttClient.state());
-  } else {
-    Serial.printf("!DBG:AD2EMB,MQTT publish LRR success\r\n");    
+void my_MQTT_SUB(void *ctx, uint8_t event, const AD2MessageView *msg, AD2VirtualPartitionState *s) {
+  PubSubClient *client = (PubSubClient *)ctx;
+
+  if (event == AD2_EV_LRR) {
+    String pubtopic = mqtt_root + MQTT_LRR_PUB_TOPIC;
+    if (!client->publish(pubtopic.c_str(), msg->data)) {
+      Serial.printf("!DBG:AD2EMB,MQTT publish LRR fail rc(%i)\r\n", client->state());
+    } else {
+      Serial.printf("!DBG:AD2EMB,MQTT publish LRR success\r\n");
+    }
+    return;
+  }
+
+  // Publish the shared json snapshot
+  ad2_snapshot_t *snap = ad2Snapshot(s);
+  if (!snap) {
+    return;
+  }
+  String pubtopic = mqtt_root + MQTT_KPM_PUB_TOPIC;
+  if (!client->publish(pubtopic.c_str(), (const uint8_t *)snap->json, snap->len)) {
+    Serial.printf("!DBG:AD2EMB,MQTT publish KPM fail rc(%i)\r\n", client->state());
   }
-#endif
-  Serial.println(*msg);
 }
+#endif
@@ -39,6 +39,46 @@ IPAddress dhcp_fail_gw(169,254,0,1);
 #define AD2_UART
 //#define AD2_SOCK
 
+/**
+ * AlarmDecoder receive buffer size.
+ * The ESP32 uart driver rx buffer is set to the same size so a full
+ * driver buffer can be drained and parsed in a single put().
+ */
+#define AD2_RX_BUFFER_SIZE 2048
+
+/**
+ * AD2_SOCK flow control.
+ * Each ad2Loop() reads at most AD2_SOCK_BUDGET bytes from the socket.
+ * While a backlog remains, as after a reconnect, the budget doubles each
+ * pass up to AD2_SOCK_BUDGET_MAX and drops back once the socket is
+ * drained. Reads pause while the parser queue is half full so the data
+ * waits in TCP instead of being merged or dropped. A failed connect is
+ * retried after AD2_SOCK_RETRY_MS doubling up to AD2_SOCK_RETRY_MAX_MS.
+ */
+#define AD2_SOCK_BUDGET 512
+#define AD2_SOCK_BUDGET_MAX (4 * AD2_RX_BUFFER_SIZE)
+#define AD2_SOCK_RETRY_MS 1000
+#define AD2_SOCK_RETRY_MAX_MS 30000
+
+/**
+ * Capture the raw AD2* stream to SPIFFS for replay on a host with
+ * tests/host/ad2replay. Each read is stored with the time since the
+ * previous read. Capture stops when the file reaches AD2_CAPTURE_MAX_SIZE.
+ */
+//#define AD2_CAPTURE_FILE "/capture.ad2"
+#define AD2_CAPTURE_MAX_SIZE (256 * 1024)
+
+/**
+ * Read and parse the AD2* in its own task pinned to this core so a slow
+ * network call in loop() can not stall ingest. Decoded messages are
+ * handed to loop() through a lock free ring of AD2_TASK_QUEUE_SIZE
+ * records(power of 2). Comment out AD2_TASK_CORE to read and parse from
+ * loop() instead. loop() runs on core 1.
+ */
+#define AD2_TASK_CORE 0
+#define AD2_TASK_QUEUE_SIZE 16
+#define AD2_TASK_STACK_SIZE 4096
+
 /**
  * Base embedded hardware setup
  * FIXME: needs design work.
@@ -104,6 +144,7 @@ IPAddress dhcp_fail_gw(169,254,0,1);
 #define MQTT_CMD_SUB_TOPIC  "CONTROL/CMD"   // Subscribe for remote control. Arm/Disarm, Compass, configuration, etc.
 // output topics
 #define MQTT_PING_PUB_TOPIC  "EVENT/PING"   // Client sends a PING event with ID to notify subscriber(admin) the client is alive.
+#define MQTT_STATS_PUB_TOPIC "EVENT/STATS"  // Parser counters for the last PING interval published with each PING.
 #define MQTT_LRR_PUB_TOPIC   "STREAM/LRR"   // LRR message topic
 #define MQTT_KPM_PUB_TOPIC   "STREAM/KPM"   // Keypad message and state bits topic "Armed ready to arm etc"
 #define MQTT_AUI_PUB_TOPIC   "STREAM/AUI"   // AUI message topic
@@ -121,6 +162,22 @@ IPAddress dhcp_fail_gw(169,254,0,1);
 #define HTTPS_PORT 443
 #define HTTP_API_BASE "/api/alarmdecoder"
 #define HTTP_MAX_WS_CLIENTS 4
+// Messages waiting per ws client. State updates of a partition take one
+// entry and later updates replace it.
+#define HTTP_WS_QUEUE_SIZE 8
+// Messages sent to each ws client per loop.
+#define HTTP_WS_SEND_BUDGET 2
+// A ws send that blocks this long means the client is not reading. Sends
+// still block. Only with AD2_TASK_CORE does a stalled client not hold up
+// reading and parsing the AD2*. Without it ingest waits on every stalled
+// send, once per HTTP_WS_STALL_BACKOFF_MS per client.
+#define HTTP_WS_STALL_MS 50
+// No sends to a stalled ws client for this long.
+#define HTTP_WS_STALL_BACKOFF_MS 1000
+// Close a ws client whose sends keep blocking this long.
+#define HTTP_WS_SLOW_TIMEOUT_MS 10000
+// Close a ws client whose queue stays full or keeps dropping this long.
+#define HTTP_WS_FULL_TIMEOUT_MS 10000
 #endif // EN_HTTP || EN_HTTPS
 
 /**
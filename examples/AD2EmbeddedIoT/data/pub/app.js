@@ -58,6 +58,50 @@ var panel_states =  {
 panel_states.get = function(key) {
   return (panel_states[key] ? panel_states[key] : panel_states["unknown"]);
 }
+/* AD2_FLAG_* bit of each state field in a binary state record. */
+const state_flags = {
+  "ready": 0, "armed_away": 1, "armed_home": 2, "backlight_on": 3,
+  "programming_mode": 4, "zone_bypassed": 6, "ac_power": 7, "chime_on": 8,
+  "alarm_event_occured": 9, "alarm_sounding": 10, "battery_low": 11,
+  "entry_delay_off": 12, "fire_alarm": 13, "system_issue": 14,
+  "perimeter_only": 15, "system_specific": 16, "exit_now": 20
+};
+
+/* decode a binary state record(AD2_STATE_RECORD_SIZE) into the same
+   fields as the JSON state. returns null if it is not a record. */
+function decodeState(buf) {
+  if (buf.byteLength < 88)
+    return null;
+  var dv = new DataView(buf);
+  if (dv.getUint8(0) != 1)
+    return null;
+  var flags = dv.getUint32(12, true);
+  var mask = dv.getUint32(8, true);
+  var state = {
+    "partition": dv.getUint8(1),
+    "last_numeric_message": dv.getUint16(2, true),
+    "version": dv.getUint32(4, true),
+    "address_mask_filter": "",
+    "display_cursor_type": dv.getUint8(16),
+    "display_cursor_location": dv.getUint8(17),
+    "beeps": String.fromCharCode(dv.getUint8(18)),
+    "panel_type": String.fromCharCode(dv.getUint8(19)),
+    "last_alpha_message": "",
+    "zones_faulted": []
+  };
+  for (var i = 0; i < 32; i++)
+    state.address_mask_filter += (mask >>> i) & 1 ? "1" : "0";
+  for (var key in state_flags)
+    state[key] = ((flags >>> state_flags[key]) & 1) == 1;
+  for (var i = 24; i < 56 && dv.getUint8(i); i++)
+    state.last_alpha_message += String.fromCharCode(dv.getUint8(i));
+  for (var z = 1; z < 256; z++) {
+    if ((dv.getUint32(56 + (z >> 5) * 4, true) >>> (z & 31)) & 1)
+      state.zones_faulted.push(z);
+  }
+  return state;
+}
+
 const elem = id => document.getElementById(id);
 const divOut = elem("divOut");
 
@@ -91,6 +135,11 @@ class AD2ws {
       this.connected = false;
       this.ws = null;
       this.ad2emb_state = null;
+      /* binary state records instead of JSON deltas. open the page
+         with ?bin to use them. */
+      this.binary = new URLSearchParams(document.location.search).has("bin");
+      /* full state of each partition seen, by partition number */
+      this.partitions = {};
       this.mode = "unknown";
   }
 
@@ -135,6 +184,7 @@ class AD2ws {
           divOut.innerHTML = "<p>Connecting.</p>";
           this.connecting = true;
           this.ws = new WebSocket("ws://" + document.location.host + "/ad2ws");
+          this.ws.binaryType = "arraybuffer";
 
           /* FIXME: need send request for update on state */
           this.ws.onopen = e => {
@@ -143,14 +193,43 @@ class AD2ws {
               this.connected = true;
               divOut.innerHTML = "<p>Connected.</p>";
 
+              /* versions restart if the device restarted. */
+              this.partitions = {};
+
+              /* binary state records or only changed fields after the
+                 first full state. */
+              this.wsSendMessage(this.binary ? "!BIN:1" : "!DELTA:1");
+
               /* request the current AD2EMB AlarmDecoder state. */
               this.wsSendMessage("!SYNC:"+this.addressMask);
           };
           /* FIXME: needs more cow bell */
           this.ws.onmessage = e => {
               this.debug.trace("onmessage. '" + e.data + "'");
+              if (e.data instanceof ArrayBuffer) {
+                var state = decodeState(e.data);
+                if (state) {
+                  this.partitions[state.partition] = state;
+                  this.ad2emb_state = state;
+                }
+              } else
               if (e.data[0] == "{") {
-                this.ad2emb_state = JSON.parse(e.data);
+                var msg = JSON.parse(e.data);
+                var state = this.partitions[msg.partition];
+                if (msg.delta) {
+                  /* a delta only applies to the version right before it.
+                     on a gap ask for the full state of the partition. */
+                  if (!state || msg.version != state.version + 1) {
+                    this.debug.info("version gap on partition " + msg.partition);
+                    this.wsSendMessage("!SYNC:P" + msg.partition);
+                    return;
+                  }
+                  delete msg.delta;
+                  Object.assign(state, msg);
+                } else {
+                  state = this.partitions[msg.partition] = msg;
+                }
+                this.ad2emb_state = state;
               }
               if (e.data[0] == "!") {
                 // !PONG:0000000
@@ -23,14 +23,139 @@
  */
 
 #include "ArduinoAlarmDecoder.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Known '!' message types by AD2_TAG_SLOT(). Each tag must hash to its own
+// slot. Pick a new AD2_TAG_HASH_MUL if a new tag collides.
+struct AD2TagEntry {
+  uint32_t tag;
+  uint8_t type;
+};
+static const AD2TagEntry ad2_tag_table[16] = {
+  { 0, AD2_MSG_UNKNOWN },
+  { AD2_TAG('C','O','N','F'), AD2_MSG_CONFIG },
+  { 0, AD2_MSG_UNKNOWN },
+  { AD2_TAG('A','U','I',':'), AD2_MSG_AUI },
+  { AD2_TAG('S','e','n','d'), AD2_MSG_SENDING },
+  { AD2_TAG('L','R','R',':'), AD2_MSG_LRR },
+  { AD2_TAG('R','E','L',':'), AD2_MSG_REL },
+  { AD2_TAG('E','X','P',':'), AD2_MSG_EXP },
+  { AD2_TAG('V','E','R',':'), AD2_MSG_VER },
+  { 0, AD2_MSG_UNKNOWN },
+  { AD2_TAG('E','R','R',':'), AD2_MSG_ERR },
+  { 0, AD2_MSG_UNKNOWN },
+  { AD2_TAG('C','R','C',':'), AD2_MSG_CRC },
+  { AD2_TAG('K','P','M',':'), AD2_MSG_KPM },
+  { AD2_TAG('R','F','X',':'), AD2_MSG_RFX },
+  { AD2_TAG('K','P','E',':'), AD2_MSG_KPE }
+};
+static_assert(AD2_TAG_SLOT(AD2_TAG('C','O','N','F')) == 1, "tag slot");
+static_assert(AD2_TAG_SLOT(AD2_TAG('A','U','I',':')) == 3, "tag slot");
+static_assert(AD2_TAG_SLOT(AD2_TAG('S','e','n','d')) == 4, "tag slot");
+static_assert(AD2_TAG_SLOT(AD2_TAG('L','R','R',':')) == 5, "tag slot");
+static_assert(AD2_TAG_SLOT(AD2_TAG('R','E','L',':')) == 6, "tag slot");
+static_assert(AD2_TAG_SLOT(AD2_TAG('E','X','P',':')) == 7, "tag slot");
+static_assert(AD2_TAG_SLOT(AD2_TAG('V','E','R',':')) == 8, "tag slot");
+static_assert(AD2_TAG_SLOT(AD2_TAG('E','R','R',':')) == 10, "tag slot");
+static_assert(AD2_TAG_SLOT(AD2_TAG('C','R','C',':')) == 12, "tag slot");
+static_assert(AD2_TAG_SLOT(AD2_TAG('K','P','M',':')) == 13, "tag slot");
+static_assert(AD2_TAG_SLOT(AD2_TAG('R','F','X',':')) == 14, "tag slot");
+static_assert(AD2_TAG_SLOT(AD2_TAG('K','P','E',':')) == 15, "tag slot");
+
+// The runtime callback and queue parsers.
+template class AD2Parser<AlarmDecoderParser>;
+template class AD2Parser<AD2QueueParser>;
+
+
+AD2ParserCore::AD2ParserCore() {
+
+  // Empty line buffer and error counters.
+  line_len = 0;
+  line_buffer[0] = 0;
+  line_view.data = line_buffer;
+  line_view.len = 0;
+
+  // Zero all counters.
+  resetStats();
+  line_seq = 0;
+
+  // No application prefix handlers.
+  prefix_handler_count = 0;
+
+  // All zone timers free and the timer wheel empty.
+  for (uint8_t i = 0; i < AD2_MAX_ZONE_FAULTS; i++) {
+    zone_timers[i].next = i + 1 < AD2_MAX_ZONE_FAULTS ? i + 1 : 0xff;
+    zone_timers[i].zone = 0;
+  }
+  zone_timer_free = 0;
+  memset(zone_wheel, 0xff, sizeof(zone_wheel));
+  zone_wheel_tick = 0;
+  zone_wheel_ms = 0;
+
+  // No partitions yet. Slot 0 is kept for the system partition.
+  AD2PStates_count = 1;
+  AD2PStates_system = nullptr;
+  memset(AD2PStates_by_bit, 0, sizeof(AD2PStates_by_bit));
+
+#if AD2_TRACE_SIZE
+  // Empty trace ring.
+  trace_count = 0;
+#endif
+
+  // Repeated keypad messages are not dispatched by default.
+  notify_repeats = false;
 
+  // Reset the parser on init.
+  reset_parser();
 
+}
 
 AlarmDecoderParser::AlarmDecoderParser() {
 
   // clear all callback pointers.
+  ON_RAW_MESSAGE_VCB = 0;
+  ON_ARM_VCB = 0;
+  ON_DISARM_VCB = 0;
+  ON_POWER_CHANGE_VCB = 0;
+  ON_READY_CHANGE_VCB = 0;
+  ON_ALARM_VCB = 0;
+  ON_ALARM_RESTORED_VCB = 0;
+  ON_FIRE_VCB = 0;
+  ON_BYPASS_VCB = 0;
+  ON_BOOT_VCB = 0;
+  ON_CONFIG_RECEIVED_VCB = 0;
+  ON_ZONE_FAULT_VCB = 0;
+  ON_ZONE_RESTORE_VCB = 0;
+  ON_LOW_BATTERY_VCB = 0;
+  ON_PANIC_VCB = 0;
+  ON_RELAY_CHANGED_VCB = 0;
+  ON_CHIME_CHANGED_VCB = 0;
+  ON_MESSAGE_VCB = 0;
+  ON_EXPANDER_MESSAGE_VCB = 0;
+  ON_LRR_VCB = 0;
+  ON_RFX_VCB = 0;
+  ON_SENDING_RECEIVED_VCB = 0;
+  ON_AUI_VCB = 0;
+  ON_KPM_VCB = 0;
+  ON_KPE_VCB = 0;
+  ON_CRC_VCB = 0;
+  ON_VER_VCB = 0;
+  ON_ERR_VCB = 0;
+  ON_EXPANDER_MESSAGE_TCB = 0;
+  ON_RELAY_CHANGED_TCB = 0;
+  ON_LRR_TCB = 0;
+  ON_RFX_TCB = 0;
+  ON_AUI_TCB = 0;
+  ON_KPE_TCB = 0;
+  ON_CRC_TCB = 0;
+  ON_VER_TCB = 0;
+  ON_ERR_TCB = 0;
+  ON_ZONE_FAULT_TCB = 0;
+  ON_ZONE_RESTORE_TCB = 0;
+#if AD2_STRING_CALLBACKS
   ON_RAW_MESSAGE_CB = 0;
-  ON_MESSAGE_CB = 0;
   ON_ARM_CB = 0;
   ON_DISARM_CB = 0;
   ON_POWER_CHANGE_CB = 0;
@@ -58,74 +183,116 @@ AlarmDecoderParser::AlarmDecoderParser() {
   ON_CRC_CB = 0;
   ON_VER_CB = 0;
   ON_ERR_CB = 0;
+#endif
 
-  // Reset the parser on init.
-  reset_parser();
+#if AD2_STRING_CALLBACKS
+  compat_msg_seq = 0;
+#endif
 
+  // No subscribers and nothing in the event masks.
+  subscriber_count = 0;
+  event_mask = 0;
+  typed_event_mask = 0;
 }
 
-void AlarmDecoderParser::reset_parser() {
+void AD2ParserCore::reset_parser() {
   // Initialize parser state machine state.
   AD2_Parser_State = AD2_PARSER_RESET;
 }
 
+/**
+ * Copy the parser counters and optionally zero them.
+ */
+void AD2ParserCore::getStats(AD2ParserStats *out, bool reset) {
+  *out = stats;
+  if (reset) {
+    resetStats();
+  }
+}
+
+/**
+ * Zero the parser counters.
+ */
+void AD2ParserCore::resetStats() {
+  memset(&stats, 0, sizeof(stats));
+}
+
+/**
+ * Add a handler for an unknown '!' message prefix.
+ */
+bool AD2ParserCore::addPrefixHandler(const char *prefix, AD2ParserCallback_view_t cb) {
+  if (!prefix || !cb || prefix_handler_count >= AD2_MAX_PREFIX_HANDLERS) {
+    return false;
+  }
+  prefix_handlers[prefix_handler_count].prefix = prefix;
+  prefix_handlers[prefix_handler_count].len = strlen(prefix);
+  prefix_handlers[prefix_handler_count].cb = cb;
+  prefix_handler_count++;
+  return true;
+}
+
+/**
+ * Enable or disable ON_MESSAGE for repeated keypad messages.
+ */
+void AD2ParserCore::setNotifyRepeats(bool enable) {
+  notify_repeats = enable;
+}
+
 /**
  * return a partition state structure by 32bit keypad/partition mask.
+ *
+ * A partition is indexed by the lowest bit of its address mask so a
+ * lookup is a count trailing zeros and a table read. Masks with the same
+ * lowest bit share the partition and with update set their bits are added
+ * to its address mask filter. Partition states come from the
+ * preallocated AD2PStates. Returns nullptr if not found or out of
+ * storage.
+ *
+ * The partition number is the lowest address bit + 1 so it is the same
+ * whatever order messages arrive in. The system partition(mask 0) is 0.
  */
-AD2VirtualPartitionState * AlarmDecoderParser::getAD2PState(uint32_t *amask, bool update) {
+AD2VirtualPartitionState * AD2ParserCore::getAD2PState(uint32_t *amask, bool update) {
   // Create or return a pointer to our partition storage class.
-  AD2VirtualPartitionState *ad2ps = nullptr;
-
-  // look for an exact match.
-  if ( AD2PStates.find(*amask) == AD2PStates.end()) {
-
-    // Not found create or find a mask that has at least
-    // one bit in common and update its mask to include the new
-    // bits. System partition mask is 0 and will skip this logic.
-    if (*amask) {
-        uint32_t foundkey = *amask;
-        for (auto const& x : AD2PStates)
-        {
-          // Mask has matching bits use it instead.
-          if (x.first & *amask) {
-            ad2ps = AD2PStates[x.first];
-            foundkey = x.first;
-            break;
-          }
-        }
+  uint32_t mask = *amask;
+  uint8_t bit = mask ? AD2_CTZ(mask) : 0;
+  // System partition mask is 0 and has no bits to look up.
+  AD2VirtualPartitionState *ad2ps = mask ? AD2PStates_by_bit[bit] : AD2PStates_system;
 
-        // Not necessary but seems reasonable.
-        // Update key to include new mask if it changed.
-        if (foundkey != *amask && update) {
-          // remove the old map entry.
-          AD2PStates.erase(foundkey);
-          // Add new one with mask of original + new.
-          *amask |= foundkey;
-          AD2PStates[*amask] = ad2ps;
-        }
-    }
+  if (!update) {
+    return ad2ps;
+  }
 
-    // Did not find entry. Make new.
-    if (!ad2ps && update) {
-        ad2ps = AD2PStates[*amask] = new AD2VirtualPartitionState;
-        ad2ps->partition = AD2PStates.size();
+  // Did not find entry. Make new. Slot 0 is kept for the system
+  // partition.
+  if (!ad2ps) {
+    if (!mask) {
+      ad2ps = AD2PStates_system = &AD2PStates[0];
+    } else if (AD2PStates_count < AD2_MAX_PARTITIONS) {
+      ad2ps = AD2PStates_by_bit[bit] = &AD2PStates[AD2PStates_count++];
+    } else {
+      return nullptr;
     }
-
-  } else {
-    // Found. Grab the state class ptr.
-    ad2ps = AD2PStates[*amask];
+    *ad2ps = AD2VirtualPartitionState();
+    ad2ps->partition = mask ? bit + 1 : 0;
   }
+
+  ad2ps->address_mask_filter |= mask;
+  *amask = ad2ps->address_mask_filter;
+
   return ad2ps;
 }
 
 /**
- * Consume bytes from an AlarmDecoder stream into a small ring buffer
+ * Consume bytes from an AlarmDecoder stream into a fixed line buffer
  * for processing.
  *
- * 1) Parse all of the data firing off events upon parsing a full message.
- *   Continue parsing data until all is consumed.
+ * 1) Stop after each full message so AD2Parser<>::put() can process it.
+ *   Continue with the next call until all data is consumed.
+ * 2) Printable runs are found a word(or vector) at a time and copied into
+ *   the line buffer in one step. Only CR/LF and corrupt bytes are looked
+ *   at individually.
  */
-bool AlarmDecoderParser::put(uint8_t *buff, int8_t len) {
+bool AD2ParserCore::scan_line(const uint8_t *&bp, const uint8_t *end) {
 
   // All AlarmDecoder messages are '\n' terminated.
   // "!boot.....done" is the only state exists that needs notification
@@ -134,334 +301,1269 @@ bool AlarmDecoderParser::put(uint8_t *buff, int8_t len) {
   // If KPM config bit is not set(the default) then standard keypad state
   // messages start with '['.
 
-  int8_t bytes_left = len;
-  uint8_t *bp = buff;
-
-  // Sanity check.
-  if (len<=0) {
-     return false;
-  }
-
   // Consume all the bytes.
-  while (bytes_left>0) {
+  while (bp < end) {
 
     uint8_t ch;
+    size_t run;
 
     // Update state machine.
     switch (AD2_Parser_State) {
 
-      // Reset the ring buffer state.
+      // Reset the line buffer state.
       case AD2_PARSER_RESET:
 
-        ring_qin_position = 0;
-        ring_qout_position = 0;
-
-        // Initialize AlarmDecoder stream parsing ring buffer memory to 0s.
-        memset(ring_buffer, 0, sizeof(ring_buffer));
+        line_len = 0;
+        line_buffer[0] = 0;
         AD2_Parser_State = AD2_PARSER_SCANNING_START;
         break;
 
       // Wait for ALPHA/NUMERIC after an EOL
       case AD2_PARSER_SCANNING_START:
-        // store local.
-        ch = *bp;
 
-        // start scanning for EOL as soon as we have a printable character.
-        if (ch >31 && ch <127) {
-          AD2_Parser_State = AD2_PARSER_SCANNING_EOL;
-        } else {
-          // Dump the byte.
-          // Update remaining bytes counter and move ptr.
+        // Dump bytes until we have a printable character.
+        while (bp < end && (*bp < 32 || *bp > 126)) {
           bp++;
-          bytes_left--;
+        }
+
+        // start scanning for EOL.
+        if (bp < end) {
+          AD2_Parser_State = AD2_PARSER_SCANNING_EOL;
         }
         break;
 
       // Consume bytes looking for terminator.
       case AD2_PARSER_SCANNING_EOL:
-        // store local.
-        ch = *bp;
 
-        // Protection from external leaks or faults. Very unlikely to happen.
-        // Do not consume the byte and try again after a reset.
-        if (ring_qin_position > ALARMDECODER_MAX_MESSAGE_SIZE) {
+        // Take the whole printable run in one step.
+        run = ad2_printable_span(bp, end - bp);
+        if (run) {
+
+          // Message is longer than any valid message. Drop it and skip
+          // everything up to the next EOL.
+          if (run > (size_t)(ALARMDECODER_MAX_MESSAGE_SIZE - line_len)) {
+            stats.overflow++;
+            AD2_TRACE(AD2_TRACE_OVERFLOW, 0xff, line_len + run, 0);
+            AD2_Parser_State = AD2_PARSER_DISCARDING;
+            bp += run;
+            break;
+          }
 
-          // Next state is RESET.
-          AD2_Parser_State = AD2_PARSER_RESET;
+          // Still receiving a message.
+          // Save these bytes to our line buffer and keep waiting for EOL.
+          memcpy(&line_buffer[line_len], bp, run);
+          line_len += run;
+          bp += run;
+        }
 
-          // Done.
+        // Need more data.
+        if (bp == end) {
           break;
         }
 
+        // store local and consume the byte that stopped the run.
+        ch = *bp++;
+
+        // Process full messages on CR or LF
+        if ( ch == '\n' || ch == '\r') {
+
+          // Next wait for start of next message
+          AD2_Parser_State = AD2_PARSER_RESET;
+
+          // Do not save EOL into the buffer. Terminate and process.
+          line_buffer[line_len] = 0;
+          stats.lines++;
+          if (line_len > stats.max_line) {
+            stats.max_line = line_len;
+          }
+
+          // Ready to process.
+          return true;
+        }
+
         // Protect from corrupt data skip and reset.
         // All bytes must be CR/LF or printable characters only.
-        if (ch != '\r' && ch != '\n') {
-          if (ch <32 || ch >126) {
-
-            // Update remaining bytes counter and move ptr.
-            bp++;
-            bytes_left--;
+        AD2_Parser_State = AD2_PARSER_RESET;
+        stats.corrupt++;
+        AD2_TRACE(AD2_TRACE_CORRUPT, 0xff, line_len, ch);
+        break;
 
-            // Next state is RESET.
+      // Drop bytes until the end of an oversized message.
+      case AD2_PARSER_DISCARDING:
+        bp += ad2_printable_span(bp, end - bp);
+        if (bp < end) {
+          ch = *bp++;
+          if ( ch == '\n' || ch == '\r') {
             AD2_Parser_State = AD2_PARSER_RESET;
-
-            // Done.
-            break;
           }
         }
+        break;
 
-        // Update remaining bytes counter and move ptr.
-        bp++;
-        bytes_left--;
+      // Unknown state start over.
+      case AD2_PARSER_PROCESSING:
+      default:
+        AD2_Parser_State = AD2_PARSER_RESET;
+        break;
+    }
+  }
 
-        // Process full messages on CR or LF
-        if ( ch == '\n' || ch == '\r') {
+  return false;
+}
 
-          // Next wait for start of next message
-          AD2_Parser_State = AD2_PARSER_SCANNING_START;
-
-          // FIXME: Make it better faster less cpu mem etc. String :(
-          // Consume all of the data for this message from the ring buffer.
-          String msg = "";
-          while (ring_qout_position != ring_qin_position) {
-            msg += (char)ring_buffer[ring_qout_position];
-            // Reset to 0 at the end of the ring.
-            if ( ++ring_qout_position >= ALARMDECODER_MAX_MESSAGE_SIZE ) {
-              ring_qout_position = 0;
-            }
-          }
+/**
+ * Call the handler added with addPrefixHandler() for a '!' message that
+ * is not a known type.
+ */
+bool AD2ParserCore::dispatch_prefix(const char *msg, uint16_t len) {
+  for (uint8_t i = 0; i < prefix_handler_count; i++) {
+    if (len >= prefix_handlers[i].len &&
+        !strncmp(msg, prefix_handlers[i].prefix, prefix_handlers[i].len)) {
+      AD2_TRACE(AD2_TRACE_PREFIX, i, len, 0);
+      prefix_handlers[i].cb(&line_view, nullptr);
+      return true;
+    }
+  }
+  return false;
+}
 
-          // call ON_RAW_MESSAGE callback if enabled.
-          if (ON_RAW_MESSAGE_CB) {
-            ON_RAW_MESSAGE_CB(&msg, nullptr);
-          }
+/**
+ * Decode a keypad message and update the partition state it belongs to.
+ *
+ * Returns AD2_KEYPAD_REPEAT with the partition for a repeat of its last
+ * message, AD2_KEYPAD_NEW with the partition and its previous flags for a
+ * new message or AD2_KEYPAD_DROP if the message could not be used.
+ */
+uint8_t AD2ParserCore::update_keypad(const char *msg, uint16_t len, AD2KeypadMessage *km,
+                                     AD2VirtualPartitionState **ps, uint32_t *prev_flags) {
+
+  // Panels send the same keypad message over and over. If this message
+  // is identical to the last one for its partition only note that it
+  // was seen again and skip decoding and dispatch. The hash rules out
+  // most changes and the compare confirms a match.
+  uint32_t hash = ad2_hash(msg, len);
+  if (len == KEYPAD_MESSAGE_SIZE) {
+    uint32_t rmask = AD2_NTOHL(ad2_parse_hex(&msg[AMASK_START], AMASK_END - AMASK_START));
+    AD2VirtualPartitionState *rps = getAD2PState(&rmask);
+    if (rps && (rps->flags & AD2_FLAG_VALID) && rps->message_hash == hash &&
+        !memcmp(last_keypad[rps - AD2PStates], msg, KEYPAD_MESSAGE_SIZE)) {
+      rps->last_seen = millis();
+      rps->repeat_count++;
+      stats.repeats++;
+      AD2_TRACE(AD2_TRACE_REPEAT, rps->partition, len, rps->flags);
+      *ps = rps;
+      return AD2_KEYPAD_REPEAT;
+    }
+  }
 
-          // Detect message type or error.
-          // 1) Starts with !
-          //     !boot, !EXP, !REL, etc, etc.
-          // 2) Starts with [
-          //    Standard status message.
-          // All other cases are invalid
-          //
-          if (msg[0] == '!') {
-            if (msg.startsWith("!LRR:")) {
-              // call ON_LRR callback if enabled.
-              if (ON_LRR_CB) {
-                ON_LRR_CB(&msg, nullptr);
-              }
-            } else
-            if (msg.startsWith("!REL:") || msg.startsWith("!EXP:")) {
-              // call ON_EXPANDER_MESSAGE callback if enabled.
-              if (ON_EXPANDER_MESSAGE_CB) {
-                ON_EXPANDER_MESSAGE_CB(&msg, nullptr);
-              }
-            } else
-            if (msg.startsWith("!RFX:")) {
-              // call ON_RFX callback if enabled.
-              if (ON_RFX_CB) {
-                ON_RFX_CB(&msg, nullptr);
-              }
-            } else
-            if (msg.startsWith("!AUI:")) {
-              // call ON_AUI callback if enabled.
-              if (ON_AUI_CB) {
-                ON_AUI_CB(&msg, nullptr);
-              }
-            } else
-            if (msg.startsWith("!KPM:")) {
-              // FIXME: move parser below to function so it can be called here.
-              // call ON_KPM callback if enabled.
-              if (ON_KPM_CB) {
-                ON_KPM_CB(&msg, nullptr);
-              }
-            } else
-            if (msg.startsWith("!KPE:")) {
-              // call ON_KPE callback if enabled.
-              if (ON_KPE_CB) {
-                ON_KPE_CB(&msg, nullptr);
-              }
-            } else
-            if (msg.startsWith("!CRC:")) {
-              // call ON_CRC callback if enabled.
-              if (ON_CRC_CB) {
-                ON_CRC_CB(&msg, nullptr);
-              }
-            } else
-            if (msg.startsWith("!VER:")) {
-              // Parse the version string.
-              // call ON_VER callback if enabled.
-              if (ON_VER_CB) {
-                ON_VER_CB(&msg, nullptr);
-              }
-            } else
-            if (msg.startsWith("!ERR:")) {
-              // call ON_ERR callback if enabled.
-              if (ON_ERR_CB) {
-                ON_ERR_CB(&msg, nullptr);
-              }
-            }
-          } else {
-            // http://www.alarmdecoder.com/wiki/index.php/Protocol#Keypad
-            if (msg[0] == '[') {
-
-              // Excessive sanity check. Test a few static characters.
-              // Length should be 94 bytes and end with ".
-              // [00110011000000003A--],010,[f70700000010808c18020000000000],"ARMED ***STAY** ZONE BYPASSED "
-              if (msg.length() == 94 && msg[93]=='"' && msg[22] == ',') {
-
-                // First extract the 32 bit address mask from section #3
-                // to use it as a storage key for the state.
-                uint32_t amask = strtol(msg.substring(AMASK_START,
-                                        AMASK_END).c_str(), nullptr, 16);
-
-                amask = AD2_NTOHL(amask);
-                // Ademco/DSC: MASK 00000000 = System
-                // Ademco 00000001 is keypad address 0
-                // Ademco 00000002 is keypad address 1
-                // DSC    00000002 is partition 1
-                // Ademco 40000000 is keypad address 30
-
-                // Create or return a pointer to our partition storage class.
-                AD2VirtualPartitionState *ad2ps = getAD2PState(&amask, true);
-
-                // we should not need to test the validity of ad2ps with update=true
-                // the function will return a value.
-
-                // store key internal for easy use.
-                ad2ps->address_mask_filter = amask;
-
-                // Update the partition state based upon the new status message.
-                // FIXME: Next.
-
-                // Extract state bits from section #1
-                ad2ps->ready = is_bit_set(READY_BYTE, msg.c_str());
-                ad2ps->armed_away = is_bit_set(ARMED_AWAY_BYTE, msg.c_str());
-                ad2ps->armed_home = is_bit_set(ARMED_HOME_BYTE, msg.c_str());
-                ad2ps->backlight_on  = is_bit_set(BACKLIGHT_BYTE, msg.c_str());
-                ad2ps->programming_mode = is_bit_set(PROGMODE_BYTE, msg.c_str());
-                ad2ps->zone_bypassed = is_bit_set(BYPASS_BYTE, msg.c_str());
-                ad2ps->ac_power = is_bit_set(ACPOWER_BYTE, msg.c_str());
-                ad2ps->chime_on = is_bit_set(CHIME_BYTE, msg.c_str());
-                ad2ps->alarm_event_occurred = is_bit_set(ALARMSTICKY_BYTE, msg.c_str());
-                ad2ps->alarm_sounding = is_bit_set(ALARM_BYTE, msg.c_str());
-                ad2ps->battery_low = is_bit_set(LOWBATTERY_BYTE, msg.c_str());
-                ad2ps->entry_delay_off = is_bit_set(ENTRYDELAY_BYTE, msg.c_str());
-                ad2ps->fire_alarm = is_bit_set(FIRE_BYTE, msg.c_str());
-                ad2ps->system_issue = is_bit_set(SYSISSUE_BYTE, msg.c_str());
-                ad2ps->perimeter_only = is_bit_set(PERIMETERONLY_BYTE, msg.c_str());
-                ad2ps->system_specific = is_bit_set(SYSSPECIFIC_BYTE, msg.c_str());
-                ad2ps->beeps = msg[BEEPMODE_BYTE];
-                ad2ps->panel_type = msg[PANEL_TYPE_BYTE];
-
-                // Extract the numeric value from section #2
-                ad2ps->last_numeric_message = strtol(msg.substring(SECTION_2_START, SECTION_2_START+3).c_str(), 0, 10);
-
-                // Extract the 32 char Alpha message from section #4.
-                ad2ps->last_alpha_message = msg.substring(SECTION_4_START, SECTION_4_START+32);
-
-                // Extract the cursor location and type from section #3
-                ad2ps->display_cursor_type = (uint8_t) strtol(msg.substring(CURSOR_TYPE_POS, CURSOR_TYPE_POS+2).c_str(), 0, 16);
-                ad2ps->display_cursor_location = (uint8_t) strtol(msg.substring(CURSOR_POS, CURSOR_POS+2).c_str(), 0, 16);
-
-                // look at messages for specific some states.
-                // FIXME: Multi language support
-                // FIXME: system messages need to be tested. They should go into
-                // partition 0 but it needs to be tested.
-                ad2ps->exit_now = false;
-                if (ad2ps->panel_type == 'A') { // Ademco Vista
-                  if(ad2ps->last_alpha_message.indexOf("may exit now") >= 0) {
-                    ad2ps->exit_now = true;
-                  }
-                } else
-                if (ad2ps->panel_type == 'D') { // DSC Power Series
-                  if(ad2ps->last_alpha_message.indexOf("quick exit") >= 0 ||
-                     ad2ps->last_alpha_message.indexOf("exit delay") >= 0)
-                  {
-                    ad2ps->exit_now = true;
-                  }
-                }
-
-                // FIXME: debugging / testing
-                Serial.print("!DBG: SIZE(");
-                Serial.print(AD2PStates.size());
-                Serial.print(") PID(");
-                Serial.print(ad2ps->partition);
-                Serial.print(") MASK(");
-                Serial.print(amask,BIN);
-                Serial.print(") Ready(");
-                Serial.print(ad2ps->ready);
-                Serial.print(") Armed Away(");
-                Serial.print(ad2ps->armed_away);
-                Serial.print(") Armed Home(");
-                Serial.print(ad2ps->armed_home);
-                Serial.print(") Bypassed(");
-                Serial.print(ad2ps->zone_bypassed);
-                Serial.println(")");
-
-                // call ON_MESSAGE callback if enabled.
-                if (ON_MESSAGE_CB) {
-                  ON_MESSAGE_CB(&msg, ad2ps);
-                }
-              }
-            } else {
-              //FIXME: Error
-              Serial.println("!ERR: BAD PROTOCOL PREFIX.");
-            }
-          }
+  // Decode all fields in one pass. Drop anything that is not a
+  // well formed keypad message.
+  if (!ad2_decode_keypad(msg, len, km)) {
+    stats.length_rejects++;
+    AD2_LOGW("BAD KEYPAD MESSAGE LENGTH(%u)", len);
+    AD2_TRACE(AD2_TRACE_BAD_KEYPAD, 0xff, len, 0);
+    return AD2_KEYPAD_DROP;
+  }
 
+  uint32_t amask = km->address_mask;
+  // Ademco/DSC: MASK 00000000 = System
+  // Ademco 00000001 is keypad address 0
+  // Ademco 00000002 is keypad address 1
+  // DSC    00000002 is partition 1
+  // Ademco 40000000 is keypad address 30
 
-          // Do not save EOL into the ring. We are done for now.
-          break;
-        }
+  // Create or return a pointer to our partition storage class.
+  AD2VirtualPartitionState *ad2ps = getAD2PState(&amask, true);
+
+  // No storage left for a new partition.
+  if (!ad2ps) {
+    stats.drops++;
+    AD2_LOGW("NO PARTITION STORAGE MASK(%08x)", (unsigned)amask);
+    AD2_TRACE(AD2_TRACE_NO_PARTITION, 0xff, len, amask);
+    return AD2_KEYPAD_DROP;
+  }
 
-        // Still receiving a message.
-        // Save this byte to our ring buffer and parse and keep waiting for EOL.
-        ring_buffer[ring_qin_position] = ch;
+  // store key internal for easy use.
+  ad2ps->address_mask_filter = amask;
+  stats.keypad++;
+
+  // Remember this message to detect repeats.
+  // Decoded messages are always KEYPAD_MESSAGE_SIZE.
+  ad2ps->message_hash = hash;
+  memcpy(last_keypad[ad2ps - AD2PStates], msg, KEYPAD_MESSAGE_SIZE);
+  ad2ps->last_seen = millis();
+  ad2ps->repeat_count = 0;
+
+  // Update the partition state based upon the new status message.
+
+  // Keep the previous bits to detect transitions.
+  *prev_flags = ad2ps->flags;
+
+  // State bits from section #1
+  ad2ps->flags = km->flags | AD2_FLAG_VALID;
+  ad2ps->beeps = km->beeps;
+  ad2ps->panel_type = km->panel_type;
+
+  // Numeric data from section #2.
+  ad2ps->last_numeric_message = km->numeric;
+
+  // Copy the 32 char Alpha message from section #4.
+  memcpy(ad2ps->last_alpha_message, km->alpha, ALPHA_SIZE);
+  ad2ps->last_alpha_message[ALPHA_SIZE] = 0;
+
+  // Cursor location and type from section #3
+  ad2ps->display_cursor_type = km->cursor_type;
+  ad2ps->display_cursor_location = km->cursor_location;
+
+  // look at messages for specific some states.
+  // FIXME: Multi language support
+  // FIXME: system messages need to be tested. They should go into
+  // partition 0 but it needs to be tested.
+  bool exit_now = false;
+  if (ad2ps->panel_type == 'A') { // Ademco Vista
+    if(strstr(ad2ps->last_alpha_message, "may exit now")) {
+      exit_now = true;
+    }
+  } else
+  if (ad2ps->panel_type == 'D') { // DSC Power Series
+    if(strstr(ad2ps->last_alpha_message, "quick exit") ||
+       strstr(ad2ps->last_alpha_message, "exit delay"))
+    {
+      exit_now = true;
+    }
+  }
+  ad2ps->setFlag(AD2_FLAG_EXIT_NOW, exit_now);
 
-        // Reset to 0 at the end of the ring
-        if ( ++ring_qin_position >= ALARMDECODER_MAX_MESSAGE_SIZE ) {
-          ring_qin_position = 0;
-        }
+  *ps = ad2ps;
+  return AD2_KEYPAD_NEW;
+}
 
-        // If next qin address is qout then loose a byte and report error.
-        if (ring_qin_position == ring_qout_position) {
-          ring_error_count++;
-          if ( ++ring_qout_position >= ALARMDECODER_MAX_MESSAGE_SIZE ) {
-            ring_qout_position = 0;
-          }
-        }
+/**
+ * Mark a zone faulted and start its restore timeout. If it is already
+ * faulted only push back the timeout and return false.
+ */
+bool AD2ParserCore::zone_set_fault(AD2VirtualPartitionState *s, uint8_t zone) {
+  uint8_t pidx = s - AD2PStates;
+  uint8_t t;
+  bool added = !s->isZoneFaulted(zone);
+
+  if (added) {
+    s->zone_faults[zone >> 5] |= 1UL << (zone & 31);
+    s->zone_fault_count++;
+  } else {
+    t = zone_timer_find(pidx, zone);
+    if (t != 0xff) {
+      zone_timer_unlink(t);
+      zone_timers[t].expire = zone_wheel_tick + (AD2_ZONE_TIMEOUT_MS + AD2_ZONE_TICK_MS - 1) / AD2_ZONE_TICK_MS;
+      zone_timer_link(t);
+      return false;
+    }
+  }
 
-        break;
+  // Start the restore timeout. A zone that faulted while no timer was
+  // free gets one when it is shown again. Until then it is only restored
+  // by the display cycle or READY.
+  t = zone_timer_free;
+  if (t != 0xff) {
+    zone_timer_free = zone_timers[t].next;
+    zone_timers[t].partition = pidx;
+    zone_timers[t].zone = zone;
+    zone_timers[t].expire = zone_wheel_tick + (AD2_ZONE_TIMEOUT_MS + AD2_ZONE_TICK_MS - 1) / AD2_ZONE_TICK_MS;
+    zone_timer_link(t);
+  } else if (added) {
+    AD2_LOGW("NO ZONE TIMER PID(%u) ZONE(%u)", s->partition, zone);
+  }
 
-      case AD2_PARSER_PROCESSING:
-        // FIXME: TBD
-        break;
+  return added;
+}
 
-      default:
-        // FIXME: TBD
-        break;
+/**
+ * Clear a zone fault and stop its timeout. Returns false if the zone was
+ * not faulted.
+ */
+bool AD2ParserCore::zone_clear_fault(AD2VirtualPartitionState *s, uint8_t zone) {
+  if (!s->isZoneFaulted(zone)) {
+    return false;
+  }
+
+  s->zone_faults[zone >> 5] &= ~(1UL << (zone & 31));
+  s->zone_fault_count--;
+
+  uint8_t t = zone_timer_find(s - AD2PStates, zone);
+  if (t != 0xff) {
+    zone_timer_unlink(t);
+    zone_timers[t].zone = 0;
+    zone_timers[t].next = zone_timer_free;
+    zone_timer_free = t;
+  }
+
+  return true;
+}
+
+/**
+ * Find the timer for a faulted zone. Only faulted zones hold a timer so
+ * this looks at no more than AD2_MAX_ZONE_FAULTS entries.
+ */
+uint8_t AD2ParserCore::zone_timer_find(uint8_t partition, uint8_t zone) {
+  for (uint8_t t = 0; t < AD2_MAX_ZONE_FAULTS; t++) {
+    if (zone_timers[t].zone == zone && zone_timers[t].partition == partition) {
+      return t;
+    }
+  }
+  return 0xff;
+}
+
+/**
+ * Add a timer to the wheel slot of its expire tick.
+ */
+void AD2ParserCore::zone_timer_link(uint8_t t) {
+  uint8_t *head = &zone_wheel[zone_timers[t].expire & (AD2_ZONE_WHEEL_SLOTS - 1)];
+  zone_timers[t].prev = 0xff;
+  zone_timers[t].next = *head;
+  if (*head != 0xff) {
+    zone_timers[*head].prev = t;
+  }
+  *head = t;
+}
+
+/**
+ * Remove a timer from its wheel slot.
+ */
+void AD2ParserCore::zone_timer_unlink(uint8_t t) {
+  uint8_t prev = zone_timers[t].prev;
+  uint8_t next = zone_timers[t].next;
+  if (prev != 0xff) {
+    zone_timers[prev].next = next;
+  } else {
+    zone_wheel[zone_timers[t].expire & (AD2_ZONE_WHEEL_SLOTS - 1)] = next;
+  }
+  if (next != 0xff) {
+    zone_timers[next].prev = prev;
+  }
+}
+
+/**
+ * Advance the timer wheel to now. Returns the number of slots whose
+ * ticks passed starting with the slot of tick *first. No more than one
+ * turn of the wheel is visited.
+ */
+uint32_t AD2ParserCore::zone_wheel_advance(uint32_t *first) {
+  uint32_t n = (millis() - zone_wheel_ms) / AD2_ZONE_TICK_MS;
+  if (!n) {
+    return 0;
+  }
+  zone_wheel_ms += n * AD2_ZONE_TICK_MS;
+
+  *first = zone_wheel_tick + 1;
+  zone_wheel_tick += n;
+  if (n > AD2_ZONE_WHEEL_SLOTS) {
+    n = AD2_ZONE_WHEEL_SLOTS;
+  }
+
+  return n;
+}
+
+#if AD2_TRACE_SIZE
+/**
+ * Add a record to the trace ring overwriting the oldest when full.
+ */
+void AD2ParserCore::trace(uint8_t type, uint8_t partition, uint16_t len, uint32_t flags) {
+  AD2TraceRecord *r = &trace_ring[trace_count++ & (AD2_TRACE_SIZE - 1)];
+  r->time = millis();
+  r->flags = flags;
+  r->len = len;
+  r->type = type;
+  r->partition = partition;
+}
+
+/**
+ * Copy up to max trace records oldest first.
+ */
+size_t AD2ParserCore::getTrace(AD2TraceRecord *out, size_t max) {
+  uint32_t n = trace_count < AD2_TRACE_SIZE ? trace_count : AD2_TRACE_SIZE;
+  uint32_t start = trace_count - n;
+  if (n > max) {
+    start += n - max;
+    n = max;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    out[i] = trace_ring[(start + i) & (AD2_TRACE_SIZE - 1)];
+  }
+  return n;
+}
+
+/**
+ * Print the trace ring oldest first.
+ * !TRC:time,type,partition,len,flags
+ */
+void AD2ParserCore::dumpTrace(Print &out) {
+  AD2TraceRecord r;
+  uint32_t n = trace_count < AD2_TRACE_SIZE ? trace_count : AD2_TRACE_SIZE;
+  for (uint32_t i = trace_count - n; i != trace_count; i++) {
+    r = trace_ring[i & (AD2_TRACE_SIZE - 1)];
+    out.printf("!TRC:%lu,%u,%u,%u,%08lx\r\n", (unsigned long)r.time, r.type,
+               r.partition, r.len, (unsigned long)r.flags);
+  }
+}
+
+/**
+ * Empty the trace ring.
+ */
+void AD2ParserCore::clearTrace() {
+  trace_count = 0;
+}
+#endif
+
+// Select the view and legacy callbacks of an event.
+#if AD2_STRING_CALLBACKS
+#define AD2_EVENT_CALLBACKS(EVENT) \
+  case AD2_EV_##EVENT: vcb = ON_##EVENT##_VCB; scb = ON_##EVENT##_CB; break
+#else
+#define AD2_EVENT_CALLBACKS(EVENT) \
+  case AD2_EV_##EVENT: vcb = ON_##EVENT##_VCB; break
+#endif
+
+/**
+ * Call the view callback, the legacy String* callback and the subscribers
+ * for an event. The String copy of the message is only made the first time
+ * a legacy callback needs it for the current message.
+ */
+void AlarmDecoderParser::on_event(uint8_t event, const AD2MessageView *msg,
+                                  AD2VirtualPartitionState *s) {
+  AD2ParserCallback_view_t vcb = nullptr;
+#if AD2_STRING_CALLBACKS
+  AD2ParserCallback_msg_t scb = nullptr;
+#endif
+
+  switch (event) {
+    AD2_EVENT_CALLBACKS(RAW_MESSAGE);
+    AD2_EVENT_CALLBACKS(ARM);
+    AD2_EVENT_CALLBACKS(DISARM);
+    AD2_EVENT_CALLBACKS(POWER_CHANGE);
+    AD2_EVENT_CALLBACKS(READY_CHANGE);
+    AD2_EVENT_CALLBACKS(ALARM);
+    AD2_EVENT_CALLBACKS(ALARM_RESTORED);
+    AD2_EVENT_CALLBACKS(FIRE);
+    AD2_EVENT_CALLBACKS(BYPASS);
+    AD2_EVENT_CALLBACKS(BOOT);
+    AD2_EVENT_CALLBACKS(CONFIG_RECEIVED);
+    AD2_EVENT_CALLBACKS(ZONE_FAULT);
+    AD2_EVENT_CALLBACKS(ZONE_RESTORE);
+    AD2_EVENT_CALLBACKS(LOW_BATTERY);
+    AD2_EVENT_CALLBACKS(PANIC);
+    AD2_EVENT_CALLBACKS(RELAY_CHANGED);
+    AD2_EVENT_CALLBACKS(CHIME_CHANGED);
+    AD2_EVENT_CALLBACKS(MESSAGE);
+    AD2_EVENT_CALLBACKS(EXPANDER_MESSAGE);
+    AD2_EVENT_CALLBACKS(LRR);
+    AD2_EVENT_CALLBACKS(RFX);
+    AD2_EVENT_CALLBACKS(SENDING_RECEIVED);
+    AD2_EVENT_CALLBACKS(AUI);
+    AD2_EVENT_CALLBACKS(KPM);
+    AD2_EVENT_CALLBACKS(KPE);
+    AD2_EVENT_CALLBACKS(CRC);
+    AD2_EVENT_CALLBACKS(VER);
+    AD2_EVENT_CALLBACKS(ERR);
+  }
+
+  if (vcb) {
+    vcb(msg, s);
+  }
+#if AD2_STRING_CALLBACKS
+  if (scb) {
+    if (compat_msg_seq != line_seq) {
+      compat_msg = msg->data;
+      compat_msg_seq = line_seq;
+    }
+    scb(&compat_msg, s);
+  }
+#endif
+
+  uint32_t bit = AD2_EVENT_MASK(event);
+  for (uint8_t i = 0; i < subscriber_count; i++) {
+    if ((subscribers[i].events & bit) && subscribers[i].cb &&
+        (!s || !subscribers[i].address_mask ||
+         (s->address_mask_filter & subscribers[i].address_mask))) {
+      subscribers[i].cb(subscribers[i].ctx, event, msg, s);
+    }
+  }
+}
+
+/**
+ * Typed callbacks. Only called when typed_event_mask shows the callback
+ * is set.
+ */
+void AlarmDecoderParser::on_lrr(const AD2MessageView *msg, const AD2LRRMessage *m) {
+  ON_LRR_TCB(msg, m);
+}
+
+void AlarmDecoderParser::on_rfx(const AD2MessageView *msg, const AD2RFXMessage *m) {
+  ON_RFX_TCB(msg, m);
+}
+
+void AlarmDecoderParser::on_exp(uint8_t event, const AD2MessageView *msg, const AD2EXPMessage *m) {
+  if (event == AD2_EV_RELAY_CHANGED) {
+    ON_RELAY_CHANGED_TCB(msg, m);
+  } else {
+    ON_EXPANDER_MESSAGE_TCB(msg, m);
+  }
+}
+
+void AlarmDecoderParser::on_ver(const AD2MessageView *msg, const AD2VERMessage *m) {
+  ON_VER_TCB(msg, m);
+}
+
+void AlarmDecoderParser::on_data(uint8_t event, const AD2MessageView *msg, const AD2DataMessage *m) {
+  AD2ParserCallback_data_t cb;
+
+  switch (event) {
+    case AD2_EV_AUI: cb = ON_AUI_TCB; break;
+    case AD2_EV_KPE: cb = ON_KPE_TCB; break;
+    case AD2_EV_CRC: cb = ON_CRC_TCB; break;
+    default: cb = ON_ERR_TCB; break;
+  }
+  cb(msg, m);
+}
+
+void AlarmDecoderParser::on_zone(uint8_t event, AD2VirtualPartitionState *s, uint8_t zone) {
+  if (event == AD2_EV_ZONE_FAULT) {
+    ON_ZONE_FAULT_TCB(s, zone);
+  } else {
+    ON_ZONE_RESTORE_TCB(s, zone);
+  }
+}
+
+/**
+ * Add a subscriber to the first free slot.
+ */
+int8_t AlarmDecoderParser::subscribe(uint32_t events, AD2ParserCallback_sub_t cb,
+                                     void *ctx, uint32_t address_mask) {
+  if (!cb) {
+    return -1;
+  }
+
+  uint8_t i;
+  for (i = 0; i < subscriber_count; i++) {
+    if (!subscribers[i].cb) {
+      break;
+    }
+  }
+  if (i == AD2_MAX_SUBSCRIBERS) {
+    AD2_LOGW("NO SUBSCRIBER SLOT");
+    return -1;
+  }
+
+  subscribers[i].cb = cb;
+  subscribers[i].ctx = ctx;
+  subscribers[i].events = events & AD2_EVENT_ALL;
+  subscribers[i].address_mask = address_mask;
+  if (i == subscriber_count) {
+    subscriber_count++;
+  }
+  update_event_mask();
+
+  return i;
+}
+
+/**
+ * Free a subscriber slot. The slot is only cleared so a callback running
+ * the subscriber loop is not disturbed.
+ */
+void AlarmDecoderParser::unsubscribe(int8_t handle) {
+  if (handle < 0 || handle >= subscriber_count) {
+    return;
+  }
+
+  subscribers[handle].cb = nullptr;
+  subscribers[handle].events = 0;
+  while (subscriber_count && !subscribers[subscriber_count - 1].cb) {
+    subscriber_count--;
+  }
+  update_event_mask();
+}
+
+// Add an event to the mask if any callback for it is set.
+#if AD2_STRING_CALLBACKS
+#define AD2_EVENT_CB(EVENT) \
+  if (ON_##EVENT##_VCB || ON_##EVENT##_CB) mask |= AD2_EVENT_MASK(AD2_EV_##EVENT)
+#else
+#define AD2_EVENT_CB(EVENT) \
+  if (ON_##EVENT##_VCB) mask |= AD2_EVENT_MASK(AD2_EV_##EVENT)
+#endif
+#define AD2_EVENT_TCB(EVENT) \
+  if (ON_##EVENT##_TCB) typed |= AD2_EVENT_MASK(AD2_EV_##EVENT)
+
+// Clear every callback kind of an event.
+#if AD2_STRING_CALLBACKS
+#define AD2_CLEAR_CB(EVENT) \
+  case AD2_EV_##EVENT: ON_##EVENT##_VCB = nullptr; ON_##EVENT##_CB = nullptr; break
+#else
+#define AD2_CLEAR_CB(EVENT) \
+  case AD2_EV_##EVENT: ON_##EVENT##_VCB = nullptr; break
+#endif
+#define AD2_CLEAR_TCB(EVENT) \
+  case AD2_EV_##EVENT: ON_##EVENT##_TCB = nullptr; break
+
+/**
+ * Clear the view, typed and String* callbacks of an AD2_EV_* event.
+ */
+void AlarmDecoderParser::clearCB(uint8_t event) {
+  switch (event) {
+    AD2_CLEAR_CB(RAW_MESSAGE);
+    AD2_CLEAR_CB(ARM);
+    AD2_CLEAR_CB(DISARM);
+    AD2_CLEAR_CB(POWER_CHANGE);
+    AD2_CLEAR_CB(READY_CHANGE);
+    AD2_CLEAR_CB(ALARM);
+    AD2_CLEAR_CB(ALARM_RESTORED);
+    AD2_CLEAR_CB(FIRE);
+    AD2_CLEAR_CB(BYPASS);
+    AD2_CLEAR_CB(BOOT);
+    AD2_CLEAR_CB(CONFIG_RECEIVED);
+    AD2_CLEAR_CB(ZONE_FAULT);
+    AD2_CLEAR_CB(ZONE_RESTORE);
+    AD2_CLEAR_CB(LOW_BATTERY);
+    AD2_CLEAR_CB(PANIC);
+    AD2_CLEAR_CB(RELAY_CHANGED);
+    AD2_CLEAR_CB(CHIME_CHANGED);
+    AD2_CLEAR_CB(MESSAGE);
+    AD2_CLEAR_CB(EXPANDER_MESSAGE);
+    AD2_CLEAR_CB(LRR);
+    AD2_CLEAR_CB(RFX);
+    AD2_CLEAR_CB(SENDING_RECEIVED);
+    AD2_CLEAR_CB(AUI);
+    AD2_CLEAR_CB(KPM);
+    AD2_CLEAR_CB(KPE);
+    AD2_CLEAR_CB(CRC);
+    AD2_CLEAR_CB(VER);
+    AD2_CLEAR_CB(ERR);
+  }
+  switch (event) {
+    AD2_CLEAR_TCB(EXPANDER_MESSAGE);
+    AD2_CLEAR_TCB(RELAY_CHANGED);
+    AD2_CLEAR_TCB(LRR);
+    AD2_CLEAR_TCB(RFX);
+    AD2_CLEAR_TCB(AUI);
+    AD2_CLEAR_TCB(KPE);
+    AD2_CLEAR_TCB(CRC);
+    AD2_CLEAR_TCB(VER);
+    AD2_CLEAR_TCB(ERR);
+    AD2_CLEAR_TCB(ZONE_FAULT);
+    AD2_CLEAR_TCB(ZONE_RESTORE);
+  }
+  update_event_mask();
+}
+
+/**
+ * Rebuild the masks of events anything is listening to.
+ */
+void AlarmDecoderParser::update_event_mask() {
+  uint32_t mask = 0;
+  uint32_t typed = 0;
+
+  for (uint8_t i = 0; i < subscriber_count; i++) {
+    mask |= subscribers[i].events;
+  }
+
+  AD2_EVENT_CB(RAW_MESSAGE);
+  AD2_EVENT_CB(ARM);
+  AD2_EVENT_CB(DISARM);
+  AD2_EVENT_CB(POWER_CHANGE);
+  AD2_EVENT_CB(READY_CHANGE);
+  AD2_EVENT_CB(ALARM);
+  AD2_EVENT_CB(ALARM_RESTORED);
+  AD2_EVENT_CB(FIRE);
+  AD2_EVENT_CB(BYPASS);
+  AD2_EVENT_CB(BOOT);
+  AD2_EVENT_CB(CONFIG_RECEIVED);
+  AD2_EVENT_CB(ZONE_FAULT);
+  AD2_EVENT_CB(ZONE_RESTORE);
+  AD2_EVENT_CB(LOW_BATTERY);
+  AD2_EVENT_CB(PANIC);
+  AD2_EVENT_CB(RELAY_CHANGED);
+  AD2_EVENT_CB(CHIME_CHANGED);
+  AD2_EVENT_CB(MESSAGE);
+  AD2_EVENT_CB(EXPANDER_MESSAGE);
+  AD2_EVENT_CB(LRR);
+  AD2_EVENT_CB(RFX);
+  AD2_EVENT_CB(SENDING_RECEIVED);
+  AD2_EVENT_CB(AUI);
+  AD2_EVENT_CB(KPM);
+  AD2_EVENT_CB(KPE);
+  AD2_EVENT_CB(CRC);
+  AD2_EVENT_CB(VER);
+  AD2_EVENT_CB(ERR);
+
+  AD2_EVENT_TCB(EXPANDER_MESSAGE);
+  AD2_EVENT_TCB(RELAY_CHANGED);
+  AD2_EVENT_TCB(LRR);
+  AD2_EVENT_TCB(RFX);
+  AD2_EVENT_TCB(AUI);
+  AD2_EVENT_TCB(KPE);
+  AD2_EVENT_TCB(CRC);
+  AD2_EVENT_TCB(VER);
+  AD2_EVENT_TCB(ERR);
+  AD2_EVENT_TCB(ZONE_FAULT);
+  AD2_EVENT_TCB(ZONE_RESTORE);
+
+  event_mask = mask;
+  typed_event_mask = typed;
+}
+
+AD2QueueParser::AD2QueueParser() {
+  queue_head = 0;
+  queue_tail = 0;
+  queue_events = AD2_EVENT_ALL & ~AD2_EVENT_MASK(AD2_EV_RAW_MESSAGE);
+  merge = false;
+  current_seq = 0;
+  current_pos = 0;
+  current_valid = false;
+  current_state = nullptr;
+  memset(partition_pos, 0, sizeof(partition_pos));
+}
+
+/**
+ * Select the events that queue a message.
+ */
+void AD2QueueParser::setQueueEvents(uint32_t events) {
+  queue_events = events & AD2_EVENT_ALL;
+}
+
+/**
+ * Enable or disable merging messages for the same partition.
+ */
+void AD2QueueParser::setMerge(bool enable) {
+  merge = enable;
+}
+
+/**
+ * Number of messages waiting.
+ */
+size_t AD2QueueParser::pending() const {
+  return queue_tail - queue_head;
+}
+
+/**
+ * Copy up to max messages oldest first and remove them from the queue.
+ */
+size_t AD2QueueParser::drain(AD2QueuedMessage *out, size_t max) {
+  size_t n = 0;
+
+  while (n < max && queue_head != queue_tail) {
+    out[n++] = queue[queue_head++ & (AD2_QUEUE_SIZE - 1)];
+  }
+
+  return n;
+}
+
+/**
+ * Queue the current message on its first event. Later events of the same
+ * message are added to its record.
+ */
+void AD2QueueParser::on_event(uint8_t event, const AD2MessageView *msg,
+                              AD2VirtualPartitionState *s) {
+  AD2QueuedMessage *r;
+
+  // Zone timeouts can restore zones on more than one partition for the
+  // same line_seq. Each partition gets its own record.
+  if (current_seq != line_seq || (s && current_state && s != current_state)) {
+    current_seq = line_seq;
+    current_state = s;
+    current_valid = false;
+
+    // Update the message still waiting for this partition.
+    if (merge && s) {
+      uint32_t pos = partition_pos[s - AD2PStates] - 1;
+      if (pos - queue_head < queue_tail - queue_head) {
+        current_pos = pos;
+        current_valid = true;
+        queue[pos & (AD2_QUEUE_SIZE - 1)].merged++;
+      }
+    }
+
+    // Start a new record.
+    if (!current_valid) {
+      if (queue_tail - queue_head >= AD2_QUEUE_SIZE) {
+        stats.queue_drops++;
+        AD2_LOGW("QUEUE FULL");
+        return;
+      }
+      current_pos = queue_tail++;
+      current_valid = true;
+      r = &queue[current_pos & (AD2_QUEUE_SIZE - 1)];
+      r->events = 0;
+      r->merged = 0;
+      r->zone = 0;
+      r->has_state = false;
+      r->len = 0;
+      r->data[0] = 0;
+    }
+
+    // Zone timeouts have no message. Keep the one being merged into.
+    r = &queue[current_pos & (AD2_QUEUE_SIZE - 1)];
+    r->time = millis();
+    if (msg->len) {
+      r->len = msg->len;
+      memcpy(r->data, msg->data, msg->len);
+      r->data[msg->len] = 0;
+    }
+  } else if (!current_valid) {
+    // Dropped.
+    return;
+  }
+
+  r = &queue[current_pos & (AD2_QUEUE_SIZE - 1)];
+  r->events |= AD2_EVENT_MASK(event);
+  if (s) {
+    current_state = s;
+    r->state = *s;
+    r->has_state = true;
+    if (event == AD2_EV_ZONE_FAULT || event == AD2_EV_ZONE_RESTORE) {
+      r->zone = s->last_zone_event;
+    }
+    partition_pos[s - AD2PStates] = current_pos + 1;
+  }
+}
+
+AD2CommandQueue::AD2CommandQueue() {
+  queue_head = 0;
+  queue_count = 0;
+  head_written = 0;
+  gap_ms = AD2_CMD_GAP_MS;
+  key_ms = AD2_CMD_KEY_MS;
+  next_ms = millis();
+  last.len = 0;
+  last.sources = 0;
+  last_ms = 0;
+  memset(&stats, 0, sizeof(stats));
+}
+
+/**
+ * Queue a whole command. Merges it into an identical command from
+ * another source that is waiting or was just written.
+ */
+bool AD2CommandQueue::send(const char *cmd, size_t len, uint8_t source) {
+  uint8_t bit = 1 << (source & 7);
+
+  if (!len || len > AD2_CMD_MAX_SIZE) {
+    stats.rejects++;
+    AD2_LOGW("CMD REJECT len(%u)", (unsigned)len);
+    return false;
+  }
+
+  // Waiting duplicate.
+  for (uint8_t i = 0; i < queue_count; i++) {
+    AD2Command *c = &queue[(queue_head + i) % AD2_CMD_QUEUE_SIZE];
+    if (c->len == len && !(c->sources & bit) && !memcmp(c->data, cmd, len)) {
+      c->sources |= bit;
+      stats.merged++;
+      return true;
     }
   }
 
-  return true;
+  // Duplicate of the command just written.
+  if (last.sources && !(last.sources & bit) && millis() - last_ms < AD2_CMD_DEDUP_MS &&
+      last.len == len && !memcmp(last.data, cmd, len)) {
+    last.sources |= bit;
+    stats.merged++;
+    return true;
+  }
+
+  if (queue_count >= AD2_CMD_QUEUE_SIZE) {
+    stats.drops++;
+    AD2_LOGW("CMD QUEUE FULL");
+    return false;
+  }
+
+  AD2Command *c = &queue[(queue_head + queue_count++) % AD2_CMD_QUEUE_SIZE];
+  c->len = len;
+  c->sources = bit;
+  memcpy(c->data, cmd, len);
+  stats.queued++;
+  return true;
+}
+
+/**
+ * Write the oldest command once the previous one has had its time. A
+ * command the output did not take all of stays at the head.
+ */
+size_t AD2CommandQueue::poll(Print &out) {
+  if (!queue_count || (int32_t)(millis() - next_ms) < 0) {
+    return 0;
+  }
+
+  AD2Command *c = &queue[queue_head];
+  size_t left = c->len - head_written;
+  size_t n = out.write((const uint8_t *)c->data + head_written, left);
+  if (n > left) {
+    n = left;
+  }
+  stats.bytes += n;
+
+  // Short or failed write. Try the rest again after a gap.
+  if (n < left) {
+    head_written += n;
+    stats.short_writes++;
+    next_ms = millis() + gap_ms;
+    AD2_LOGW("CMD SHORT WRITE %u of %u", (unsigned)n, (unsigned)left);
+    return n;
+  }
+  head_written = 0;
+
+  last = *c;
+  last_ms = millis();
+  next_ms = last_ms + gap_ms + (uint32_t)key_ms * c->len;
+  queue_head = (queue_head + 1) % AD2_CMD_QUEUE_SIZE;
+  queue_count--;
+  stats.sent++;
+
+  return n;
+}
+
+/**
+ * Change the time after each command and the extra time per byte.
+ */
+void AD2CommandQueue::setPacing(uint16_t gap, uint16_t key) {
+  gap_ms = gap;
+  key_ms = key;
+}
+
+/**
+ * Number of commands waiting.
+ */
+size_t AD2CommandQueue::pending() const {
+  return queue_count;
+}
+
+/**
+ * Copy the counters and optionally zero them.
+ */
+void AD2CommandQueue::getStats(AD2CommandStats *out, bool reset) {
+  *out = stats;
+  if (reset) {
+    memset(&stats, 0, sizeof(stats));
+  }
+}
+
+/**
+ * setCB_ON_RAW_MESSAGE
+ */
+void AlarmDecoderParser::setCB_ON_RAW_MESSAGE(AD2ParserCallback_view_t cb) {
+  ON_RAW_MESSAGE_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_ARM
+ */
+void AlarmDecoderParser::setCB_ON_ARM(AD2ParserCallback_view_t cb) {
+  ON_ARM_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_DISARM
+ */
+void AlarmDecoderParser::setCB_ON_DISARM(AD2ParserCallback_view_t cb) {
+  ON_DISARM_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_POWER_CHANGE
+ */
+void AlarmDecoderParser::setCB_ON_POWER_CHANGE(AD2ParserCallback_view_t cb) {
+  ON_POWER_CHANGE_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_READY_CHANGE
+ */
+void AlarmDecoderParser::setCB_ON_READY_CHANGE(AD2ParserCallback_view_t cb) {
+  ON_READY_CHANGE_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_ALARM
+ */
+void AlarmDecoderParser::setCB_ON_ALARM(AD2ParserCallback_view_t cb) {
+  ON_ALARM_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_ALARM_RESTORED
+ */
+void AlarmDecoderParser::setCB_ON_ALARM_RESTORED(AD2ParserCallback_view_t cb) {
+  ON_ALARM_RESTORED_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_FIRE
+ */
+void AlarmDecoderParser::setCB_ON_FIRE(AD2ParserCallback_view_t cb) {
+  ON_FIRE_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_BYPASS
+ */
+void AlarmDecoderParser::setCB_ON_BYPASS(AD2ParserCallback_view_t cb) {
+  ON_BYPASS_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_BOOT
+ */
+void AlarmDecoderParser::setCB_ON_BOOT(AD2ParserCallback_view_t cb) {
+  ON_BOOT_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_CONFIG_RECEIVED
+ */
+void AlarmDecoderParser::setCB_ON_CONFIG_RECEIVED(AD2ParserCallback_view_t cb) {
+  ON_CONFIG_RECEIVED_VCB = cb;
+  update_event_mask();
+}
+
+
+/**
+ * setCB_ON_ZONE_FAULT
+ */
+void AlarmDecoderParser::setCB_ON_ZONE_FAULT(AD2ParserCallback_view_t cb) {
+  ON_ZONE_FAULT_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_ZONE_RESTORE
+ */
+void AlarmDecoderParser::setCB_ON_ZONE_RESTORE(AD2ParserCallback_view_t cb) {
+  ON_ZONE_RESTORE_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_LOW_BATTERY
+ */
+void AlarmDecoderParser::setCB_ON_LOW_BATTERY(AD2ParserCallback_view_t cb) {
+  ON_LOW_BATTERY_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_PANIC
+ */
+void AlarmDecoderParser::setCB_ON_PANIC(AD2ParserCallback_view_t cb) {
+  ON_PANIC_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_RELAY_CHANGED
+ */
+void AlarmDecoderParser::setCB_ON_RELAY_CHANGED(AD2ParserCallback_view_t cb) {
+  ON_RELAY_CHANGED_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_CHIME_CHANGED
+ */
+void AlarmDecoderParser::setCB_ON_CHIME_CHANGED(AD2ParserCallback_view_t cb) {
+  ON_CHIME_CHANGED_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_MESSAGE
+ */
+void AlarmDecoderParser::setCB_ON_MESSAGE(AD2ParserCallback_view_t cb) {
+  ON_MESSAGE_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_EXPANDER_MESSAGE
+ */
+void AlarmDecoderParser::setCB_ON_EXPANDER_MESSAGE(AD2ParserCallback_view_t cb) {
+  ON_EXPANDER_MESSAGE_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_LRR
+ */
+void AlarmDecoderParser::setCB_ON_LRR(AD2ParserCallback_view_t cb) {
+  ON_LRR_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_RFX
+ */
+void AlarmDecoderParser::setCB_ON_RFX(AD2ParserCallback_view_t cb) {
+  ON_RFX_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_SENDING_RECEIVED
+ */
+void AlarmDecoderParser::setCB_ON_SENDING_RECEIVED(AD2ParserCallback_view_t cb) {
+  ON_SENDING_RECEIVED_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_AUI
+ */
+void AlarmDecoderParser::setCB_ON_AUI(AD2ParserCallback_view_t cb) {
+  ON_AUI_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_KPM
+ */
+void AlarmDecoderParser::setCB_ON_KPM(AD2ParserCallback_view_t cb) {
+  ON_KPM_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_KPE
+ */
+void AlarmDecoderParser::setCB_ON_KPE(AD2ParserCallback_view_t cb) {
+  ON_KPE_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_CRC
+ */
+void AlarmDecoderParser::setCB_ON_CRC(AD2ParserCallback_view_t cb) {
+  ON_CRC_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_VER
+ */
+void AlarmDecoderParser::setCB_ON_VER(AD2ParserCallback_view_t cb) {
+  ON_VER_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_ERR
+ */
+void AlarmDecoderParser::setCB_ON_ERR(AD2ParserCallback_view_t cb) {
+  ON_ERR_VCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_EXPANDER_MESSAGE typed
+ */
+void AlarmDecoderParser::setCB_ON_EXPANDER_MESSAGE(AD2ParserCallback_exp_t cb) {
+  ON_EXPANDER_MESSAGE_TCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_RELAY_CHANGED typed
+ */
+void AlarmDecoderParser::setCB_ON_RELAY_CHANGED(AD2ParserCallback_exp_t cb) {
+  ON_RELAY_CHANGED_TCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_LRR typed
+ */
+void AlarmDecoderParser::setCB_ON_LRR(AD2ParserCallback_lrr_t cb) {
+  ON_LRR_TCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_RFX typed
+ */
+void AlarmDecoderParser::setCB_ON_RFX(AD2ParserCallback_rfx_t cb) {
+  ON_RFX_TCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_AUI typed
+ */
+void AlarmDecoderParser::setCB_ON_AUI(AD2ParserCallback_data_t cb) {
+  ON_AUI_TCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_KPE typed
+ */
+void AlarmDecoderParser::setCB_ON_KPE(AD2ParserCallback_data_t cb) {
+  ON_KPE_TCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_CRC typed
+ */
+void AlarmDecoderParser::setCB_ON_CRC(AD2ParserCallback_data_t cb) {
+  ON_CRC_TCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_VER typed
+ */
+void AlarmDecoderParser::setCB_ON_VER(AD2ParserCallback_ver_t cb) {
+  ON_VER_TCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_ERR typed
+ */
+void AlarmDecoderParser::setCB_ON_ERR(AD2ParserCallback_data_t cb) {
+  ON_ERR_TCB = cb;
+  update_event_mask();
+}
+
+/**
+ * setCB_ON_ZONE_FAULT typed
+ */
+void AlarmDecoderParser::setCB_ON_ZONE_FAULT(AD2ParserCallback_zone_t cb) {
+  ON_ZONE_FAULT_TCB = cb;
+  update_event_mask();
 }
 
 /**
- * FIXME: test code
+ * setCB_ON_ZONE_RESTORE typed
  */
-void AlarmDecoderParser::test() {
-  for (int x = 0; x < 10000; x++) {
-    AD2PStates[1] = new AD2VirtualPartitionState;
-    AD2PStates[1]->ready = false;
-    delete AD2PStates[1];
-  }
+void AlarmDecoderParser::setCB_ON_ZONE_RESTORE(AD2ParserCallback_zone_t cb) {
+  ON_ZONE_RESTORE_TCB = cb;
+  update_event_mask();
 }
 
+#if AD2_STRING_CALLBACKS
 /**
  * setCB_ON_RAW_MESSAGE
  */
 void AlarmDecoderParser::setCB_ON_RAW_MESSAGE(AD2ParserCallback_msg_t cb) {
   ON_RAW_MESSAGE_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -469,6 +1571,7 @@ void AlarmDecoderParser::setCB_ON_RAW_MESSAGE(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_ARM(AD2ParserCallback_msg_t cb) {
   ON_ARM_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -476,6 +1579,7 @@ void AlarmDecoderParser::setCB_ON_ARM(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_DISARM(AD2ParserCallback_msg_t cb) {
   ON_DISARM_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -483,6 +1587,7 @@ void AlarmDecoderParser::setCB_ON_DISARM(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_POWER_CHANGE(AD2ParserCallback_msg_t cb) {
   ON_POWER_CHANGE_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -490,6 +1595,7 @@ void AlarmDecoderParser::setCB_ON_POWER_CHANGE(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_READY_CHANGE(AD2ParserCallback_msg_t cb) {
   ON_READY_CHANGE_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -497,6 +1603,7 @@ void AlarmDecoderParser::setCB_ON_READY_CHANGE(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_ALARM(AD2ParserCallback_msg_t cb) {
   ON_ALARM_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -504,6 +1611,7 @@ void AlarmDecoderParser::setCB_ON_ALARM(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_ALARM_RESTORED(AD2ParserCallback_msg_t cb) {
   ON_ALARM_RESTORED_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -511,6 +1619,7 @@ void AlarmDecoderParser::setCB_ON_ALARM_RESTORED(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_FIRE(AD2ParserCallback_msg_t cb) {
   ON_FIRE_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -518,6 +1627,7 @@ void AlarmDecoderParser::setCB_ON_FIRE(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_BYPASS(AD2ParserCallback_msg_t cb) {
   ON_BYPASS_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -525,6 +1635,7 @@ void AlarmDecoderParser::setCB_ON_BYPASS(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_BOOT(AD2ParserCallback_msg_t cb) {
   ON_BOOT_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -532,6 +1643,7 @@ void AlarmDecoderParser::setCB_ON_BOOT(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_CONFIG_RECEIVED(AD2ParserCallback_msg_t cb) {
   ON_CONFIG_RECEIVED_CB = cb;
+  update_event_mask();
 }
 
 
@@ -540,6 +1652,7 @@ void AlarmDecoderParser::setCB_ON_CONFIG_RECEIVED(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_ZONE_FAULT(AD2ParserCallback_msg_t cb) {
   ON_ZONE_FAULT_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -547,6 +1660,7 @@ void AlarmDecoderParser::setCB_ON_ZONE_FAULT(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_ZONE_RESTORE(AD2ParserCallback_msg_t cb) {
   ON_ZONE_RESTORE_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -554,6 +1668,7 @@ void AlarmDecoderParser::setCB_ON_ZONE_RESTORE(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_LOW_BATTERY(AD2ParserCallback_msg_t cb) {
   ON_LOW_BATTERY_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -561,6 +1676,7 @@ void AlarmDecoderParser::setCB_ON_LOW_BATTERY(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_PANIC(AD2ParserCallback_msg_t cb) {
   ON_PANIC_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -568,6 +1684,7 @@ void AlarmDecoderParser::setCB_ON_PANIC(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_RELAY_CHANGED(AD2ParserCallback_msg_t cb) {
   ON_RELAY_CHANGED_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -575,6 +1692,7 @@ void AlarmDecoderParser::setCB_ON_RELAY_CHANGED(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_CHIME_CHANGED(AD2ParserCallback_msg_t cb) {
   ON_CHIME_CHANGED_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -582,6 +1700,7 @@ void AlarmDecoderParser::setCB_ON_CHIME_CHANGED(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_MESSAGE(AD2ParserCallback_msg_t cb) {
   ON_MESSAGE_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -589,6 +1708,7 @@ void AlarmDecoderParser::setCB_ON_MESSAGE(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_EXPANDER_MESSAGE(AD2ParserCallback_msg_t cb) {
   ON_EXPANDER_MESSAGE_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -596,6 +1716,7 @@ void AlarmDecoderParser::setCB_ON_EXPANDER_MESSAGE(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_LRR(AD2ParserCallback_msg_t cb) {
   ON_LRR_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -603,6 +1724,7 @@ void AlarmDecoderParser::setCB_ON_LRR(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_RFX(AD2ParserCallback_msg_t cb) {
   ON_RFX_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -610,6 +1732,7 @@ void AlarmDecoderParser::setCB_ON_RFX(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_SENDING_RECEIVED(AD2ParserCallback_msg_t cb) {
   ON_SENDING_RECEIVED_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -617,6 +1740,7 @@ void AlarmDecoderParser::setCB_ON_SENDING_RECEIVED(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_AUI(AD2ParserCallback_msg_t cb) {
   ON_AUI_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -624,6 +1748,7 @@ void AlarmDecoderParser::setCB_ON_AUI(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_KPM(AD2ParserCallback_msg_t cb) {
   ON_KPM_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -631,6 +1756,7 @@ void AlarmDecoderParser::setCB_ON_KPM(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_KPE(AD2ParserCallback_msg_t cb) {
   ON_KPE_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -638,6 +1764,7 @@ void AlarmDecoderParser::setCB_ON_KPE(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_CRC(AD2ParserCallback_msg_t cb) {
   ON_CRC_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -645,6 +1772,7 @@ void AlarmDecoderParser::setCB_ON_CRC(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_VER(AD2ParserCallback_msg_t cb) {
   ON_VER_CB = cb;
+  update_event_mask();
 }
 
 /**
@@ -652,7 +1780,9 @@ void AlarmDecoderParser::setCB_ON_VER(AD2ParserCallback_msg_t cb) {
  */
 void AlarmDecoderParser::setCB_ON_ERR(AD2ParserCallback_msg_t cb) {
   ON_ERR_CB = cb;
+  update_event_mask();
 }
+#endif
 
 
 
@@ -679,3 +1809,909 @@ bool is_bit_set(int pos, const char * bitStr)
 
       return set;
 }
+
+/**
+* function: ad2_parse_hex
+* convert a fixed width hex field in place without a copy.
+* Conversion stops at the first non hex character.
+*
+* in: const char *
+* description: start of the field
+*
+* in: uint8_t
+* description: number of characters in the field
+ *
+*/
+uint32_t ad2_parse_hex(const char *str, uint8_t len)
+{
+      uint32_t val = 0;
+
+      for (uint8_t i = 0; i < len; i++) {
+              char c = str[i];
+              uint8_t n;
+              if (c >= '0' && c <= '9')
+                      n = c - '0';
+              else if (c >= 'a' && c <= 'f')
+                      n = c - 'a' + 10;
+              else if (c >= 'A' && c <= 'F')
+                      n = c - 'A' + 10;
+              else
+                      break;
+              val = (val << 4) | n;
+      }
+
+      return val;
+}
+
+/**
+* function: ad2_printable_span
+* count the leading printable(32-126) bytes in a buffer.
+* Checks a full machine word per step using SWAR tests or 16 bytes per
+* step with SSE2 on hosts that have it. Stops at CR/LF and corrupt bytes.
+*
+* in: const uint8_t *
+* description: start of the data
+*
+* in: size_t
+* description: number of bytes available
+ *
+*/
+size_t ad2_printable_span(const uint8_t *buf, size_t len)
+{
+      size_t pos = 0;
+
+#if defined(__SSE2__)
+      const __m128i lo = _mm_set1_epi8(32);
+      const __m128i hi = _mm_set1_epi8(126);
+      while (len - pos >= 16) {
+              __m128i v = _mm_loadu_si128((const __m128i *)(buf + pos));
+              // signed compare so bytes >127 also test as < 32.
+              __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, lo), _mm_cmpgt_epi8(v, hi));
+              int m = _mm_movemask_epi8(bad);
+              if (m) {
+                      return pos + __builtin_ctz(m);
+              }
+              pos += 16;
+      }
+#endif
+
+      // Any byte < 32 or > 126 in a word. The tests may flag extra bytes
+      // above a bad byte but never miss one so fall back to bytes on a hit.
+      const size_t ones = (size_t)~0 / 255;
+      const size_t highs = ones * 0x80;
+      while (len - pos >= sizeof(size_t)) {
+              size_t w;
+              memcpy(&w, buf + pos, sizeof(w));
+              if (((w - ones * 32) & ~w & highs) | (((w + ones) | w) & highs)) {
+                      break;
+              }
+              pos += sizeof(size_t);
+      }
+
+      while (pos < len && buf[pos] > 31 && buf[pos] < 127) {
+              pos++;
+      }
+
+      return pos;
+}
+
+/**
+* function: ad2_parse_dec
+* convert a fixed width decimal field in place without a copy.
+* Conversion stops at the first non decimal character.
+*
+* in: const char *
+* description: start of the field
+*
+* in: uint8_t
+* description: number of characters in the field
+ *
+*/
+uint32_t ad2_parse_dec(const char *str, uint8_t len)
+{
+      uint32_t val = 0;
+
+      for (uint8_t i = 0; i < len; i++) {
+              char c = str[i];
+              if (c < '0' || c > '9')
+                      break;
+              val = (val * 10) + (c - '0');
+      }
+
+      return val;
+}
+
+/**
+* function: ad2_decode_keypad
+* decode a keypad message in a single pass using the fixed section
+* offsets. No copies are made. Returns false if the message is not a
+* well formed keypad message.
+*
+* in: const char *
+* description: keypad message starting with '['
+*
+* in: uint16_t
+* description: length of the message
+*
+* out: AD2KeypadMessage *
+* description: decoded fields
+ *
+*/
+bool ad2_decode_keypad(const char *msg, uint16_t len, AD2KeypadMessage *km)
+{
+      // Excessive sanity check. Test a few static characters.
+      // Length should be 94 bytes and end with ".
+      // [00110011000000003A--],010,[f70700000010808c18020000000000],"ARMED ***STAY** ZONE BYPASSED "
+      if (len != KEYPAD_MESSAGE_SIZE || msg[0] != '[' ||
+          msg[KEYPAD_MESSAGE_SIZE-1] != '"' || msg[SECTION_2_START-1] != ',')
+              return false;
+
+      // Section #1 all bit field bytes into one word.
+      const char *bits = &msg[SECTION_1_START+1];
+      uint32_t flags = 0;
+      for (uint8_t i = 0; i < BIT_FIELD_BYTES; i++)
+              flags |= (uint32_t)(bits[i] == BIT_ON) << i;
+      // Beep mode and panel type are values not bits.
+      km->flags = flags & ~(AD2_BIT(BEEPMODE_BYTE) | AD2_BIT(PANEL_TYPE_BYTE));
+      km->beeps = msg[BEEPMODE_BYTE];
+      km->panel_type = msg[PANEL_TYPE_BYTE];
+
+      // Section #2 numeric data.
+      km->numeric = ad2_parse_dec(&msg[SECTION_2_START], 3);
+
+      // Section #3 address mask is little endian on the wire and cursor.
+      km->address_mask = AD2_NTOHL(ad2_parse_hex(&msg[AMASK_START], AMASK_END - AMASK_START));
+      km->cursor_type = ad2_parse_hex(&msg[CURSOR_TYPE_POS], 2);
+      km->cursor_location = ad2_parse_hex(&msg[CURSOR_POS], 2);
+
+      // Section #4 alpha data.
+      km->alpha = &msg[SECTION_4_START];
+
+      return true;
+}
+
+/**
+* function: ad2_hash
+* 32 bit FNV-1a hash used to fingerprint messages.
+*
+* in: const char *
+* description: data to hash
+*
+* in: uint16_t
+* description: number of bytes
+ *
+*/
+uint32_t ad2_hash(const char *str, uint16_t len)
+{
+      uint32_t h = 2166136261UL;
+
+      for (uint16_t i = 0; i < len; i++) {
+              h ^= (uint8_t)str[i];
+              h *= 16777619UL;
+      }
+
+      return h;
+}
+
+/**
+* function: ad2_next_field
+* take the next separated field from a message without a copy.
+* Returns false when no fields remain.
+*
+* in/out: const char *&
+* description: start of the field. Moved past the separator.
+*
+* in: const char *
+* description: end of the message
+*
+* out: AD2Field *
+* description: the field
+ *
+*/
+static bool ad2_next_field(const char *&p, const char *end, AD2Field *f, char sep = ',')
+{
+      if (p > end)
+              return false;
+
+      const char *e = (const char *)memchr(p, sep, end - p);
+      if (!e)
+              e = end;
+      f->data = p;
+      f->len = e - p;
+      p = e + 1;
+
+      return true;
+}
+
+/**
+* function: ad2_decode_lrr
+* decode a !LRR: message in place. Returns false if a required field is
+* missing.
+*
+* in: const char *
+* description: message starting with !LRR:
+*
+* in: uint16_t
+* description: length of the message
+*
+* out: AD2LRRMessage *
+* description: decoded fields
+ *
+*/
+bool ad2_decode_lrr(const char *msg, uint16_t len, AD2LRRMessage *m)
+{
+      const char *p = msg + 5;
+      const char *end = msg + len;
+      AD2Field f;
+
+      if (len < 5)
+              return false;
+
+      // !LRR:008,1,CID_3401,ff
+      if (!ad2_next_field(p, end, &m->event_data))
+              return false;
+      if (!ad2_next_field(p, end, &f))
+              return false;
+      m->partition = ad2_parse_dec(f.data, f.len);
+      if (!ad2_next_field(p, end, &m->event_type))
+              return false;
+
+      // CID_QEEE qualifier and event code.
+      m->is_cid = m->event_type.len >= 8 && !strncmp(m->event_type.data, "CID_", 4);
+      m->cid_qualifier = m->is_cid ? m->event_type.data[4] - '0' : 0;
+      m->cid_code = m->is_cid ? ad2_parse_hex(&m->event_type.data[5], 3) : 0;
+
+      // Optional report code.
+      m->has_report_code = ad2_next_field(p, end, &f) && f.len;
+      m->report_code = m->has_report_code ? ad2_parse_hex(f.data, f.len) : 0;
+
+      return true;
+}
+
+/**
+* function: ad2_decode_rfx
+* decode a !RFX: message in place. Returns false if a required field is
+* missing.
+*
+* in: const char *
+* description: message starting with !RFX:
+*
+* in: uint16_t
+* description: length of the message
+*
+* out: AD2RFXMessage *
+* description: decoded fields
+ *
+*/
+bool ad2_decode_rfx(const char *msg, uint16_t len, AD2RFXMessage *m)
+{
+      const char *p = msg + 5;
+      const char *end = msg + len;
+      AD2Field f;
+
+      if (len < 5)
+              return false;
+
+      // !RFX:0180036,80
+      if (!ad2_next_field(p, end, &m->serial) || !m->serial.len)
+              return false;
+      m->serial_number = ad2_parse_dec(m->serial.data, m->serial.len);
+      if (!ad2_next_field(p, end, &f) || !f.len)
+              return false;
+      m->value = ad2_parse_hex(f.data, f.len);
+
+      m->battery = m->value & AD2_RFX_BATTERY;
+      m->supervision = m->value & AD2_RFX_SUPERVISION;
+      m->loop[0] = m->value & AD2_RFX_LOOP1;
+      m->loop[1] = m->value & AD2_RFX_LOOP2;
+      m->loop[2] = m->value & AD2_RFX_LOOP3;
+      m->loop[3] = m->value & AD2_RFX_LOOP4;
+
+      return true;
+}
+
+/**
+* function: ad2_decode_exp
+* decode a !EXP: or !REL: message in place. Returns false if a required
+* field is missing.
+*
+* in: const char *
+* description: message starting with !EXP: or !REL:
+*
+* in: uint16_t
+* description: length of the message
+*
+* out: AD2EXPMessage *
+* description: decoded fields
+ *
+*/
+bool ad2_decode_exp(const char *msg, uint16_t len, AD2EXPMessage *m)
+{
+      const char *p = msg + 5;
+      const char *end = msg + len;
+      AD2Field f[3];
+
+      if (len < 5)
+              return false;
+
+      // !EXP:07,01,01
+      for (uint8_t i = 0; i < 3; i++) {
+              if (!ad2_next_field(p, end, &f[i]) || !f[i].len)
+                      return false;
+      }
+      m->address = ad2_parse_dec(f[0].data, f[0].len);
+      m->channel = ad2_parse_dec(f[1].data, f[1].len);
+      m->value = ad2_parse_dec(f[2].data, f[2].len);
+      m->relay = msg[1] == 'R';
+
+      return true;
+}
+
+/**
+* function: ad2_decode_ver
+* decode a !VER: message in place. Known capability codes are collected
+* into AD2_CAP_* bits. Returns false if a required field is missing.
+*
+* in: const char *
+* description: message starting with !VER:
+*
+* in: uint16_t
+* description: length of the message
+*
+* out: AD2VERMessage *
+* description: decoded fields
+ *
+*/
+bool ad2_decode_ver(const char *msg, uint16_t len, AD2VERMessage *m)
+{
+      // Capability codes in AD2_CAP_* bit order.
+      static const char caps[][3] = {
+              "TX", "RX", "SM", "VZ", "RF", "ZX", "RE", "AU", "3X", "CG",
+              "DD", "MF", "LR", "KE", "MK", "CB", "DS", "ER", "CR"
+      };
+      const char *p = msg + 5;
+      const char *end = msg + len;
+      AD2Field f;
+
+      if (len < 5)
+              return false;
+
+      // !VER:ffffffff,V2.2a.8.8,TX;RX;SM
+      if (!ad2_next_field(p, end, &f) || !f.len)
+              return false;
+      m->serial_number = ad2_parse_hex(f.data, f.len);
+      if (!ad2_next_field(p, end, &m->version))
+              return false;
+      if (!ad2_next_field(p, end, &m->capability_list)) {
+              m->capability_list.data = end;
+              m->capability_list.len = 0;
+      }
+
+      m->capabilities = 0;
+      const char *cp = m->capability_list.data;
+      const char *cend = cp + m->capability_list.len;
+      while (ad2_next_field(cp, cend, &f, ';')) {
+              if (f.len != 2)
+                      continue;
+              for (uint8_t i = 0; i < sizeof(caps) / sizeof(caps[0]); i++) {
+                      if (f.data[0] == caps[i][0] && f.data[1] == caps[i][1]) {
+                              m->capabilities |= 1UL << i;
+                              break;
+                      }
+              }
+      }
+
+      return true;
+}
+
+/**
+* function: ad2_decode_data
+* view of the data after the prefix of a !XXX: message.
+*
+* in: const char *
+* description: message starting with !XXX:
+*
+* in: uint16_t
+* description: length of the message
+*
+* out: AD2DataMessage *
+* description: decoded fields
+ *
+*/
+bool ad2_decode_data(const char *msg, uint16_t len, AD2DataMessage *m)
+{
+      if (len < 5) {
+              m->data.data = msg + len;
+              m->data.len = 0;
+              return false;
+      }
+
+      m->data.data = msg + 5;
+      m->data.len = len - 5;
+
+      return true;
+}
+
+/**
+* function: ad2_message_type
+* classify a '!' message with one table lookup on the 4 bytes after '!'.
+* Returns AD2_MSG_UNKNOWN for anything not in the table.
+*
+* in: const char *
+* description: message starting with '!'
+*
+* in: uint16_t
+* description: length of the message
+ *
+*/
+uint8_t ad2_message_type(const char *msg, uint16_t len)
+{
+      if (len < 5)
+              return AD2_MSG_UNKNOWN;
+
+      uint32_t tag = AD2_TAG((uint8_t)msg[1], (uint8_t)msg[2],
+                             (uint8_t)msg[3], (uint8_t)msg[4]);
+      const AD2TagEntry *e = &ad2_tag_table[AD2_TAG_SLOT(tag)];
+
+      return e->tag == tag ? e->type : (uint8_t)AD2_MSG_UNKNOWN;
+}
+
+/**
+* function: ad2_stats_add
+* add parser counters from another snapshot. Used to total counters taken
+* with getStats(..., true) by another task. The max_* fields keep the
+* larger value.
+*
+* out: AD2ParserStats *
+* description: running total
+*
+* in: const AD2ParserStats *
+* description: counters to add
+ *
+*/
+void ad2_stats_add(AD2ParserStats *to, const AD2ParserStats *from)
+{
+      to->bytes_in += from->bytes_in;
+      to->lines += from->lines;
+      to->keypad += from->keypad;
+      to->repeats += from->repeats;
+      for (int i = 0; i < AD2_MSG_TYPE_COUNT; i++)
+              to->types[i] += from->types[i];
+      to->drops += from->drops;
+      to->overflow += from->overflow;
+      to->corrupt += from->corrupt;
+      to->length_rejects += from->length_rejects;
+      to->bad_prefix += from->bad_prefix;
+      if (from->max_line > to->max_line)
+              to->max_line = from->max_line;
+      if (from->max_dispatch_us > to->max_dispatch_us)
+              to->max_dispatch_us = from->max_dispatch_us;
+      to->queue_drops += from->queue_drops;
+}
+
+/**
+* function: ad2_capture_header
+* write the capture file header.
+*
+* out: uint8_t *
+* description: AD2_CAPTURE_HEADER_SIZE bytes
+ *
+*/
+size_t ad2_capture_header(uint8_t *out)
+{
+      memcpy(out, "AD2CAP", 6);
+      out[6] = AD2_CAPTURE_VERSION;
+      out[7] = 0;
+
+      return AD2_CAPTURE_HEADER_SIZE;
+}
+
+/**
+* function: ad2_capture_record
+* write a capture record header. The chunk bytes follow it.
+*
+* out: uint8_t *
+* description: AD2_CAPTURE_RECORD_SIZE bytes
+*
+* in: uint32_t
+* description: microseconds since the previous record
+*
+* in: uint16_t
+* description: chunk length
+ *
+*/
+size_t ad2_capture_record(uint8_t *out, uint32_t delta_us, uint16_t len)
+{
+      out[0] = delta_us;
+      out[1] = delta_us >> 8;
+      out[2] = delta_us >> 16;
+      out[3] = delta_us >> 24;
+      out[4] = len;
+      out[5] = len >> 8;
+
+      return AD2_CAPTURE_RECORD_SIZE;
+}
+
+/**
+* function: ad2_capture_check
+* test for a capture file header this version can read.
+*
+* in: const uint8_t *
+* description: start of the capture
+*
+* in: size_t
+* description: capture size
+ *
+*/
+bool ad2_capture_check(const uint8_t *buf, size_t len)
+{
+      return len >= AD2_CAPTURE_HEADER_SIZE && !memcmp(buf, "AD2CAP", 6) &&
+             buf[6] == AD2_CAPTURE_VERSION;
+}
+
+/**
+* function: ad2_capture_next
+* read the record at p. Returns the chunk bytes or nullptr at the end of
+* the capture or if the record is cut short. The next record starts at
+* the returned pointer + len.
+*
+* in: const uint8_t *
+* description: record start
+*
+* in: const uint8_t *
+* description: end of the capture
+*
+* out: uint32_t *, uint16_t *
+* description: microseconds since the previous record and chunk length
+ *
+*/
+const uint8_t * ad2_capture_next(const uint8_t *p, const uint8_t *end,
+                                 uint32_t *delta_us, uint16_t *len)
+{
+      if (end - p < AD2_CAPTURE_RECORD_SIZE)
+              return nullptr;
+
+      *delta_us = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                  ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+      *len = (uint16_t)(p[4] | (p[5] << 8));
+      p += AD2_CAPTURE_RECORD_SIZE;
+
+      if (end - p < *len)
+              return nullptr;
+
+      return p;
+}
+
+/**
+* function: ad2_encode_state
+* write s as a binary state record.
+*
+* out: uint8_t *
+* description: AD2_STATE_RECORD_SIZE bytes
+*
+* in: const AD2VirtualPartitionState *
+* description: partition state
+*
+* in: uint32_t
+* description: state version
+ *
+*/
+size_t ad2_encode_state(uint8_t *out, const AD2VirtualPartitionState *s, uint32_t version)
+{
+      memset(out, 0, AD2_STATE_RECORD_SIZE);
+      out[0] = AD2_STATE_RECORD_VERSION;
+      out[1] = s->partition;
+      out[2] = s->last_numeric_message;
+      out[3] = s->last_numeric_message >> 8;
+      for (int i = 0; i < 4; i++) {
+              out[4 + i] = version >> (8 * i);
+              out[8 + i] = s->address_mask_filter >> (8 * i);
+              out[12 + i] = s->flags >> (8 * i);
+      }
+      out[16] = s->display_cursor_type;
+      out[17] = s->display_cursor_location;
+      out[18] = s->beeps;
+      out[19] = s->panel_type;
+      out[20] = s->zone_fault_count;
+      memcpy(&out[24], s->last_alpha_message, strlen(s->last_alpha_message));
+      for (int w = 0; w < AD2_STATE_RECORD_ZONE_WORDS && w < AD2_ZONE_WORDS; w++) {
+              for (int i = 0; i < 4; i++)
+                      out[56 + w * 4 + i] = s->zone_faults[w] >> (8 * i);
+      }
+
+      return AD2_STATE_RECORD_SIZE;
+}
+
+/**
+* function: ad2_decode_state
+* read a binary state record into s. Fields not in the record are left
+* as they are. Returns false if buf is not a record this version can read.
+*
+* in: const uint8_t *
+* description: record start
+*
+* in: size_t
+* description: bytes available
+*
+* out: AD2VirtualPartitionState *, uint32_t *
+* description: partition state and state version
+ *
+*/
+bool ad2_decode_state(const uint8_t *buf, size_t len, AD2VirtualPartitionState *s,
+                      uint32_t *version)
+{
+      if (len < AD2_STATE_RECORD_SIZE || buf[0] != AD2_STATE_RECORD_VERSION)
+              return false;
+
+      s->partition = buf[1];
+      s->last_numeric_message = (uint16_t)(buf[2] | (buf[3] << 8));
+      *version = 0;
+      s->address_mask_filter = 0;
+      s->flags = 0;
+      for (int i = 0; i < 4; i++) {
+              *version |= (uint32_t)buf[4 + i] << (8 * i);
+              s->address_mask_filter |= (uint32_t)buf[8 + i] << (8 * i);
+              s->flags |= (uint32_t)buf[12 + i] << (8 * i);
+      }
+      s->display_cursor_type = buf[16];
+      s->display_cursor_location = buf[17];
+      s->beeps = buf[18];
+      s->panel_type = buf[19];
+      s->zone_fault_count = buf[20];
+      memcpy(s->last_alpha_message, &buf[24], ALPHA_SIZE);
+      s->last_alpha_message[ALPHA_SIZE] = 0;
+      for (int w = 0; w < AD2_STATE_RECORD_ZONE_WORDS && w < AD2_ZONE_WORDS; w++) {
+              const uint8_t *z = &buf[56 + w * 4];
+              s->zone_faults[w] = (uint32_t)z[0] | ((uint32_t)z[1] << 8) |
+                                  ((uint32_t)z[2] << 16) | ((uint32_t)z[3] << 24);
+      }
+
+      return true;
+}
+
+/**
+* function: ad2_json_begin
+* start a JSON object in buf.
+*
+* out: AD2JsonWriter *
+* description: writer state
+*
+* in: char *, size_t
+* description: output buffer and its size including the NUL
+ *
+*/
+void ad2_json_begin(AD2JsonWriter *w, char *buf, size_t size)
+{
+      w->start = buf;
+      w->p = buf;
+      w->end = buf + size - 1;
+      w->first = true;
+      w->full = false;
+      ad2_json_put(w, "{", 1);
+}
+
+/**
+* function: ad2_json_put
+* append raw bytes. Stops at the end of the buffer and sets full.
+*
+* in: const char *, size_t
+* description: bytes to append
+ *
+*/
+void ad2_json_put(AD2JsonWriter *w, const char *str, size_t len)
+{
+      for (; len; len--) {
+              if (w->p == w->end) {
+                      w->full = true;
+                      break;
+              }
+              *w->p++ = *str++;
+      }
+}
+
+/**
+* function: ad2_json_key
+* append a member name and the ':'.
+*
+* in: const char *
+* description: member name. Not escaped.
+ *
+*/
+void ad2_json_key(AD2JsonWriter *w, const char *key)
+{
+      if (!w->first)
+              ad2_json_put(w, ",", 1);
+      w->first = false;
+      ad2_json_put(w, "\"", 1);
+      ad2_json_put(w, key, strlen(key));
+      ad2_json_put(w, "\":", 2);
+}
+
+/**
+* function: ad2_json_bool
+* append a true/false member.
+ *
+*/
+void ad2_json_bool(AD2JsonWriter *w, const char *key, bool val)
+{
+      ad2_json_key(w, key);
+      ad2_json_put(w, val ? "true" : "false", val ? 4 : 5);
+}
+
+/**
+* function: ad2_json_uint
+* append an unsigned number member.
+ *
+*/
+void ad2_json_uint(AD2JsonWriter *w, const char *key, uint32_t val)
+{
+      char num[10];
+      char *n = num + sizeof(num);
+
+      do {
+              *--n = '0' + val % 10;
+              val /= 10;
+      } while (val);
+
+      ad2_json_key(w, key);
+      ad2_json_put(w, n, num + sizeof(num) - n);
+}
+
+/**
+* function: ad2_json_string
+* append a string member. '"' and '\' are escaped and control characters
+* are written as spaces.
+*
+* in: const char *, size_t
+* description: string and its length
+ *
+*/
+void ad2_json_string(AD2JsonWriter *w, const char *key, const char *str, size_t len)
+{
+      ad2_json_key(w, key);
+      ad2_json_put(w, "\"", 1);
+      for (size_t i = 0; i < len; i++) {
+              char c = str[i];
+              if (c == '"' || c == '\\')
+                      ad2_json_put(w, "\\", 1);
+              else if ((uint8_t)c < ' ')
+                      c = ' ';
+              ad2_json_put(w, &c, 1);
+      }
+      ad2_json_put(w, "\"", 1);
+}
+
+/**
+* function: ad2_json_end
+* close the object and NUL terminate it. Returns its length.
+ *
+*/
+size_t ad2_json_end(AD2JsonWriter *w)
+{
+      ad2_json_put(w, "}", 1);
+      *w->p = 0;
+
+      return w->p - w->start;
+}
+
+// Partition state flags written by ad2_json_state().
+static const struct {
+      uint32_t flag;
+      const char *key;
+} ad2_json_flags[] = {
+      {AD2_FLAG_READY, "ready"},
+      {AD2_FLAG_ARMED_AWAY, "armed_away"},
+      {AD2_FLAG_ARMED_HOME, "armed_home"},
+      {AD2_FLAG_BACKLIGHT, "backlight_on"},
+      {AD2_FLAG_PROGMODE, "programming_mode"},
+      {AD2_FLAG_BYPASS, "zone_bypassed"},
+      {AD2_FLAG_ACPOWER, "ac_power"},
+      {AD2_FLAG_CHIME, "chime_on"},
+      {AD2_FLAG_ALARMSTICKY, "alarm_event_occured"},
+      {AD2_FLAG_ALARM, "alarm_sounding"},
+      {AD2_FLAG_LOWBATTERY, "battery_low"},
+      {AD2_FLAG_ENTRYDELAY, "entry_delay_off"},
+      {AD2_FLAG_FIRE, "fire_alarm"},
+      {AD2_FLAG_SYSISSUE, "system_issue"},
+      {AD2_FLAG_PERIMETERONLY, "perimeter_only"},
+      {AD2_FLAG_EXIT_NOW, "exit_now"},
+      {AD2_FLAG_SYSSPECIFIC, "system_specific"},
+};
+
+/**
+* function: ad2_json_state
+* append the members of a partition state. With prev only the members
+* that differ from prev are written.
+*
+* in: const AD2VirtualPartitionState *
+* description: partition state
+*
+* in: const AD2VirtualPartitionState *
+* description: earlier state of the partition or nullptr for all members
+ *
+*/
+void ad2_json_state(AD2JsonWriter *w, const AD2VirtualPartitionState *s,
+                    const AD2VirtualPartitionState *prev)
+{
+      // The address mask as 32 '0'/'1' characters. Address or partition 0
+      // first.
+      if (!prev || prev->address_mask_filter != s->address_mask_filter) {
+              char mask[AD2_ADDRESS_BITS];
+              for (int i = 0; i < AD2_ADDRESS_BITS; i++)
+                      mask[i] = (s->address_mask_filter & (1UL << i)) ? '1' : '0';
+              ad2_json_string(w, "address_mask_filter", mask, sizeof(mask));
+      }
+
+      if (!prev || prev->display_cursor_type != s->display_cursor_type)
+              ad2_json_uint(w, "display_cursor_type", s->display_cursor_type);
+      if (!prev || prev->display_cursor_location != s->display_cursor_location)
+              ad2_json_uint(w, "display_cursor_location", s->display_cursor_location);
+
+      uint32_t changed = prev ? s->changedFlags(*prev) : 0xffffffff;
+      for (size_t i = 0; i < sizeof(ad2_json_flags) / sizeof(ad2_json_flags[0]); i++) {
+              if (changed & ad2_json_flags[i].flag)
+                      ad2_json_bool(w, ad2_json_flags[i].key, s->isSet(ad2_json_flags[i].flag));
+      }
+
+      if (!prev || prev->beeps != s->beeps) {
+              char beeps = s->beeps;
+              ad2_json_string(w, "beeps", &beeps, 1);
+      }
+      if (!prev || prev->panel_type != s->panel_type)
+              ad2_json_string(w, "panel_type", &s->panel_type, 1);
+      if (!prev || strcmp(prev->last_alpha_message, s->last_alpha_message))
+              ad2_json_string(w, "last_alpha_message", s->last_alpha_message,
+                              strlen(s->last_alpha_message));
+      if (!prev || prev->last_numeric_message != s->last_numeric_message)
+              ad2_json_uint(w, "last_numeric_message", s->last_numeric_message);
+
+      // The whole zone list is written when it changes. Room is kept to
+      // close the list and the object.
+      if (!prev || memcmp(prev->zone_faults, s->zone_faults, sizeof(s->zone_faults))) {
+              uint8_t n = 0;
+              ad2_json_key(w, "zones_faulted");
+              ad2_json_put(w, "[", 1);
+              for (uint8_t z = 1; z <= AD2_MAX_ZONES && n < s->zone_fault_count; z++) {
+                      if (!s->isZoneFaulted(z))
+                              continue;
+                      if (w->end - w->p <= 6) {
+                              w->full = true;
+                              break;
+                      }
+                      char num[5];
+                      int len = snprintf(num, sizeof(num), n++ ? ",%u" : "%u", z);
+                      ad2_json_put(w, num, len);
+              }
+              ad2_json_put(w, "]", 1);
+      }
+}
+
+/**
+* function: ad2_json_state_changed
+* true if any member ad2_json_state() writes differs between s and prev.
+*
+* in: const AD2VirtualPartitionState *
+* description: partition state
+*
+* in: const AD2VirtualPartitionState *
+* description: earlier state of the partition
+ *
+*/
+bool ad2_json_state_changed(const AD2VirtualPartitionState *s,
+                            const AD2VirtualPartitionState *prev)
+{
+      uint32_t changed = s->changedFlags(*prev);
+      for (size_t i = 0; i < sizeof(ad2_json_flags) / sizeof(ad2_json_flags[0]); i++) {
+              if (changed & ad2_json_flags[i].flag)
+                      return true;
+      }
+
+      return prev->address_mask_filter != s->address_mask_filter ||
+             prev->display_cursor_type != s->display_cursor_type ||
+             prev->display_cursor_location != s->display_cursor_location ||
+             prev->beeps != s->beeps ||
+             prev->panel_type != s->panel_type ||
+             prev->last_numeric_message != s->last_numeric_message ||
+             strcmp(prev->last_alpha_message, s->last_alpha_message) ||
+             memcmp(prev->zone_faults, s->zone_faults, sizeof(s->zone_faults));
+}
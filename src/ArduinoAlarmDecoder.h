@@ -24,8 +24,8 @@
 #ifndef AlarmDecoder_h
 #define AlarmDecoder_h
 #include <stdint.h>
+#include <stddef.h>
 #include <WString.h>
-#include <map>
 #include "Arduino.h"
 
 // types and defines
@@ -34,13 +34,188 @@ enum AD2_PARSER_STATES {
   AD2_PARSER_RESET            = 0,
   AD2_PARSER_SCANNING_START   = 1,
   AD2_PARSER_SCANNING_EOL     = 2,
-  AD2_PARSER_PROCESSING       = 3
+  AD2_PARSER_PROCESSING       = 3,
+  AD2_PARSER_DISCARDING       = 4
 };
 
 // The actual max is ~90 but leave some room for future.
-// WARN: use int8_t so must be <= 127 for overflow protection.
 #define ALARMDECODER_MAX_MESSAGE_SIZE 120
 
+// Number of partition states kept including the system partition(mask 0).
+// Storage is reserved up front. Masks that need more are dropped.
+#ifndef AD2_MAX_PARTITIONS
+#define AD2_MAX_PARTITIONS 9
+#endif
+
+// Keypad address(Ademco) / partition(DSC) bits in an address mask.
+#define AD2_ADDRESS_BITS 32
+
+// Zones tracked per partition. Zone n is bit n of a bitset.
+#define AD2_MAX_ZONES 250
+#define AD2_ZONE_WORDS ((AD2_MAX_ZONES + 32) / 32)
+
+// Faulted zones that can wait on a restore timeout at the same time.
+#ifndef AD2_MAX_ZONE_FAULTS
+#define AD2_MAX_ZONE_FAULTS 32
+#endif
+#if AD2_MAX_ZONE_FAULTS > 255
+#error AD2_MAX_ZONE_FAULTS must be less than 256
+#endif
+
+// A faulted zone that is not shown again for this long is restored.
+#ifndef AD2_ZONE_TIMEOUT_MS
+#define AD2_ZONE_TIMEOUT_MS 30000
+#endif
+
+// Restore timeout timer wheel tick and number of slots. Power of 2.
+#ifndef AD2_ZONE_TICK_MS
+#define AD2_ZONE_TICK_MS 1000
+#endif
+#ifndef AD2_ZONE_WHEEL_SLOTS
+#define AD2_ZONE_WHEEL_SLOTS 16
+#endif
+#if AD2_ZONE_WHEEL_SLOTS & (AD2_ZONE_WHEEL_SLOTS - 1)
+#error AD2_ZONE_WHEEL_SLOTS must be a power of 2
+#endif
+
+// Library log levels. Messages above AD2_LOG_LEVEL are not compiled in.
+#define AD2_LOG_NONE  0
+#define AD2_LOG_ERROR 1
+#define AD2_LOG_WARN  2
+#define AD2_LOG_INFO  3
+#define AD2_LOG_DEBUG 4
+#ifndef AD2_LOG_LEVEL
+#define AD2_LOG_LEVEL AD2_LOG_NONE
+#endif
+
+// Where log messages are printed.
+#ifndef AD2_LOG_OUTPUT
+#define AD2_LOG_OUTPUT Serial
+#endif
+
+#if AD2_LOG_LEVEL >= AD2_LOG_ERROR
+#define AD2_LOGE(fmt, ...) AD2_LOG_OUTPUT.printf("!ERR: " fmt "\r\n", ##__VA_ARGS__)
+#else
+#define AD2_LOGE(fmt, ...) do {} while (0)
+#endif
+#if AD2_LOG_LEVEL >= AD2_LOG_WARN
+#define AD2_LOGW(fmt, ...) AD2_LOG_OUTPUT.printf("!WRN: " fmt "\r\n", ##__VA_ARGS__)
+#else
+#define AD2_LOGW(fmt, ...) do {} while (0)
+#endif
+#if AD2_LOG_LEVEL >= AD2_LOG_INFO
+#define AD2_LOGI(fmt, ...) AD2_LOG_OUTPUT.printf("!INF: " fmt "\r\n", ##__VA_ARGS__)
+#else
+#define AD2_LOGI(fmt, ...) do {} while (0)
+#endif
+#if AD2_LOG_LEVEL >= AD2_LOG_DEBUG
+#define AD2_LOGD(fmt, ...) AD2_LOG_OUTPUT.printf("!DBG: " fmt "\r\n", ##__VA_ARGS__)
+#else
+#define AD2_LOGD(fmt, ...) do {} while (0)
+#endif
+
+// Records kept in the binary trace ring. 0 removes it. Power of 2.
+#ifndef AD2_TRACE_SIZE
+#define AD2_TRACE_SIZE 0
+#endif
+#if AD2_TRACE_SIZE & (AD2_TRACE_SIZE - 1)
+#error AD2_TRACE_SIZE must be a power of 2
+#endif
+
+// Trace record types.
+enum AD2_TRACE_TYPES {
+  AD2_TRACE_KEYPAD            = 1,
+  AD2_TRACE_REPEAT            = 2,
+  AD2_TRACE_LRR               = 3,
+  AD2_TRACE_EXP               = 4,
+  AD2_TRACE_RFX               = 5,
+  AD2_TRACE_AUI               = 6,
+  AD2_TRACE_KPM               = 7,
+  AD2_TRACE_KPE               = 8,
+  AD2_TRACE_CRC               = 9,
+  AD2_TRACE_VER               = 10,
+  AD2_TRACE_ERR               = 11,
+  AD2_TRACE_UNKNOWN           = 12,
+  AD2_TRACE_BAD_PREFIX        = 13,
+  AD2_TRACE_BAD_KEYPAD        = 14,
+  AD2_TRACE_NO_PARTITION      = 15,
+  AD2_TRACE_OVERFLOW          = 16,
+  AD2_TRACE_CORRUPT           = 17,
+  AD2_TRACE_SENDING           = 18,
+  AD2_TRACE_CONFIG            = 19,
+  AD2_TRACE_PREFIX            = 20,
+  AD2_TRACE_ZONE_FAULT        = 21,
+  AD2_TRACE_ZONE_RESTORE      = 22
+};
+
+// '!' message types.
+enum AD2_MESSAGE_TYPES {
+  AD2_MSG_UNKNOWN             = 0,
+  AD2_MSG_LRR                 = 1,
+  AD2_MSG_EXP                 = 2,
+  AD2_MSG_REL                 = 3,
+  AD2_MSG_RFX                 = 4,
+  AD2_MSG_AUI                 = 5,
+  AD2_MSG_KPM                 = 6,
+  AD2_MSG_KPE                 = 7,
+  AD2_MSG_CRC                 = 8,
+  AD2_MSG_VER                 = 9,
+  AD2_MSG_ERR                 = 10,
+  AD2_MSG_SENDING             = 11,
+  AD2_MSG_CONFIG              = 12
+};
+#define AD2_MSG_TYPE_COUNT 13
+
+// Handlers the application can add for '!' prefixes the parser does not
+// know. Checked in the order added.
+#ifndef AD2_MAX_PREFIX_HANDLERS
+#define AD2_MAX_PREFIX_HANDLERS 4
+#endif
+
+/**
+ * Number of messages AD2QueueParser can hold. Power of 2.
+ */
+#ifndef AD2_QUEUE_SIZE
+#define AD2_QUEUE_SIZE 16
+#endif
+
+/**
+ * AD2CommandQueue limits and pacing. Commands are whole keypad sequences
+ * up to AD2_CMD_MAX_SIZE bytes. After a command is written the next waits
+ * AD2_CMD_GAP_MS plus AD2_CMD_KEY_MS per byte so the AD2* can pass the
+ * keys to the panel at keypad speed. The same command from another source
+ * within AD2_CMD_DEDUP_MS of the first is merged.
+ */
+#ifndef AD2_CMD_QUEUE_SIZE
+#define AD2_CMD_QUEUE_SIZE 8
+#endif
+#ifndef AD2_CMD_MAX_SIZE
+#define AD2_CMD_MAX_SIZE 64
+#endif
+#ifndef AD2_CMD_GAP_MS
+#define AD2_CMD_GAP_MS 100
+#endif
+#ifndef AD2_CMD_KEY_MS
+#define AD2_CMD_KEY_MS 10
+#endif
+#ifndef AD2_CMD_DEDUP_MS
+#define AD2_CMD_DEDUP_MS 1000
+#endif
+
+/**
+ * Number of subscribe() slots.
+ */
+#ifndef AD2_MAX_SUBSCRIBERS
+#define AD2_MAX_SUBSCRIBERS 8
+#endif
+
+// Legacy String* callbacks. Each message is copied into a String before the
+// callbacks are called. Set to 0 to remove them and only use the zero copy
+// AD2MessageView callbacks.
+#ifndef AD2_STRING_CALLBACKS
+#define AD2_STRING_CALLBACKS 1
+#endif
+
 #define BIT_ON '1'
 #define BIT_OFF '0'
 #define BIT_UNDEFINED '-'
@@ -79,7 +254,41 @@ enum AD2_PARSER_STATES {
 #define PANEL_TYPE_BYTE    18
 #define UNUSED_1_BYTE      19
 #define UNUSED_2_BYTE      20
+#define BIT_FIELD_BYTES    20
+
+// Keypad message and alpha field sizes.
+#define KEYPAD_MESSAGE_SIZE 94
+#define ALPHA_SIZE          32
+
+// Packed section #1 flags. Bit (n - 1) is set if byte n is BIT_ON.
+#define AD2_BIT(byte)               (1UL << ((byte) - 1))
+#define AD2_FLAG_READY              AD2_BIT(READY_BYTE)
+#define AD2_FLAG_ARMED_AWAY         AD2_BIT(ARMED_AWAY_BYTE)
+#define AD2_FLAG_ARMED_HOME         AD2_BIT(ARMED_HOME_BYTE)
+#define AD2_FLAG_BACKLIGHT          AD2_BIT(BACKLIGHT_BYTE)
+#define AD2_FLAG_PROGMODE           AD2_BIT(PROGMODE_BYTE)
+#define AD2_FLAG_BYPASS             AD2_BIT(BYPASS_BYTE)
+#define AD2_FLAG_ACPOWER            AD2_BIT(ACPOWER_BYTE)
+#define AD2_FLAG_CHIME              AD2_BIT(CHIME_BYTE)
+#define AD2_FLAG_ALARMSTICKY        AD2_BIT(ALARMSTICKY_BYTE)
+#define AD2_FLAG_ALARM              AD2_BIT(ALARM_BYTE)
+#define AD2_FLAG_LOWBATTERY         AD2_BIT(LOWBATTERY_BYTE)
+#define AD2_FLAG_ENTRYDELAY         AD2_BIT(ENTRYDELAY_BYTE)
+#define AD2_FLAG_FIRE               AD2_BIT(FIRE_BYTE)
+#define AD2_FLAG_SYSISSUE           AD2_BIT(SYSISSUE_BYTE)
+#define AD2_FLAG_PERIMETERONLY      AD2_BIT(PERIMETERONLY_BYTE)
+#define AD2_FLAG_SYSSPECIFIC        AD2_BIT(SYSSPECIFIC_BYTE)
+#define AD2_FLAG_UNUSED_1           AD2_BIT(UNUSED_1_BYTE)
+#define AD2_FLAG_UNUSED_2           AD2_BIT(UNUSED_2_BYTE)
 
+// Flags derived from the alpha message stored above the section #1 bits.
+#define AD2_FLAG_EXIT_NOW           (1UL << BIT_FIELD_BYTES)
+
+// Set once a partition state has been filled from a keypad message.
+#define AD2_FLAG_VALID              (1UL << 31)
+
+// Flags that make up the armed state.
+#define AD2_FLAG_ARMED              (AD2_FLAG_ARMED_AWAY | AD2_FLAG_ARMED_HOME)
 
 
 
@@ -87,11 +296,165 @@ enum AD2_PARSER_STATES {
  * Utility functions/macros.
  */
 
+#define AD2_CTZ(x) __builtin_ctz(x)
+
+// The 4 bytes after '!' packed into one word identify a message type.
+#define AD2_TAG(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | \
+                             ((uint32_t)(c) <<  8) |  (uint32_t)(d))
+
+// Slot of a tag in the 16 entry '!' message table. The multiplier gives
+// every known tag its own slot.
+#define AD2_TAG_HASH_MUL 0x025b413fUL
+#define AD2_TAG_SLOT(tag) ((uint32_t)((uint32_t)(tag) * (uint32_t)AD2_TAG_HASH_MUL) >> 28)
+
 #define AD2_NTOHL(x) ((((x) & 0xff000000UL) >> 24) | \
                     (((x) & 0x00ff0000UL) >>  8) | \
                     (((x) & 0x0000ff00UL) <<  8) | \
                     (((x) & 0x000000ffUL) << 24))
 
+/**
+ * Fields of a keypad message decoded in place.
+ *
+ * Filled by ad2_decode_keypad() in a single pass over the message. The
+ * alpha pointer refers to the 32 characters inside the message and is not
+ * NUL terminated.
+ */
+struct AD2KeypadMessage
+{
+  // Section #1 bit fields as AD2_FLAG_* bits.
+  uint32_t flags;
+  // Section #3 address mask in host order.
+  uint32_t address_mask;
+  // Section #2 numeric data.
+  uint16_t numeric;
+  // Section #3 cursor.
+  uint8_t cursor_type;
+  uint8_t cursor_location;
+  // Section #1 non bit values.
+  char beeps;
+  char panel_type;
+  // Section #4 alpha data.
+  const char *alpha;
+};
+
+/**
+ * Field inside a message. Not NUL terminated.
+ */
+struct AD2Field
+{
+  const char *data;
+  uint8_t len;
+};
+
+/**
+ * !LRR: Long range radio / contact ID event.
+ *  !LRR:008,1,CID_3401,ff
+ *       |   | |        ^- optional report code(hex)
+ *       |   | ^---------- event type
+ *       |   ^------------ partition
+ *       ^---------------- event data(user or zone)
+ *
+ * For CID_ events the qualifier(1 new event/open 3 restore/close 6 status)
+ * and the 3 digit event code are decoded as well. The code is read as hex
+ * digits so CID 401 is 0x401.
+ */
+struct AD2LRRMessage
+{
+  AD2Field event_data;
+  AD2Field event_type;
+  uint8_t partition;
+  bool is_cid;
+  uint8_t cid_qualifier;
+  uint16_t cid_code;
+  bool has_report_code;
+  uint8_t report_code;
+};
+
+// !RFX: value bits.
+#define AD2_RFX_BATTERY             0x02
+#define AD2_RFX_SUPERVISION         0x04
+#define AD2_RFX_LOOP1               0x80
+#define AD2_RFX_LOOP2               0x20
+#define AD2_RFX_LOOP3               0x10
+#define AD2_RFX_LOOP4               0x40
+
+/**
+ * !RFX: Wireless sensor status.
+ *  !RFX:0180036,80
+ *       |       ^- value(hex) see AD2_RFX_*
+ *       ^--------- serial number
+ */
+struct AD2RFXMessage
+{
+  AD2Field serial;
+  uint32_t serial_number;
+  uint8_t value;
+  bool battery;
+  bool supervision;
+  // loop[0] is loop 1.
+  bool loop[4];
+};
+
+/**
+ * !EXP: Zone expander and !REL: relay module status.
+ *  !EXP:07,01,01
+ *       |  |  ^- value
+ *       |  ^---- channel
+ *       ^------- address
+ */
+struct AD2EXPMessage
+{
+  uint8_t address;
+  uint8_t channel;
+  uint8_t value;
+  // true for !REL: messages.
+  bool relay;
+};
+
+// !VER: capability bits.
+#define AD2_CAP_TX                  (1UL << 0)
+#define AD2_CAP_RX                  (1UL << 1)
+#define AD2_CAP_SM                  (1UL << 2)
+#define AD2_CAP_VZ                  (1UL << 3)
+#define AD2_CAP_RF                  (1UL << 4)
+#define AD2_CAP_ZX                  (1UL << 5)
+#define AD2_CAP_RE                  (1UL << 6)
+#define AD2_CAP_AU                  (1UL << 7)
+#define AD2_CAP_3X                  (1UL << 8)
+#define AD2_CAP_CG                  (1UL << 9)
+#define AD2_CAP_DD                  (1UL << 10)
+#define AD2_CAP_MF                  (1UL << 11)
+#define AD2_CAP_LR                  (1UL << 12)
+#define AD2_CAP_KE                  (1UL << 13)
+#define AD2_CAP_MK                  (1UL << 14)
+#define AD2_CAP_CB                  (1UL << 15)
+#define AD2_CAP_DS                  (1UL << 16)
+#define AD2_CAP_ER                  (1UL << 17)
+#define AD2_CAP_CR                  (1UL << 18)
+
+/**
+ * !VER: Firmware version and capabilities.
+ *  !VER:ffffffff,V2.2a.8.8,TX;RX;SM;VZ;RF;ZX;RE;AU;3X;CG;DD;MF;LR;KE;MK;CB
+ *       |        |         ^- capabilities see AD2_CAP_*
+ *       |        ^----------- version
+ *       ^-------------------- serial number(hex)
+ */
+struct AD2VERMessage
+{
+  uint32_t serial_number;
+  AD2Field version;
+  AD2Field capability_list;
+  uint32_t capabilities;
+};
+
+/**
+ * !AUI: !KPE: !CRC: and !ERR: messages. Only the data after the prefix.
+ */
+struct AD2DataMessage
+{
+  AD2Field data;
+};
+
 /**
  * Data structure for each Virtual partition state.
  *
@@ -130,62 +493,615 @@ class AD2VirtualPartitionState
   public:
 
   // Address mask filter for this partition
-  uint32_t address_mask_filter;
+  uint32_t address_mask_filter = 0;
 
   // Partition number(external lookup required for Ademco)
-  uint8_t partition;
+  uint8_t partition = 0;
 
   // Calculated from section #3(Raw)
   uint8_t display_cursor_type = 0;     // 0[OFF] 1[UNDERLINE] 2[INVERT]
   uint8_t display_cursor_location = 0; // 1-32
 
-  // SECTION #1 data
-  //  https://www.alarmdecoder.com/wiki/index.php/Protocol#Bit_field
-  bool ready = false;
-  bool armed_away = false;
-  bool armed_home = false;
-  bool backlight_on = false;
-  bool programming_mode = false;
-  bool zone_bypassed = false;
-  bool ac_power = false;
-  bool chime_on = false;
-  bool alarm_event_occurred = false;
-  bool alarm_sounding = false;
-  bool battery_low = false;
-  bool entry_delay_off = false;
-  bool fire_alarm = false;
-  bool system_issue = false;
-  bool perimeter_only = false;
-  bool exit_now = false;
-  bool system_specific = false;
+  // SECTION #1 non bit data
   uint8_t beeps = 0;
   char panel_type = '?';
-  bool unused1 = false;
-  bool unused2 = false;
 
-  String last_alpha_message = "";
-  String last_numeric_message = "";
+  // SECTION #2 data
+  uint16_t last_numeric_message = 0;
+
+  // SECTION #1 data
+  //  https://www.alarmdecoder.com/wiki/index.php/Protocol#Bit_field
+  // All state bits are kept in one word using the AD2_FLAG_* bits.
+  // The named bit fields overlay the same word so older code using
+  // s->ready etc. still works. Bit n holds section #1 byte n + 1.
+  union {
+    uint32_t flags = 0;
+    struct {
+      uint32_t ready : 1;
+      uint32_t armed_away : 1;
+      uint32_t armed_home : 1;
+      uint32_t backlight_on : 1;
+      uint32_t programming_mode : 1;
+      uint32_t : 1;                    // BEEPMODE_BYTE
+      uint32_t zone_bypassed : 1;
+      uint32_t ac_power : 1;
+      uint32_t chime_on : 1;
+      uint32_t alarm_event_occurred : 1;
+      uint32_t alarm_sounding : 1;
+      uint32_t battery_low : 1;
+      uint32_t entry_delay_off : 1;
+      uint32_t fire_alarm : 1;
+      uint32_t system_issue : 1;
+      uint32_t perimeter_only : 1;
+      uint32_t system_specific : 1;
+      uint32_t : 1;                    // PANEL_TYPE_BYTE
+      uint32_t unused1 : 1;
+      uint32_t unused2 : 1;
+      uint32_t exit_now : 1;
+    };
+  };
+
+  // SECTION #4 data
+  char last_alpha_message[ALPHA_SIZE + 1] = "";
+
+  // Fingerprint of the last keypad message for this partition, when it
+  // was last received(millis) and how many times in a row it repeated.
+  uint32_t message_hash = 0;
+  uint32_t last_seen = 0;
+  uint32_t repeat_count = 0;
+
+  // Faulted zones. Bit n is zone n.
+  uint32_t zone_faults[AD2_ZONE_WORDS] = {0};
+  uint8_t zone_fault_count = 0;
+
+  // Zone shown by the last keypad message if it was a FAULT message or 0.
+  uint8_t last_fault_zone = 0;
+
+  // Zone of the ON_ZONE_FAULT or ON_ZONE_RESTORE event being called.
+  uint8_t last_zone_event = 0;
+
+  // Test a state bit.
+  inline bool isSet(uint32_t flag) const {
+    return (flags & flag) != 0;
+  }
+
+  // Set or clear a state bit.
+  inline void setFlag(uint32_t flag, bool on) {
+    flags = on ? (flags | flag) : (flags & ~flag);
+  }
+
+  // Test if a zone is faulted.
+  inline bool isZoneFaulted(uint8_t zone) const {
+    return zone <= AD2_MAX_ZONES && (zone_faults[zone >> 5] >> (zone & 31)) & 1;
+  }
+
+  // State bits that differ from another state.
+  inline uint32_t changedFlags(const AD2VirtualPartitionState &other) const {
+    return flags ^ other.flags;
+  }
+
+};
+
+/**
+ * Compact record of a parser event kept in the trace ring.
+ */
+struct AD2TraceRecord
+{
+  uint32_t time;        // millis()
+  uint32_t flags;       // partition state flags for keypad messages
+  uint16_t len;         // message length
+  uint8_t type;         // AD2_TRACE_*
+  uint8_t partition;    // partition number or 0xff
+};
+
+/**
+ * Parser counters. Read with AlarmDecoderParser::getStats().
+ */
+struct AD2ParserStats
+{
+  uint32_t bytes_in;              // bytes passed to put()
+  uint32_t lines;                 // complete lines processed
+  uint32_t keypad;                // keypad messages decoded
+  uint32_t repeats;               // repeated keypad messages skipped
+  uint32_t types[AD2_MSG_TYPE_COUNT]; // '!' messages by AD2_MSG_*
+  uint32_t drops;                 // keypad messages with no partition storage
+  uint32_t overflow;              // lines longer than the line buffer
+  uint32_t corrupt;               // resets on a non printable byte
+  uint32_t length_rejects;        // malformed keypad messages
+  uint32_t bad_prefix;            // lines not starting with '!' or '['
+  uint16_t max_line;              // longest line processed
+  uint32_t max_dispatch_us;       // longest time to process a line
+  uint32_t queue_drops;           // messages not queued by AD2QueueParser
+};
+
+/**
+ * Capture format for raw AD2* streams.
+ *
+ * An 8 byte file header "AD2CAP", version, 0 followed by one record for
+ * each chunk read from the AD2*. A record is the time since the previous
+ * record in microseconds(uint32) and the chunk length(uint16) both little
+ * endian followed by the chunk bytes.
+ */
+#define AD2_CAPTURE_VERSION         1
+#define AD2_CAPTURE_HEADER_SIZE     8
+#define AD2_CAPTURE_RECORD_SIZE     6
+
+/**
+ * Binary partition state record. A fixed size alternative to the JSON
+ * state for clients that only need to test a few bits. All fields are
+ * little endian.
+ *
+ *  0 AD2_STATE_RECORD_VERSION      1 partition
+ *  2 numeric field(uint16)         4 state version(uint32)
+ *  8 address mask(uint32)         12 AD2_FLAG_* bits(uint32)
+ * 16 cursor type  17 cursor location  18 beeps  19 panel type
+ * 20 faulted zone count           21 3 zero bytes
+ * 24 alpha text, 32 bytes NUL padded
+ * 56 faulted zones, 8 uint32 words. Bit n is zone n.
+ */
+#define AD2_STATE_RECORD_VERSION    1
+#define AD2_STATE_RECORD_SIZE       88
+#define AD2_STATE_RECORD_ZONE_WORDS 8
 
+/**
+ * JSON object writer into a fixed buffer. Output stops at the end of the
+ * buffer and sets full instead of overflowing. Start with
+ * ad2_json_begin() and close with ad2_json_end().
+ */
+struct AD2JsonWriter
+{
+  char *start;
+  char *p;
+  char *end;
+  bool first;           // no key written yet
+  bool full;            // output was cut short
+};
+
+/**
+ * Non-owning view of a complete message.
+ *
+ * The data points into the parser line buffer and is NUL terminated. It is
+ * only valid until the callback returns. Copy it if it needs to be kept.
+ */
+struct AD2MessageView
+{
+  const char *data;
+  uint16_t len;
 };
 
-typedef std::map<uint32_t, AD2VirtualPartitionState *> ad2pstates_t;
+/**
+ * Parser events. Subscribers select events with AD2_EVENT_MASK() bits.
+ */
+enum AD2_EVENTS {
+  AD2_EV_RAW_MESSAGE = 0,
+  AD2_EV_ARM,
+  AD2_EV_DISARM,
+  AD2_EV_POWER_CHANGE,
+  AD2_EV_READY_CHANGE,
+  AD2_EV_ALARM,
+  AD2_EV_ALARM_RESTORED,
+  AD2_EV_FIRE,
+  AD2_EV_BYPASS,
+  AD2_EV_BOOT,
+  AD2_EV_CONFIG_RECEIVED,
+  AD2_EV_ZONE_FAULT,
+  AD2_EV_ZONE_RESTORE,
+  AD2_EV_LOW_BATTERY,
+  AD2_EV_PANIC,
+  AD2_EV_RELAY_CHANGED,
+  AD2_EV_CHIME_CHANGED,
+  AD2_EV_MESSAGE,
+  AD2_EV_EXPANDER_MESSAGE,
+  AD2_EV_LRR,
+  AD2_EV_RFX,
+  AD2_EV_SENDING_RECEIVED,
+  AD2_EV_AUI,
+  AD2_EV_KPM,
+  AD2_EV_KPE,
+  AD2_EV_CRC,
+  AD2_EV_VER,
+  AD2_EV_ERR
+};
+#define AD2_EVENT_COUNT 28
+#define AD2_EVENT_MASK(EV) (1UL << (EV))
+#define AD2_EVENT_ALL ((1UL << AD2_EVENT_COUNT) - 1)
+
+// Events fired by notify_changes() for partition state transitions.
+#define AD2_EVENT_TRANSITIONS (AD2_EVENT_MASK(AD2_EV_ARM) | \
+                               AD2_EVENT_MASK(AD2_EV_DISARM) | \
+                               AD2_EVENT_MASK(AD2_EV_POWER_CHANGE) | \
+                               AD2_EVENT_MASK(AD2_EV_READY_CHANGE) | \
+                               AD2_EVENT_MASK(AD2_EV_ALARM) | \
+                               AD2_EVENT_MASK(AD2_EV_ALARM_RESTORED) | \
+                               AD2_EVENT_MASK(AD2_EV_FIRE) | \
+                               AD2_EVENT_MASK(AD2_EV_BYPASS) | \
+                               AD2_EVENT_MASK(AD2_EV_LOW_BATTERY) | \
+                               AD2_EVENT_MASK(AD2_EV_CHIME_CHANGED))
+
+typedef void (*AD2ParserCallback_view_t)(const AD2MessageView*, AD2VirtualPartitionState*);
+// Typed callbacks get the decoded fields of the message as well.
+typedef void (*AD2ParserCallback_lrr_t)(const AD2MessageView*, const AD2LRRMessage*);
+typedef void (*AD2ParserCallback_rfx_t)(const AD2MessageView*, const AD2RFXMessage*);
+typedef void (*AD2ParserCallback_exp_t)(const AD2MessageView*, const AD2EXPMessage*);
+typedef void (*AD2ParserCallback_ver_t)(const AD2MessageView*, const AD2VERMessage*);
+typedef void (*AD2ParserCallback_data_t)(const AD2MessageView*, const AD2DataMessage*);
+typedef void (*AD2ParserCallback_zone_t)(AD2VirtualPartitionState*, uint8_t zone);
+// Subscriber callbacks get their context pointer and the AD2_EV_* event.
+typedef void (*AD2ParserCallback_sub_t)(void *ctx, uint8_t event, const AD2MessageView*, AD2VirtualPartitionState*);
+#if AD2_STRING_CALLBACKS
 typedef void (*AD2ParserCallback_msg_t)(String*, AD2VirtualPartitionState*);
+#endif
+// Type of nullptr. Picks the clearing overload of the setCB_ functions
+// so setCB_ON_x(nullptr) is not ambiguous between callback types.
+typedef decltype(nullptr) ad2_nullptr_t;
+
+// Utility functions.
+bool is_bit_set(int pos, const char * bitStr);
+uint32_t ad2_parse_hex(const char *str, uint8_t len);
+uint32_t ad2_parse_dec(const char *str, uint8_t len);
+bool ad2_decode_keypad(const char *msg, uint16_t len, AD2KeypadMessage *km);
+uint32_t ad2_hash(const char *str, uint16_t len);
+uint8_t ad2_message_type(const char *msg, uint16_t len);
+size_t ad2_capture_header(uint8_t *out);
+size_t ad2_capture_record(uint8_t *out, uint32_t delta_us, uint16_t len);
+bool ad2_capture_check(const uint8_t *buf, size_t len);
+const uint8_t * ad2_capture_next(const uint8_t *p, const uint8_t *end,
+                                 uint32_t *delta_us, uint16_t *len);
+size_t ad2_printable_span(const uint8_t *buf, size_t len);
+bool ad2_decode_lrr(const char *msg, uint16_t len, AD2LRRMessage *m);
+bool ad2_decode_rfx(const char *msg, uint16_t len, AD2RFXMessage *m);
+bool ad2_decode_exp(const char *msg, uint16_t len, AD2EXPMessage *m);
+bool ad2_decode_ver(const char *msg, uint16_t len, AD2VERMessage *m);
+bool ad2_decode_data(const char *msg, uint16_t len, AD2DataMessage *m);
+void ad2_stats_add(AD2ParserStats *to, const AD2ParserStats *from);
+size_t ad2_encode_state(uint8_t *out, const AD2VirtualPartitionState *s, uint32_t version);
+bool ad2_decode_state(const uint8_t *buf, size_t len, AD2VirtualPartitionState *s,
+                      uint32_t *version);
+void ad2_json_begin(AD2JsonWriter *w, char *buf, size_t size);
+void ad2_json_put(AD2JsonWriter *w, const char *str, size_t len);
+void ad2_json_key(AD2JsonWriter *w, const char *key);
+void ad2_json_bool(AD2JsonWriter *w, const char *key, bool val);
+void ad2_json_uint(AD2JsonWriter *w, const char *key, uint32_t val);
+void ad2_json_string(AD2JsonWriter *w, const char *key, const char *str, size_t len);
+size_t ad2_json_end(AD2JsonWriter *w);
+void ad2_json_state(AD2JsonWriter *w, const AD2VirtualPartitionState *s,
+                    const AD2VirtualPartitionState *prev);
+bool ad2_json_state_changed(const AD2VirtualPartitionState *s,
+                            const AD2VirtualPartitionState *prev);
+
 
 /**
- * AlarmDecoder protocol parser.
+ * Parser state and the parts of the parser that do not call out to the
+ * application. AD2Parser<> adds event dispatch on top of it.
+ */
+class AD2ParserCore
+{
+  public:
+
+    AD2ParserCore();
+
+    // Reset the parser state machine.
+    void reset_parser();
+
+    // Copy the parser counters. Optionally zero them after the copy so
+    // each read covers the time since the last one.
+    void getStats(AD2ParserStats *out, bool reset = false);
+
+    // Zero the parser counters.
+    void resetStats();
+
+    // Call ON_MESSAGE for repeated identical keypad messages as well.
+    // Off by default. Repeats only update last_seen and repeat_count.
+    void setNotifyRepeats(bool enable);
+
+    // Call cb for '!' messages starting with prefix that are not a known
+    // type. ex. "!boot". The prefix is not copied and must stay valid.
+    // Returns false if all AD2_MAX_PREFIX_HANDLERS are in use.
+    bool addPrefixHandler(const char *prefix, AD2ParserCallback_view_t cb);
+
+    // get AD2PPState by mask create if flag is set and no match found.
+    AD2VirtualPartitionState * getAD2PState(uint32_t *mask, bool update=false);
+
+#if AD2_TRACE_SIZE
+    // Copy up to max trace records oldest first. Returns the number copied.
+    size_t getTrace(AD2TraceRecord *out, size_t max);
+
+    // Print the trace ring oldest first one record per line.
+    void dumpTrace(Print &out);
+
+    // Empty the trace ring.
+    void clearTrace();
+#endif
+
+  protected:
+    // Track all panel states in separate class.
+    // Preallocated partition states. Slot 0 is the system partition.
+    // Slots 1 to AD2PStates_count - 1 are in use in the order first seen.
+    AD2VirtualPartitionState AD2PStates[AD2_MAX_PARTITIONS];
+    uint8_t AD2PStates_count;
+
+    // Partition state for each lowest address bit or nullptr. The system
+    // partition(mask 0) has no bits and is kept separate.
+    AD2VirtualPartitionState *AD2PStates_by_bit[AD2_ADDRESS_BITS];
+    AD2VirtualPartitionState *AD2PStates_system;
+
+    // Last keypad message of each partition(AD2PStates index). A repeat
+    // must match it byte for byte, the hash is only a quick test.
+    char last_keypad[AD2_MAX_PARTITIONS][KEYPAD_MESSAGE_SIZE];
+
+    // Zone restore timers. Timers are kept in a hashed timer wheel of
+    // doubly linked lists so a refresh, cancel or expire touches only the
+    // timers involved. Index 0xff is the end of a list.
+    struct {
+      uint32_t expire;
+      uint8_t next;
+      uint8_t prev;
+      uint8_t partition;    // index in AD2PStates
+      uint8_t zone;
+    } zone_timers[AD2_MAX_ZONE_FAULTS];
+    uint8_t zone_timer_free;
+    uint8_t zone_wheel[AD2_ZONE_WHEEL_SLOTS];
+    uint32_t zone_wheel_tick;
+    uint32_t zone_wheel_ms;
+
+    // Parser state control starts out as AD2_PARSER_RESET.
+    int AD2_Parser_State;
+
+    // Pass repeated keypad messages to ON_MESSAGE.
+    bool notify_repeats;
+
+    // Each message is assembled contiguous in a fixed line buffer with room
+    // for a NUL terminator so callbacks can use it as a C string.
+    char line_buffer[ALARMDECODER_MAX_MESSAGE_SIZE + 1];
+    uint16_t line_len;
+
+    // Parser counters.
+    AD2ParserStats stats;
+
+    // View of the message in line_buffer passed to callbacks.
+    AD2MessageView line_view;
+
+    // Application handlers for unknown '!' prefixes.
+    struct {
+      const char *prefix;
+      uint8_t len;
+      AD2ParserCallback_view_t cb;
+    } prefix_handlers[AD2_MAX_PREFIX_HANDLERS];
+    uint8_t prefix_handler_count;
+
+    // Incremented for each message so handlers can tell messages apart.
+    uint32_t line_seq;
+
+#if AD2_TRACE_SIZE
+    // Trace ring and total records written.
+    AD2TraceRecord trace_ring[AD2_TRACE_SIZE];
+    uint32_t trace_count;
+
+    // Add a record to the trace ring.
+    void trace(uint8_t type, uint8_t partition, uint16_t len, uint32_t flags);
+#endif
+
+    // Results of update_keypad().
+    enum {
+      AD2_KEYPAD_DROP = 0,
+      AD2_KEYPAD_REPEAT,
+      AD2_KEYPAD_NEW
+    };
+
+    // Consume bytes into line_buffer. Returns true with bp just past the
+    // EOL when a complete message is ready or false once bp reaches end.
+    bool scan_line(const uint8_t *&bp, const uint8_t *end);
+
+    // Decode a keypad message and update its partition. The partition and
+    // its flags before the update are returned for a new message.
+    uint8_t update_keypad(const char *msg, uint16_t len, AD2KeypadMessage *km,
+                          AD2VirtualPartitionState **ps, uint32_t *prev_flags);
+
+    // Call the addPrefixHandler() handler matching the message. Returns
+    // false if there is none.
+    bool dispatch_prefix(const char *msg, uint16_t len);
+
+    // Set or clear a zone fault bit and its restore timer. Returns true if
+    // the zone changed. A refresh of a faulted zone only moves its timer.
+    bool zone_set_fault(AD2VirtualPartitionState *s, uint8_t zone);
+    bool zone_clear_fault(AD2VirtualPartitionState *s, uint8_t zone);
+
+    // Zone timer helpers.
+    uint8_t zone_timer_find(uint8_t partition, uint8_t zone);
+    void zone_timer_link(uint8_t t);
+    void zone_timer_unlink(uint8_t t);
+
+    // Advance the zone timer wheel to now. Returns the number of wheel
+    // slots to visit starting with the slot of tick *first.
+    uint32_t zone_wheel_advance(uint32_t *first);
+};
+
+/**
+ * AlarmDecoder protocol parser with the event handler bound at compile
+ * time.
  * 1) Able to receive partial messages with subsequent calls to complete full
  *   messages.
  * 2) consume all data received and if not complete preserve for sub.
  * 2) upon receiving a full message parse and call any events that trigger.
  * 3) continue processing data
+ *
+ * Derived is the handler. It lists the events it implements as
+ * AD2_EVENT_MASK() bits in handled_events(on_event) and
+ * typed_events(on_lrr, on_rfx, on_exp, on_ver, on_data, on_zone) and
+ * hides the matching functions below. Events it does not list compile to
+ * nothing. There is no test of a callback pointer, no call and the typed
+ * message is never decoded. Listed handlers are called directly so they
+ * can be inlined. Handlers must be public or Derived must be a friend.
+ *
+ *  class MyParser : public AD2Parser<MyParser> {
+ *    public:
+ *      static const uint32_t handled_events = AD2_EVENT_MASK(AD2_EV_MESSAGE);
+ *      void on_event(uint8_t event, const AD2MessageView *msg,
+ *                    AD2VirtualPartitionState *s) { ... }
+ *  };
+ *
+ * wanted_events() and wanted_typed_events() narrow the lists at run time.
+ * AlarmDecoderParser is the instance with runtime callbacks.
+ */
+template <class Derived>
+class AD2Parser : public AD2ParserCore
+{
+  public:
+
+    // Push data into state machine. Events fire if a complete message is
+    // received. Any amount of data can be pushed in a single call.
+    bool put(const uint8_t *buf, size_t len);
+
+    // Restore zones whose fault timed out. Timeouts are also checked for
+    // each keypad message. Call this from the main loop if messages may
+    // stop. View callbacks get an empty message.
+    void checkZoneTimeouts();
+
+  protected:
+    // Default handler. Nothing is handled.
+    static const uint32_t handled_events = 0;
+    static const uint32_t typed_events = 0;
+    uint32_t wanted_events() const { return AD2_EVENT_ALL; }
+    uint32_t wanted_typed_events() const { return AD2_EVENT_ALL; }
+    void on_event(uint8_t, const AD2MessageView*, AD2VirtualPartitionState*) {}
+    void on_lrr(const AD2MessageView*, const AD2LRRMessage*) {}
+    void on_rfx(const AD2MessageView*, const AD2RFXMessage*) {}
+    void on_exp(uint8_t, const AD2MessageView*, const AD2EXPMessage*) {}
+    void on_ver(const AD2MessageView*, const AD2VERMessage*) {}
+    void on_data(uint8_t, const AD2MessageView*, const AD2DataMessage*) {}
+    void on_zone(uint8_t, AD2VirtualPartitionState*, uint8_t) {}
+
+    Derived * self() { return static_cast<Derived *>(this); }
+
+    // Test if Derived handles an event. Constant unless Derived narrows
+    // it at run time.
+    bool handles(uint8_t event) {
+      return (Derived::handled_events & AD2_EVENT_MASK(event)) &&
+             (self()->wanted_events() & AD2_EVENT_MASK(event));
+    }
+    bool handles_typed(uint8_t event) {
+      return (Derived::typed_events & AD2_EVENT_MASK(event)) &&
+             (self()->wanted_typed_events() & AD2_EVENT_MASK(event));
+    }
+
+    // Call on_event for the current message if the event is handled.
+    void fire(uint8_t event, AD2VirtualPartitionState *s) {
+      if (handles(event)) {
+        self()->on_event(event, &line_view, s);
+      }
+    }
+
+    // Process a complete message in line_buffer.
+    void process_line();
+
+    // Decode a keypad message and update its partition. Returns the
+    // partition if the message was dispatched.
+    AD2VirtualPartitionState * process_keypad(const char *msg, uint16_t len);
+
+    // Update zone faults from a keypad message.
+    void update_zones(AD2VirtualPartitionState *s, const AD2KeypadMessage *km);
+
+    // Mark a zone faulted or refresh its timeout.
+    void zone_fault(AD2VirtualPartitionState *s, uint8_t zone);
+
+    // Restore a faulted zone.
+    void zone_restore(AD2VirtualPartitionState *s, uint8_t zone);
+
+    // Restore faulted zones after lo and before hi.
+    void zone_restore_range(AD2VirtualPartitionState *s, uint16_t lo, uint16_t hi);
+
+    // Restore the zones whose timer expired.
+    void expire_zones();
+
+    // Fire transition events for state bits that changed.
+    void notify_changes(uint32_t prev, AD2VirtualPartitionState *s);
+};
+
+/**
+ * AlarmDecoder protocol parser with runtime callbacks and subscribers.
  */
-class AlarmDecoderParser
+class AlarmDecoderParser : public AD2Parser<AlarmDecoderParser>
 {
+  friend class AD2Parser<AlarmDecoderParser>;
+
   public:
 
     AlarmDecoderParser();
 
     // Subscribe to callbacks.
+    void setCB_ON_RAW_MESSAGE(AD2ParserCallback_view_t cb);
+    void setCB_ON_ARM(AD2ParserCallback_view_t cb);
+    void setCB_ON_DISARM(AD2ParserCallback_view_t cb);
+    void setCB_ON_POWER_CHANGE(AD2ParserCallback_view_t cb);
+    void setCB_ON_READY_CHANGE(AD2ParserCallback_view_t cb);
+    void setCB_ON_ALARM(AD2ParserCallback_view_t cb);
+    void setCB_ON_ALARM_RESTORED(AD2ParserCallback_view_t cb);
+    void setCB_ON_FIRE(AD2ParserCallback_view_t cb);
+    void setCB_ON_BYPASS(AD2ParserCallback_view_t cb);
+    void setCB_ON_BOOT(AD2ParserCallback_view_t cb);
+    void setCB_ON_CONFIG_RECEIVED(AD2ParserCallback_view_t cb);
+    void setCB_ON_ZONE_FAULT(AD2ParserCallback_view_t cb);
+    void setCB_ON_ZONE_RESTORE(AD2ParserCallback_view_t cb);
+    void setCB_ON_LOW_BATTERY(AD2ParserCallback_view_t cb);
+    void setCB_ON_PANIC(AD2ParserCallback_view_t cb);
+    void setCB_ON_RELAY_CHANGED(AD2ParserCallback_view_t cb);
+    void setCB_ON_CHIME_CHANGED(AD2ParserCallback_view_t cb);
+    void setCB_ON_MESSAGE(AD2ParserCallback_view_t cb);
+    void setCB_ON_EXPANDER_MESSAGE(AD2ParserCallback_view_t cb);
+    void setCB_ON_LRR(AD2ParserCallback_view_t cb);
+    void setCB_ON_RFX(AD2ParserCallback_view_t cb);
+    void setCB_ON_SENDING_RECEIVED(AD2ParserCallback_view_t cb);
+    void setCB_ON_AUI(AD2ParserCallback_view_t cb);
+    void setCB_ON_KPM(AD2ParserCallback_view_t cb);
+    void setCB_ON_KPE(AD2ParserCallback_view_t cb);
+    void setCB_ON_CRC(AD2ParserCallback_view_t cb);
+    void setCB_ON_VER(AD2ParserCallback_view_t cb);
+    void setCB_ON_ERR(AD2ParserCallback_view_t cb);
+    // Subscribe to typed callbacks.
+    void setCB_ON_EXPANDER_MESSAGE(AD2ParserCallback_exp_t cb);
+    void setCB_ON_RELAY_CHANGED(AD2ParserCallback_exp_t cb);
+    void setCB_ON_LRR(AD2ParserCallback_lrr_t cb);
+    void setCB_ON_RFX(AD2ParserCallback_rfx_t cb);
+    void setCB_ON_AUI(AD2ParserCallback_data_t cb);
+    void setCB_ON_KPE(AD2ParserCallback_data_t cb);
+    void setCB_ON_CRC(AD2ParserCallback_data_t cb);
+    void setCB_ON_VER(AD2ParserCallback_ver_t cb);
+    void setCB_ON_ERR(AD2ParserCallback_data_t cb);
+    void setCB_ON_ZONE_FAULT(AD2ParserCallback_zone_t cb);
+    void setCB_ON_ZONE_RESTORE(AD2ParserCallback_zone_t cb);
+    // Clear every callback of an AD2_EV_* event.
+    void clearCB(uint8_t event);
+    // Clear callbacks with setCB_ON_x(nullptr).
+    void setCB_ON_RAW_MESSAGE(ad2_nullptr_t) { clearCB(AD2_EV_RAW_MESSAGE); }
+    void setCB_ON_ARM(ad2_nullptr_t) { clearCB(AD2_EV_ARM); }
+    void setCB_ON_DISARM(ad2_nullptr_t) { clearCB(AD2_EV_DISARM); }
+    void setCB_ON_POWER_CHANGE(ad2_nullptr_t) { clearCB(AD2_EV_POWER_CHANGE); }
+    void setCB_ON_READY_CHANGE(ad2_nullptr_t) { clearCB(AD2_EV_READY_CHANGE); }
+    void setCB_ON_ALARM(ad2_nullptr_t) { clearCB(AD2_EV_ALARM); }
+    void setCB_ON_ALARM_RESTORED(ad2_nullptr_t) { clearCB(AD2_EV_ALARM_RESTORED); }
+    void setCB_ON_FIRE(ad2_nullptr_t) { clearCB(AD2_EV_FIRE); }
+    void setCB_ON_BYPASS(ad2_nullptr_t) { clearCB(AD2_EV_BYPASS); }
+    void setCB_ON_BOOT(ad2_nullptr_t) { clearCB(AD2_EV_BOOT); }
+    void setCB_ON_CONFIG_RECEIVED(ad2_nullptr_t) { clearCB(AD2_EV_CONFIG_RECEIVED); }
+    void setCB_ON_ZONE_FAULT(ad2_nullptr_t) { clearCB(AD2_EV_ZONE_FAULT); }
+    void setCB_ON_ZONE_RESTORE(ad2_nullptr_t) { clearCB(AD2_EV_ZONE_RESTORE); }
+    void setCB_ON_LOW_BATTERY(ad2_nullptr_t) { clearCB(AD2_EV_LOW_BATTERY); }
+    void setCB_ON_PANIC(ad2_nullptr_t) { clearCB(AD2_EV_PANIC); }
+    void setCB_ON_RELAY_CHANGED(ad2_nullptr_t) { clearCB(AD2_EV_RELAY_CHANGED); }
+    void setCB_ON_CHIME_CHANGED(ad2_nullptr_t) { clearCB(AD2_EV_CHIME_CHANGED); }
+    void setCB_ON_MESSAGE(ad2_nullptr_t) { clearCB(AD2_EV_MESSAGE); }
+    void setCB_ON_EXPANDER_MESSAGE(ad2_nullptr_t) { clearCB(AD2_EV_EXPANDER_MESSAGE); }
+    void setCB_ON_LRR(ad2_nullptr_t) { clearCB(AD2_EV_LRR); }
+    void setCB_ON_RFX(ad2_nullptr_t) { clearCB(AD2_EV_RFX); }
+    void setCB_ON_SENDING_RECEIVED(ad2_nullptr_t) { clearCB(AD2_EV_SENDING_RECEIVED); }
+    void setCB_ON_AUI(ad2_nullptr_t) { clearCB(AD2_EV_AUI); }
+    void setCB_ON_KPM(ad2_nullptr_t) { clearCB(AD2_EV_KPM); }
+    void setCB_ON_KPE(ad2_nullptr_t) { clearCB(AD2_EV_KPE); }
+    void setCB_ON_CRC(ad2_nullptr_t) { clearCB(AD2_EV_CRC); }
+    void setCB_ON_VER(ad2_nullptr_t) { clearCB(AD2_EV_VER); }
+    void setCB_ON_ERR(ad2_nullptr_t) { clearCB(AD2_EV_ERR); }
+#if AD2_STRING_CALLBACKS
+    // Subscribe to legacy String* callbacks.
     void setCB_ON_RAW_MESSAGE(AD2ParserCallback_msg_t cb);
     void setCB_ON_ARM(AD2ParserCallback_msg_t cb);
     void setCB_ON_DISARM(AD2ParserCallback_msg_t cb);
@@ -214,8 +1130,53 @@ class AlarmDecoderParser
     void setCB_ON_CRC(AD2ParserCallback_msg_t cb);
     void setCB_ON_VER(AD2ParserCallback_msg_t cb);
     void setCB_ON_ERR(AD2ParserCallback_msg_t cb);
+#endif
 
-    // Callback functino pointers.
+    // Callback function pointers. Set them with the setCB_ functions so
+    // the event mask sees them.
+    AD2ParserCallback_view_t ON_RAW_MESSAGE_VCB;
+    AD2ParserCallback_view_t ON_ARM_VCB;
+    AD2ParserCallback_view_t ON_DISARM_VCB;
+    AD2ParserCallback_view_t ON_POWER_CHANGE_VCB;
+    AD2ParserCallback_view_t ON_READY_CHANGE_VCB;
+    AD2ParserCallback_view_t ON_ALARM_VCB;
+    AD2ParserCallback_view_t ON_ALARM_RESTORED_VCB;
+    AD2ParserCallback_view_t ON_FIRE_VCB;
+    AD2ParserCallback_view_t ON_BYPASS_VCB;
+    AD2ParserCallback_view_t ON_BOOT_VCB;
+    AD2ParserCallback_view_t ON_CONFIG_RECEIVED_VCB;
+    AD2ParserCallback_view_t ON_ZONE_FAULT_VCB;
+    AD2ParserCallback_view_t ON_ZONE_RESTORE_VCB;
+    AD2ParserCallback_view_t ON_LOW_BATTERY_VCB;
+    AD2ParserCallback_view_t ON_PANIC_VCB;
+    AD2ParserCallback_view_t ON_RELAY_CHANGED_VCB;
+    AD2ParserCallback_view_t ON_CHIME_CHANGED_VCB;
+    AD2ParserCallback_view_t ON_MESSAGE_VCB;
+    AD2ParserCallback_view_t ON_EXPANDER_MESSAGE_VCB;
+    AD2ParserCallback_view_t ON_LRR_VCB;
+    AD2ParserCallback_view_t ON_RFX_VCB;
+    AD2ParserCallback_view_t ON_SENDING_RECEIVED_VCB;
+    AD2ParserCallback_view_t ON_AUI_VCB;
+    AD2ParserCallback_view_t ON_KPM_VCB;
+    AD2ParserCallback_view_t ON_KPE_VCB;
+    AD2ParserCallback_view_t ON_CRC_VCB;
+    AD2ParserCallback_view_t ON_VER_VCB;
+    AD2ParserCallback_view_t ON_ERR_VCB;
+    // Typed callback function pointers. The message is only decoded if
+    // one is set.
+    AD2ParserCallback_exp_t ON_EXPANDER_MESSAGE_TCB;
+    AD2ParserCallback_exp_t ON_RELAY_CHANGED_TCB;
+    AD2ParserCallback_lrr_t ON_LRR_TCB;
+    AD2ParserCallback_rfx_t ON_RFX_TCB;
+    AD2ParserCallback_data_t ON_AUI_TCB;
+    AD2ParserCallback_data_t ON_KPE_TCB;
+    AD2ParserCallback_data_t ON_CRC_TCB;
+    AD2ParserCallback_ver_t ON_VER_TCB;
+    AD2ParserCallback_data_t ON_ERR_TCB;
+    AD2ParserCallback_zone_t ON_ZONE_FAULT_TCB;
+    AD2ParserCallback_zone_t ON_ZONE_RESTORE_TCB;
+#if AD2_STRING_CALLBACKS
+    // Legacy String* callback function pointers.
     AD2ParserCallback_msg_t ON_RAW_MESSAGE_CB;
     AD2ParserCallback_msg_t ON_ARM_CB;
     AD2ParserCallback_msg_t ON_DISARM_CB;
@@ -244,43 +1205,798 @@ class AlarmDecoderParser
     AD2ParserCallback_msg_t ON_CRC_CB;
     AD2ParserCallback_msg_t ON_VER_CB;
     AD2ParserCallback_msg_t ON_ERR_CB;
+#endif
 
+    // Add a subscriber for the events in the events mask. Any number of
+    // subscribers can share an event and ctx is passed back on each call.
+    // A non zero address_mask limits partition events to partitions whose
+    // address mask shares a bit with it. Events with no partition still
+    // pass. Returns a handle for unsubscribe() or -1 if no slot is free.
+    int8_t subscribe(uint32_t events, AD2ParserCallback_sub_t cb,
+                     void *ctx = nullptr, uint32_t address_mask = 0);
 
-    // Push data into state machine. Events fire if a complete message is
-    // received.
-    bool put(uint8_t *buf, int8_t len);
+    // Remove a subscriber. Safe to call from a callback.
+    void unsubscribe(int8_t handle);
 
-    // Reset the parser state machine.
-    void reset_parser();
+  protected:
+    // Subscribers. Freed slots have no callback and are reused.
+    struct {
+      AD2ParserCallback_sub_t cb;
+      void *ctx;
+      uint32_t events;
+      uint32_t address_mask;
+    } subscribers[AD2_MAX_SUBSCRIBERS];
+    uint8_t subscriber_count;
 
-    // get AD2PPState by mask create if flag is set and no match found.
-    AD2VirtualPartitionState * getAD2PState(uint32_t *mask, bool update=false);
+    // AD2_EVENT_MASK() bits of every event with a callback or subscriber
+    // and of every event with a typed callback. Events not in the masks
+    // are skipped without any other work. Kept up to date by the setCB_
+    // functions and subscribe().
+    uint32_t event_mask;
+    uint32_t typed_event_mask;
+
+    // Rebuild event_mask and typed_event_mask.
+    void update_event_mask();
+
+#if AD2_STRING_CALLBACKS
+    // Reused String for legacy callbacks. Only filled when a legacy callback
+    // is about to be called for a new line_seq and keeps its capacity
+    // between messages.
+    String compat_msg;
+    uint32_t compat_msg_seq;
+#endif
 
-    void test();
+    // Any event can have a callback. event_mask and typed_event_mask
+    // select the ones that do.
+    static const uint32_t handled_events = AD2_EVENT_ALL;
+    static const uint32_t typed_events = AD2_EVENT_MASK(AD2_EV_EXPANDER_MESSAGE) |
+                                         AD2_EVENT_MASK(AD2_EV_RELAY_CHANGED) |
+                                         AD2_EVENT_MASK(AD2_EV_LRR) |
+                                         AD2_EVENT_MASK(AD2_EV_RFX) |
+                                         AD2_EVENT_MASK(AD2_EV_AUI) |
+                                         AD2_EVENT_MASK(AD2_EV_KPE) |
+                                         AD2_EVENT_MASK(AD2_EV_CRC) |
+                                         AD2_EVENT_MASK(AD2_EV_VER) |
+                                         AD2_EVENT_MASK(AD2_EV_ERR) |
+                                         AD2_EVENT_MASK(AD2_EV_ZONE_FAULT) |
+                                         AD2_EVENT_MASK(AD2_EV_ZONE_RESTORE);
+    uint32_t wanted_events() const { return event_mask; }
+    uint32_t wanted_typed_events() const { return typed_event_mask; }
 
+    // Call the view callback, legacy callback and subscribers for an event.
+    void on_event(uint8_t event, const AD2MessageView *msg, AD2VirtualPartitionState *s);
 
+    // Call the typed callbacks.
+    void on_lrr(const AD2MessageView *msg, const AD2LRRMessage *m);
+    void on_rfx(const AD2MessageView *msg, const AD2RFXMessage *m);
+    void on_exp(uint8_t event, const AD2MessageView *msg, const AD2EXPMessage *m);
+    void on_ver(const AD2MessageView *msg, const AD2VERMessage *m);
+    void on_data(uint8_t event, const AD2MessageView *msg, const AD2DataMessage *m);
+    void on_zone(uint8_t event, AD2VirtualPartitionState *s, uint8_t zone);
+};
 
+/**
+ * A message queued by AD2QueueParser. The message and partition state are
+ * copies so the record stays valid after later put() calls.
+ */
+struct AD2QueuedMessage
+{
+  uint32_t events;      // AD2_EVENT_MASK() bits of the events fired
+  uint32_t time;        // millis() when queued or last merged
+  uint16_t len;         // message length
+  uint16_t merged;      // later messages merged into this one
+  uint8_t zone;         // zone of the last zone event or 0
+  bool has_state;       // state holds the partition of the message
+  AD2VirtualPartitionState state;
+  char data[ALARMDECODER_MAX_MESSAGE_SIZE + 1];
+};
+
+/**
+ * AlarmDecoder protocol parser that queues messages for the application
+ * to drain instead of calling callbacks.
+ *
+ * put() only ingests and decodes. Each message that fires a selected
+ * event is copied to a bounded queue with all the events it fired and its
+ * partition state. drain() hands the messages over when the application
+ * is ready. A message that finds the queue full is dropped and counted in
+ * queue_drops.
+ *
+ * With merging on a message for a partition that already has a message
+ * waiting updates that record in place. The record keeps its place in
+ * the queue, takes the new message and state and adds the new events.
+ *
+ * put() and drain() must not run at the same time. If they run in
+ * different tasks hold a lock around each call. Both are short and the
+ * work on the drained messages is done outside the lock.
+ */
+class AD2QueueParser : public AD2Parser<AD2QueueParser>
+{
+  friend class AD2Parser<AD2QueueParser>;
+
+  public:
+
+    AD2QueueParser();
+
+    // Select the AD2_EVENT_MASK() events that queue a message. Default
+    // all but ON_RAW_MESSAGE. ON_RAW_MESSAGE fires before the partition is
+    // known so those records are never merged.
+    void setQueueEvents(uint32_t events);
+
+    // Merge messages for the same partition while they wait. Off by default.
+    void setMerge(bool enable);
+
+    // Copy up to max messages oldest first and remove them from the queue.
+    // Returns the number copied.
+    size_t drain(AD2QueuedMessage *out, size_t max);
+
+    // Number of messages waiting.
+    size_t pending() const;
 
   protected:
-    // Track all panel states in separate class.
-    ad2pstates_t AD2PStates;
+    // Queue ring. head and tail only grow and are masked to index.
+    AD2QueuedMessage queue[AD2_QUEUE_SIZE];
+    uint32_t queue_head;
+    uint32_t queue_tail;
+    uint32_t queue_events;
+    bool merge;
 
-    // Parser state control starts out as AD2_PARSER_RESET.
-    int AD2_Parser_State;
+    // Record of the message being processed. Events fired by the same
+    // message(line_seq) and partition are added to it. Not valid if it
+    // was dropped.
+    uint32_t current_seq;
+    uint32_t current_pos;
+    bool current_valid;
+    AD2VirtualPartitionState *current_state;
+
+    // Waiting record of each partition(AD2PStates index) + 1 or 0.
+    uint32_t partition_pos[AD2_MAX_PARTITIONS];
 
-    // ring buffer must be < 128 bytes using signed int8 for pointer variable.
-    uint8_t ring_buffer[ALARMDECODER_MAX_MESSAGE_SIZE];
-    int8_t ring_qin_position, ring_qout_position;
-    uint16_t ring_error_count;
+    static const uint32_t handled_events = AD2_EVENT_ALL;
+    uint32_t wanted_events() const { return queue_events; }
 
+    // Queue the current message or add the event to its record.
+    void on_event(uint8_t event, const AD2MessageView *msg, AD2VirtualPartitionState *s);
 };
 
+/**
+ * A command waiting in AD2CommandQueue.
+ */
+struct AD2Command
+{
+  uint16_t len;
+  uint8_t sources;      // bit of every source that sent it
+  char data[AD2_CMD_MAX_SIZE];
+};
 
+/**
+ * AD2CommandQueue counters.
+ */
+struct AD2CommandStats
+{
+  uint32_t queued;      // commands accepted by send()
+  uint32_t merged;      // duplicates from another source folded in
+  uint32_t drops;       // commands refused because the queue was full
+  uint32_t rejects;     // empty or longer than AD2_CMD_MAX_SIZE
+  uint32_t sent;        // commands written
+  uint32_t bytes;       // bytes written
+  uint32_t short_writes; // writes that did not take the whole command
+};
+
+/**
+ * Outbound commands to the AD2*.
+ *
+ * Every source(host UART, WS, MQTT, ...) calls send() with a whole
+ * command and poll() writes the oldest one with a single write() once the
+ * pacing from the previous command has passed. Commands are never
+ * interleaved. If the output takes only part of a command the rest stays
+ * at the head and is written by a later poll() after AD2_CMD_GAP_MS. A command that is the same as one still waiting, or as
+ * the last one written within AD2_CMD_DEDUP_MS, from a different source
+ * is merged into it so a request relayed by two front ends is only sent
+ * once. The same command again from the same source is kept.
+ *
+ * send() and poll() must be called from the same task.
+ */
+class AD2CommandQueue
+{
+  public:
 
-// Forward decls.
-void ad2test(void);
+    AD2CommandQueue();
 
-// Utility functions.
-bool is_bit_set(int pos, const char * bitStr);
+    // Queue a command from source(0-7). Returns false if it was refused.
+    bool send(const char *cmd, size_t len, uint8_t source = 0);
+
+    // Write the next command to out if it is due. Returns bytes written.
+    size_t poll(Print &out);
+
+    // Change the time after each command and the extra time per byte.
+    void setPacing(uint16_t gap_ms, uint16_t key_ms);
+
+    // Number of commands waiting.
+    size_t pending() const;
+
+    // Copy the counters and optionally zero them.
+    void getStats(AD2CommandStats *out, bool reset = false);
+
+  protected:
+    AD2Command queue[AD2_CMD_QUEUE_SIZE];
+    uint8_t queue_head;
+    uint8_t queue_count;
+    uint16_t head_written;  // bytes of the head command already written
+    uint16_t gap_ms;
+    uint16_t key_ms;
+    uint32_t next_ms;
+
+    // Last command written and when for merging late duplicates. No
+    // sources means nothing was written yet.
+    AD2Command last;
+    uint32_t last_ms;
+
+    AD2CommandStats stats;
+};
+
+/**
+ * Memory ordering used by AD2SpscQueue. The defaults use the GCC
+ * __atomic builtins available on the ESP32 and Linux toolchains. Define
+ * them before including the library to port to another toolchain or RTOS.
+ */
+#ifndef AD2_LOAD_ACQUIRE
+#define AD2_LOAD_ACQUIRE(P) __atomic_load_n(P, __ATOMIC_ACQUIRE)
+#endif
+#ifndef AD2_STORE_RELEASE
+#define AD2_STORE_RELEASE(P, V) __atomic_store_n(P, V, __ATOMIC_RELEASE)
+#endif
+
+/**
+ * Padding between the producer and consumer indexes of AD2SpscQueue so
+ * the two cores do not share a cache line.
+ */
+#ifndef AD2_CACHE_LINE
+#define AD2_CACHE_LINE 64
+#endif
+
+/**
+ * Lock free single producer single consumer ring of N items. N is a power
+ * of 2.
+ *
+ * One task or core only calls the producer methods and one only calls the
+ * consumer methods. Items are filled and read in place so a record is
+ * copied once. head is only written by the consumer and tail only by the
+ * producer. Each side publishes its index with release order after it is
+ * done with the slot and reads the other side's index with acquire order.
+ *
+ * Example handing AD2QueueParser records to another task.
+ *   producer: while ((m = q.claim()) && parser.drain(m, 1)) q.push();
+ *   consumer: while ((m = q.front())) { use(m); q.pop(); }
+ */
+template <class T, uint32_t N>
+class AD2SpscQueue
+{
+  static_assert(N && !(N & (N - 1)), "AD2SpscQueue size must be a power of 2");
+
+  public:
+
+    AD2SpscQueue() : head(0), tail(0), drops(0) {}
+
+    // Producer. Free slot to fill or nullptr if the ring is full. The
+    // slot is not seen by the consumer until push().
+    T *claim() {
+      if (tail - AD2_LOAD_ACQUIRE(&head) >= N) {
+        return nullptr;
+      }
+      return &items[tail & (N - 1)];
+    }
+
+    // Producer. Hand the claimed slot to the consumer.
+    void push() {
+      AD2_STORE_RELEASE(&tail, tail + 1);
+    }
+
+    // Producer. Copy item into the ring. Counts a drop if it is full.
+    bool push(const T &item) {
+      T *slot = claim();
+      if (!slot) {
+        AD2_STORE_RELEASE(&drops, drops + 1);
+        return false;
+      }
+      *slot = item;
+      push();
+      return true;
+    }
+
+    // Consumer. Oldest item or nullptr if the ring is empty. The item
+    // stays valid until pop().
+    T *front() {
+      if (head == AD2_LOAD_ACQUIRE(&tail)) {
+        return nullptr;
+      }
+      return &items[head & (N - 1)];
+    }
+
+    // Consumer. Release the item from front().
+    void pop() {
+      AD2_STORE_RELEASE(&head, head + 1);
+    }
+
+    // Consumer. Copy out and release the oldest item.
+    bool pop(T &out) {
+      T *item = front();
+      if (!item) {
+        return false;
+      }
+      out = *item;
+      pop();
+      return true;
+    }
+
+    // Either side. Items waiting. Only a hint while the other side runs.
+    uint32_t size() const {
+      return AD2_LOAD_ACQUIRE(&tail) - AD2_LOAD_ACQUIRE(&head);
+    }
+
+    // Either side. Items push(item) could not queue.
+    uint32_t dropped() const {
+      return AD2_LOAD_ACQUIRE(&drops);
+    }
+
+  protected:
+    T items[N];
+    uint32_t head;
+    uint8_t pad[AD2_CACHE_LINE - sizeof(uint32_t)];
+    uint32_t tail;
+    uint32_t drops;
+};
+
+// Record a parser event in the trace ring if it is enabled.
+#if AD2_TRACE_SIZE
+#define AD2_TRACE(TYPE, PARTITION, LEN, FLAGS) trace(TYPE, PARTITION, LEN, FLAGS)
+#else
+#define AD2_TRACE(TYPE, PARTITION, LEN, FLAGS) do {} while (0)
+#endif
+
+/**
+ * Consume bytes from an AlarmDecoder stream and process each complete
+ * message as it is found.
+ */
+template <class Derived>
+bool AD2Parser<Derived>::put(const uint8_t *buff, size_t len) {
+
+  const uint8_t *bp = buff;
+  const uint8_t *end = buff + len;
+
+  // Sanity check.
+  if (!buff || !len) {
+     return false;
+  }
+
+  stats.bytes_in += len;
+
+  // Consume all the bytes.
+  while (scan_line(bp, end)) {
+    uint32_t start = micros();
+    process_line();
+    uint32_t took = micros() - start;
+    if (took > stats.max_dispatch_us) {
+      stats.max_dispatch_us = took;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Process a complete message held in line_buffer.
+ *
+ * The message is never copied. Handlers get a view of the line buffer.
+ */
+template <class Derived>
+void AD2Parser<Derived>::process_line() {
+
+  // Build the view for this message.
+  line_view.data = line_buffer;
+  line_view.len = line_len;
+  line_seq++;
+
+  const char *msg = line_buffer;
+
+  // call ON_RAW_MESSAGE if handled.
+  fire(AD2_EV_RAW_MESSAGE, nullptr);
+
+  // Detect message type or error.
+  // 1) Starts with !
+  //     !boot, !EXP, !REL, etc, etc.
+  // 2) Starts with [
+  //    Standard status message.
+  // All other cases are invalid
+  //
+  if (msg[0] == '!') {
+    AD2VirtualPartitionState *ad2ps;
+    bool want_exp, want_rel;
+    uint8_t type = ad2_message_type(msg, line_len);
+    stats.types[type]++;
+    switch (type) {
+    case AD2_MSG_LRR:
+      AD2_TRACE(AD2_TRACE_LRR, 0xff, line_len, 0);
+      // call ON_LRR if handled.
+      if (handles_typed(AD2_EV_LRR)) {
+        AD2LRRMessage m;
+        if (ad2_decode_lrr(msg, line_len, &m)) {
+          self()->on_lrr(&line_view, &m);
+        }
+      }
+      fire(AD2_EV_LRR, nullptr);
+      break;
+    case AD2_MSG_EXP:
+    case AD2_MSG_REL:
+      AD2_TRACE(AD2_TRACE_EXP, 0xff, line_len, 0);
+      // call ON_EXPANDER_MESSAGE and for relays ON_RELAY_CHANGED if
+      // handled.
+      want_exp = handles_typed(AD2_EV_EXPANDER_MESSAGE);
+      want_rel = msg[1] == 'R' && handles_typed(AD2_EV_RELAY_CHANGED);
+      if (want_exp || want_rel) {
+        AD2EXPMessage m;
+        if (ad2_decode_exp(msg, line_len, &m)) {
+          if (want_exp) {
+            self()->on_exp(AD2_EV_EXPANDER_MESSAGE, &line_view, &m);
+          }
+          if (want_rel) {
+            self()->on_exp(AD2_EV_RELAY_CHANGED, &line_view, &m);
+          }
+        }
+      }
+      fire(AD2_EV_EXPANDER_MESSAGE, nullptr);
+      if (msg[1] == 'R') {
+        fire(AD2_EV_RELAY_CHANGED, nullptr);
+      }
+      break;
+    case AD2_MSG_RFX:
+      AD2_TRACE(AD2_TRACE_RFX, 0xff, line_len, 0);
+      // call ON_RFX if handled.
+      if (handles_typed(AD2_EV_RFX)) {
+        AD2RFXMessage m;
+        if (ad2_decode_rfx(msg, line_len, &m)) {
+          self()->on_rfx(&line_view, &m);
+        }
+      }
+      fire(AD2_EV_RFX, nullptr);
+      break;
+    case AD2_MSG_AUI:
+      AD2_TRACE(AD2_TRACE_AUI, 0xff, line_len, 0);
+      // call ON_AUI if handled.
+      if (handles_typed(AD2_EV_AUI)) {
+        AD2DataMessage m;
+        ad2_decode_data(msg, line_len, &m);
+        self()->on_data(AD2_EV_AUI, &line_view, &m);
+      }
+      fire(AD2_EV_AUI, nullptr);
+      break;
+    case AD2_MSG_KPM:
+      AD2_TRACE(AD2_TRACE_KPM, 0xff, line_len, 0);
+      // The keypad message follows the prefix. Update the partition
+      // the same as a standard keypad message.
+      ad2ps = process_keypad(msg + 5, line_len - 5);
+      // call ON_KPM for every line. The state is nullptr if the keypad
+      // message could not be decoded.
+      fire(AD2_EV_KPM, ad2ps);
+      break;
+    case AD2_MSG_KPE:
+      AD2_TRACE(AD2_TRACE_KPE, 0xff, line_len, 0);
+      // call ON_KPE if handled.
+      if (handles_typed(AD2_EV_KPE)) {
+        AD2DataMessage m;
+        ad2_decode_data(msg, line_len, &m);
+        self()->on_data(AD2_EV_KPE, &line_view, &m);
+      }
+      fire(AD2_EV_KPE, nullptr);
+      break;
+    case AD2_MSG_CRC:
+      AD2_TRACE(AD2_TRACE_CRC, 0xff, line_len, 0);
+      // call ON_CRC if handled.
+      if (handles_typed(AD2_EV_CRC)) {
+        AD2DataMessage m;
+        ad2_decode_data(msg, line_len, &m);
+        self()->on_data(AD2_EV_CRC, &line_view, &m);
+      }
+      fire(AD2_EV_CRC, nullptr);
+      break;
+    case AD2_MSG_VER:
+      AD2_TRACE(AD2_TRACE_VER, 0xff, line_len, 0);
+      // Parse the version string.
+      // call ON_VER if handled.
+      if (handles_typed(AD2_EV_VER)) {
+        AD2VERMessage m;
+        if (ad2_decode_ver(msg, line_len, &m)) {
+          self()->on_ver(&line_view, &m);
+        }
+      }
+      fire(AD2_EV_VER, nullptr);
+      break;
+    case AD2_MSG_ERR:
+      AD2_TRACE(AD2_TRACE_ERR, 0xff, line_len, 0);
+      // call ON_ERR if handled.
+      if (handles_typed(AD2_EV_ERR)) {
+        AD2DataMessage m;
+        ad2_decode_data(msg, line_len, &m);
+        self()->on_data(AD2_EV_ERR, &line_view, &m);
+      }
+      fire(AD2_EV_ERR, nullptr);
+      break;
+    case AD2_MSG_SENDING:
+      // call ON_SENDING_RECEIVED if handled.
+      AD2_TRACE(AD2_TRACE_SENDING, 0xff, line_len, 0);
+      fire(AD2_EV_SENDING_RECEIVED, nullptr);
+      break;
+    case AD2_MSG_CONFIG:
+      // call ON_CONFIG_RECEIVED if handled.
+      AD2_TRACE(AD2_TRACE_CONFIG, 0xff, line_len, 0);
+      fire(AD2_EV_CONFIG_RECEIVED, nullptr);
+      break;
+    default:
+      // Try the prefixes added by the application.
+      if (!dispatch_prefix(msg, line_len)) {
+        AD2_TRACE(AD2_TRACE_UNKNOWN, 0xff, line_len, 0);
+      }
+      break;
+    }
+  } else {
+    // http://www.alarmdecoder.com/wiki/index.php/Protocol#Keypad
+    if (msg[0] == '[') {
+      process_keypad(msg, line_len);
+    } else {
+      stats.bad_prefix++;
+      AD2_LOGE("BAD PROTOCOL PREFIX.");
+      AD2_TRACE(AD2_TRACE_BAD_PREFIX, 0xff, line_len, (uint8_t)msg[0]);
+    }
+  }
+}
+
+/**
+ * Decode a keypad message, update the partition state it belongs to and
+ * fire ON_MESSAGE and any transition events.
+ *
+ * Used for standard '[' messages and the keypad message inside !KPM:.
+ * Returns the partition state, also for a repeat, or nullptr if the
+ * message could not be used.
+ */
+template <class Derived>
+AD2VirtualPartitionState * AD2Parser<Derived>::process_keypad(const char *msg, uint16_t len) {
+  AD2KeypadMessage km;
+  AD2VirtualPartitionState *ad2ps;
+  uint32_t prev_flags;
+
+  // Restore zones that timed out.
+  expire_zones();
+
+  switch (update_keypad(msg, len, &km, &ad2ps, &prev_flags)) {
+  case AD2_KEYPAD_REPEAT:
+    // A single faulted zone is shown by the same message over and over.
+    if (ad2ps->last_fault_zone) {
+      zone_fault(ad2ps, ad2ps->last_fault_zone);
+    }
+    if (notify_repeats) {
+      fire(AD2_EV_MESSAGE, ad2ps);
+    }
+    return ad2ps;
+  case AD2_KEYPAD_NEW:
+    // Fire events for state changes. The first message for a partition
+    // only sets the starting state.
+    if (prev_flags & AD2_FLAG_VALID) {
+      notify_changes(prev_flags, ad2ps);
+    }
+
+    // Fire zone fault and restore events.
+    update_zones(ad2ps, &km);
+
+    AD2_LOGD("SIZE(%u) PID(%u) MASK(%08x) Ready(%d) Armed Away(%d) Armed Home(%d) Bypassed(%d)",
+             AD2PStates_count, ad2ps->partition, (unsigned)ad2ps->address_mask_filter,
+             (int)ad2ps->ready, (int)ad2ps->armed_away,
+             (int)ad2ps->armed_home, (int)ad2ps->zone_bypassed);
+    AD2_TRACE(AD2_TRACE_KEYPAD, ad2ps->partition, len, ad2ps->flags);
+
+    // call ON_MESSAGE if handled.
+    fire(AD2_EV_MESSAGE, ad2ps);
+    return ad2ps;
+  default:
+    return nullptr;
+  }
+}
+
+/**
+ * Track zone faults from a keypad message.
+ *
+ * Ademco panels never send a restore. Faulted zones are cycled through
+ * the display one at a time in zone order as "FAULT nn" with the zone in
+ * the numeric field. A faulted zone that is skipped in the cycle or not
+ * shown again before AD2_ZONE_TIMEOUT_MS is restored. Nothing is faulted
+ * once the partition is READY.
+ */
+template <class Derived>
+void AD2Parser<Derived>::update_zones(AD2VirtualPartitionState *s, const AD2KeypadMessage *km) {
+
+  if (s->flags & AD2_FLAG_READY) {
+    if (s->zone_fault_count) {
+      zone_restore_range(s, 0, AD2_MAX_ZONES + 1);
+    }
+    s->last_fault_zone = 0;
+    return;
+  }
+
+  // FIXME: Multi language support and DSC zone messages.
+  if (s->panel_type != 'A' || strncmp(km->alpha, "FAULT", 5) ||
+      !km->numeric || km->numeric > AD2_MAX_ZONES) {
+    s->last_fault_zone = 0;
+    return;
+  }
+
+  uint8_t zone = km->numeric;
+  uint8_t prev = s->last_fault_zone;
+
+  // Faulted zones between the last zone shown and this one were skipped
+  // so they are no longer faulted.
+  if (prev && prev != zone) {
+    if (zone > prev) {
+      zone_restore_range(s, prev, zone);
+    } else {
+      zone_restore_range(s, prev, AD2_MAX_ZONES + 1);
+      zone_restore_range(s, 0, zone);
+    }
+  }
+
+  zone_fault(s, zone);
+  s->last_fault_zone = zone;
+}
+
+/**
+ * Mark a zone faulted and fire ON_ZONE_FAULT. If it is already faulted
+ * only push back its restore timeout.
+ */
+template <class Derived>
+void AD2Parser<Derived>::zone_fault(AD2VirtualPartitionState *s, uint8_t zone) {
+  if (!zone_set_fault(s, zone)) {
+    return;
+  }
+
+  s->last_zone_event = zone;
+  AD2_TRACE(AD2_TRACE_ZONE_FAULT, s->partition, 0, zone);
+  fire(AD2_EV_ZONE_FAULT, s);
+  if (handles_typed(AD2_EV_ZONE_FAULT)) {
+    self()->on_zone(AD2_EV_ZONE_FAULT, s, zone);
+  }
+}
+
+/**
+ * Restore a faulted zone, stop its timeout and fire ON_ZONE_RESTORE.
+ */
+template <class Derived>
+void AD2Parser<Derived>::zone_restore(AD2VirtualPartitionState *s, uint8_t zone) {
+  if (!zone_clear_fault(s, zone)) {
+    return;
+  }
+
+  s->last_zone_event = zone;
+  AD2_TRACE(AD2_TRACE_ZONE_RESTORE, s->partition, 0, zone);
+  fire(AD2_EV_ZONE_RESTORE, s);
+  if (handles_typed(AD2_EV_ZONE_RESTORE)) {
+    self()->on_zone(AD2_EV_ZONE_RESTORE, s, zone);
+  }
+}
+
+/**
+ * Restore the faulted zones after lo and before hi. Only set bits are
+ * visited.
+ */
+template <class Derived>
+void AD2Parser<Derived>::zone_restore_range(AD2VirtualPartitionState *s, uint16_t lo, uint16_t hi) {
+  uint16_t z = lo + 1;
+
+  while (z < hi && s->zone_fault_count) {
+    uint32_t w = s->zone_faults[z >> 5] >> (z & 31);
+    if (!w) {
+      // Skip to the next word.
+      z = (z | 31) + 1;
+      continue;
+    }
+    z += AD2_CTZ(w);
+    if (z >= hi) {
+      break;
+    }
+    zone_restore(s, z);
+    z++;
+  }
+}
+
+/**
+ * Advance the timer wheel to now and restore the zones that timed out.
+ * Only the slots for the ticks that passed are visited. Timers more than
+ * one turn of the wheel out stay in their slot until their tick.
+ */
+template <class Derived>
+void AD2Parser<Derived>::expire_zones() {
+  uint32_t first;
+  uint32_t n = zone_wheel_advance(&first);
+
+  for (uint32_t i = 0; i < n; i++) {
+    uint8_t t = zone_wheel[(first + i) & (AD2_ZONE_WHEEL_SLOTS - 1)];
+    while (t != 0xff) {
+      uint8_t next = zone_timers[t].next;
+      if ((int32_t)(zone_timers[t].expire - zone_wheel_tick) <= 0) {
+        zone_restore(&AD2PStates[zone_timers[t].partition], zone_timers[t].zone);
+      }
+      t = next;
+    }
+  }
+}
+
+/**
+ * Restore zones whose fault timed out outside of message processing.
+ */
+template <class Derived>
+void AD2Parser<Derived>::checkZoneTimeouts() {
+  // There is no current message.
+  line_view.data = "";
+  line_view.len = 0;
+  line_seq++;
+  expire_zones();
+}
+
+/**
+ * Fire the transition events for the bits that differ between the
+ * previous and current state of a partition. Nothing is done if the
+ * state did not change or no transition is handled.
+ */
+template <class Derived>
+void AD2Parser<Derived>::notify_changes(uint32_t prev, AD2VirtualPartitionState *s) {
+  uint32_t changed = prev ^ s->flags;
+
+  if (!changed || !(Derived::handled_events & AD2_EVENT_TRANSITIONS) ||
+      !(self()->wanted_events() & AD2_EVENT_TRANSITIONS)) {
+    return;
+  }
+
+  // Armed away <> armed home is not an arm or disarm.
+  if ((changed & AD2_FLAG_ARMED) &&
+      !(prev & AD2_FLAG_ARMED) != !(s->flags & AD2_FLAG_ARMED)) {
+    if (s->flags & AD2_FLAG_ARMED) {
+      fire(AD2_EV_ARM, s);
+    } else {
+      fire(AD2_EV_DISARM, s);
+    }
+  }
+
+  if (changed & AD2_FLAG_READY) {
+    fire(AD2_EV_READY_CHANGE, s);
+  }
+
+  if (changed & AD2_FLAG_ACPOWER) {
+    fire(AD2_EV_POWER_CHANGE, s);
+  }
+
+  if (changed & AD2_FLAG_ALARM) {
+    if (s->flags & AD2_FLAG_ALARM) {
+      fire(AD2_EV_ALARM, s);
+    } else {
+      fire(AD2_EV_ALARM_RESTORED, s);
+    }
+  }
+
+  if (changed & AD2_FLAG_FIRE) {
+    fire(AD2_EV_FIRE, s);
+  }
+
+  if (changed & AD2_FLAG_BYPASS) {
+    fire(AD2_EV_BYPASS, s);
+  }
+
+  if (changed & AD2_FLAG_LOWBATTERY) {
+    fire(AD2_EV_LOW_BATTERY, s);
+  }
+
+  if (changed & AD2_FLAG_CHIME) {
+    fire(AD2_EV_CHIME_CHANGED, s);
+  }
+}
+
+// The runtime callback and queue parsers are built once in the library.
+extern template class AD2Parser<AlarmDecoderParser>;
+extern template class AD2Parser<AD2QueueParser>;
 
 #endif
@@ -0,0 +1,86 @@
+/**
+ *  @file    Arduino.h
+ *  @author  Sean Mathews <coder@f34r.com>
+ *  @date    01/15/2020
+ *  @version 1.0
+ *
+ *  @brief Minimal Arduino core for host builds of the library
+ *
+ *  @copyright Copyright (C) 2020 Nu Tech Software Solutions, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#ifndef HostArduino_h
+#define HostArduino_h
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "WString.h"
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+/**
+ * Output stream. Host builds write to a stdio FILE.
+ */
+class Print
+{
+  public:
+    Print(FILE *f = stdout) : out(f) {}
+    virtual ~Print() {}
+
+    // Send output somewhere else. nullptr drops it.
+    void setOutput(FILE *f) { out = f; }
+
+    virtual size_t write(uint8_t c);
+    virtual size_t write(const uint8_t *buf, size_t size);
+    size_t print(const char *str);
+    size_t print(const String &str) { return print(str.c_str()); }
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(int n, int base = DEC) { return print((long)n, base); }
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t println(const char *str = "");
+    size_t println(const String &str) { return println(str.c_str()); }
+    size_t printf(const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+  protected:
+    FILE *out;
+};
+
+/**
+ * Serial port. Host builds only support output.
+ */
+class HardwareSerial : public Print
+{
+  public:
+    void begin(unsigned long baud) { (void)baud; }
+    int available() { return 0; }
+    int read() { return -1; }
+};
+
+extern HardwareSerial Serial;
+
+// Time since start up.
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+// Host builds only. Move millis() and micros() forward without waiting.
+void host_advance_ms(unsigned long ms);
+
+#endif
@@ -0,0 +1,246 @@
+/**
+ *  @file    HostArduino.cpp
+ *  @author  Sean Mathews <coder@f34r.com>
+ *  @date    01/15/2020
+ *  @version 1.0
+ *
+ *  @brief Minimal Arduino core for host builds of the library
+ *
+ *  @copyright Copyright (C) 2020 Nu Tech Software Solutions, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "Arduino.h"
+#include <stdarg.h>
+#include <time.h>
+
+HardwareSerial Serial;
+
+uint64_t ad2_host_string_allocs = 0;
+
+/**
+ * Time
+ */
+static uint64_t host_now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint64_t host_start_us = host_now_us();
+static uint64_t host_skip_us = 0;
+
+unsigned long millis() {
+  return (unsigned long)((host_now_us() - host_start_us + host_skip_us) / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long)(host_now_us() - host_start_us + host_skip_us);
+}
+
+void host_advance_ms(unsigned long ms) {
+  host_skip_us += (uint64_t)ms * 1000;
+}
+
+void delay(unsigned long ms) {
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&ts, nullptr);
+}
+
+/**
+ * Print
+ */
+size_t Print::write(uint8_t c) {
+  return out ? fwrite(&c, 1, 1, out) : 1;
+}
+
+size_t Print::write(const uint8_t *buf, size_t size) {
+  return out ? fwrite(buf, 1, size, out) : size;
+}
+
+size_t Print::print(const char *str) {
+  return write((const uint8_t *)str, strlen(str));
+}
+
+size_t Print::print(long n, int base) {
+  return print(String(n, base));
+}
+
+size_t Print::print(unsigned long n, int base) {
+  return print(String(n, base));
+}
+
+size_t Print::println(const char *str) {
+  size_t n = print(str);
+  return n + print("\r\n");
+}
+
+size_t Print::printf(const char *format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (n < 0) {
+    return 0;
+  }
+  return write((const uint8_t *)buf, (size_t)n < sizeof(buf) ? n : sizeof(buf) - 1);
+}
+
+/**
+ * String
+ */
+String::String(const char *cstr) : buffer(nullptr), capacity(0), len(0) {
+  if (cstr) {
+    copy(cstr, strlen(cstr));
+  }
+}
+
+String::String(const String &str) : buffer(nullptr), capacity(0), len(0) {
+  copy(str.c_str(), str.len);
+}
+
+String::String(char c) : buffer(nullptr), capacity(0), len(0) {
+  copy(&c, 1);
+}
+
+String::String(long value, unsigned char base) : buffer(nullptr), capacity(0), len(0) {
+  char buf[2 + 8 * sizeof(long)];
+  if (base == 10) {
+    snprintf(buf, sizeof(buf), "%ld", value);
+  } else {
+    // Other bases print the unsigned value like the Arduino core.
+    unsigned long v = (unsigned long)value;
+    char *p = &buf[sizeof(buf) - 1];
+    *p = 0;
+    do {
+      uint8_t d = v % base;
+      *--p = d < 10 ? '0' + d : 'a' + d - 10;
+      v /= base;
+    } while (v);
+    memmove(buf, p, &buf[sizeof(buf)] - p);
+  }
+  copy(buf, strlen(buf));
+}
+
+String::String(unsigned long value, unsigned char base) : buffer(nullptr), capacity(0), len(0) {
+  char buf[1 + 8 * sizeof(long)];
+  char *p = &buf[sizeof(buf) - 1];
+  *p = 0;
+  do {
+    uint8_t d = value % base;
+    *--p = d < 10 ? '0' + d : 'a' + d - 10;
+    value /= base;
+  } while (value);
+  copy(p, strlen(p));
+}
+
+String::String(int value, unsigned char base) : String((long)value, base) {
+}
+
+String::String(unsigned int value, unsigned char base) : String((unsigned long)value, base) {
+}
+
+String::~String() {
+  free(buffer);
+}
+
+bool String::reserve(unsigned int size) {
+  if (buffer && capacity >= size) {
+    return true;
+  }
+  char *nb = (char *)realloc(buffer, size + 1);
+  if (!nb) {
+    return false;
+  }
+  ad2_host_string_allocs++;
+  if (!buffer) {
+    nb[0] = 0;
+  }
+  buffer = nb;
+  capacity = size;
+  return true;
+}
+
+String & String::copy(const char *cstr, unsigned int length) {
+  if (!reserve(length)) {
+    return *this;
+  }
+  len = length;
+  memmove(buffer, cstr, length);
+  buffer[len] = 0;
+  return *this;
+}
+
+String & String::operator = (const String &rhs) {
+  if (this != &rhs) {
+    copy(rhs.c_str(), rhs.len);
+  }
+  return *this;
+}
+
+String & String::operator = (const char *cstr) {
+  return copy(cstr ? cstr : "", cstr ? strlen(cstr) : 0);
+}
+
+bool String::concat(const char *cstr, unsigned int length) {
+  if (!reserve(len + length)) {
+    return false;
+  }
+  memcpy(buffer + len, cstr, length);
+  len += length;
+  buffer[len] = 0;
+  return true;
+}
+
+char String::operator [] (unsigned int index) const {
+  return index < len ? buffer[index] : 0;
+}
+
+bool String::equals(const char *cstr) const {
+  return strcmp(c_str(), cstr) == 0;
+}
+
+bool String::startsWith(const char *prefix) const {
+  return strncmp(c_str(), prefix, strlen(prefix)) == 0;
+}
+
+int String::indexOf(const char *str) const {
+  const char *found = strstr(c_str(), str);
+  return found ? found - c_str() : -1;
+}
+
+String String::substring(unsigned int left, unsigned int right) const {
+  String out;
+  if (left > right) {
+    unsigned int t = left;
+    left = right;
+    right = t;
+  }
+  if (left >= len) {
+    return out;
+  }
+  if (right > len) {
+    right = len;
+  }
+  out.copy(buffer + left, right - left);
+  return out;
+}
+
+long String::toInt() const {
+  return atol(c_str());
+}
@@ -0,0 +1,78 @@
+/**
+ *  @file    WString.h
+ *  @author  Sean Mathews <coder@f34r.com>
+ *  @date    01/15/2020
+ *  @version 1.0
+ *
+ *  @brief Minimal Arduino String for host builds of the library
+ *
+ *  @copyright Copyright (C) 2020 Nu Tech Software Solutions, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#ifndef HostWString_h
+#define HostWString_h
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Heap allocations made by String. Read by host tools to count
+// allocations per message.
+extern uint64_t ad2_host_string_allocs;
+
+/**
+ * Heap backed string with the same buffer behavior as the Arduino core.
+ * The buffer is grown with realloc and kept between assignments.
+ */
+class String
+{
+  public:
+    String(const char *cstr = "");
+    String(const String &str);
+    explicit String(char c);
+    explicit String(long value, unsigned char base = 10);
+    explicit String(unsigned long value, unsigned char base = 10);
+    explicit String(int value, unsigned char base = 10);
+    explicit String(unsigned int value, unsigned char base = 10);
+    ~String();
+
+    String & operator = (const String &rhs);
+    String & operator = (const char *cstr);
+
+    bool reserve(unsigned int size);
+    bool concat(const char *cstr, unsigned int length);
+    String & operator += (const String &rhs) { concat(rhs.buffer, rhs.len); return *this; }
+    String & operator += (const char *cstr) { concat(cstr, strlen(cstr)); return *this; }
+    String & operator += (char c) { concat(&c, 1); return *this; }
+
+    inline unsigned int length() const { return len; }
+    inline const char * c_str() const { return buffer ? buffer : ""; }
+    char operator [] (unsigned int index) const;
+
+    bool equals(const char *cstr) const;
+    bool startsWith(const char *prefix) const;
+    int indexOf(const char *str) const;
+    String substring(unsigned int left, unsigned int right) const;
+    long toInt() const;
+
+  protected:
+    char *buffer;
+    unsigned int capacity;
+    unsigned int len;
+
+    String & copy(const char *cstr, unsigned int length);
+};
+
+#endif
@@ -0,0 +1,469 @@
+/**
+ *  @file    ad2bench.cpp
+ *  @author  Sean Mathews <coder@f34r.com>
+ *  @date    01/15/2020
+ *  @version 1.0
+ *
+ *  @brief Host benchmark for the AlarmDecoder parser
+ *
+ *  @copyright Copyright (C) 2020 Nu Tech Software Solutions, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/**
+ * Replays tests/testmessage.txt and synthetic streams through put() and
+ * reports messages/sec, ns/message, heap allocations per message and peak
+ * RSS. Also compares the original String based keypad decode against
+ * ad2_decode_keypad().
+ *
+ *  ad2bench [-n messages] [-c chunk] [testmessage.txt]
+ */
+
+#include <ArduinoAlarmDecoder.h>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifndef AD2_TEST_DATA
+#define AD2_TEST_DATA "tests/testmessage.txt"
+#endif
+
+/**
+ * Count every heap allocation made through new. new and delete both use
+ * malloc/free here so GCC's mismatch warning does not apply.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+static uint64_t new_count = 0;
+
+void * operator new(size_t size) {
+  new_count++;
+  void *p = malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void * operator new[](size_t size) {
+  return operator new(size);
+}
+void operator delete(void *p) noexcept {
+  free(p);
+}
+void operator delete[](void *p) noexcept {
+  free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+void operator delete[](void *p, size_t) noexcept {
+  free(p);
+}
+
+// new plus String buffer allocations.
+static uint64_t allocs() {
+  return new_count + ad2_host_string_allocs;
+}
+
+static double now_sec() {
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Cycle counter or ns where there is none.
+static uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return (uint64_t)(now_sec() * 1e9);
+#endif
+}
+
+// Keep the compiler from dropping work.
+static volatile uint32_t sink;
+
+/**
+ * Callbacks used while measuring.
+ */
+static void bench_view_cb(const AD2MessageView *msg, AD2VirtualPartitionState *s) {
+  sink += msg->len + (s ? s->flags : 0);
+}
+#if AD2_STRING_CALLBACKS
+static void bench_string_cb(String *msg, AD2VirtualPartitionState *s) {
+  sink += msg->length() + (s ? s->flags : 0);
+}
+#endif
+static void bench_sub_cb(void *ctx, uint8_t event, const AD2MessageView *msg,
+                         AD2VirtualPartitionState *s) {
+  *(uint32_t *)ctx += event + msg->len + (s ? s->flags : 0);
+}
+
+enum { CB_NONE, CB_VIEW, CB_STRING, CB_SUBSCRIBERS };
+
+/**
+ * Parser with its handler bound at compile time. Only ON_RAW_MESSAGE and
+ * ON_MESSAGE are handled. Everything else compiles out.
+ */
+class BenchStaticParser : public AD2Parser<BenchStaticParser>
+{
+  public:
+    static const uint32_t handled_events = AD2_EVENT_MASK(AD2_EV_RAW_MESSAGE) |
+                                           AD2_EVENT_MASK(AD2_EV_MESSAGE);
+    void on_event(uint8_t event, const AD2MessageView *msg, AD2VirtualPartitionState *s) {
+      sink += msg->len + (s ? s->flags : 0);
+    }
+};
+
+/**
+ * Queue parser drained after every put() the way a consumer loop would.
+ */
+class BenchQueueParser : public AD2QueueParser
+{
+  public:
+    bool put(const uint8_t *buf, size_t len) {
+      bool ret = AD2QueueParser::put(buf, len);
+      size_t n;
+      while ((n = drain(batch, 8)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+          sink += batch[i].len + batch[i].events;
+        }
+      }
+      return ret;
+    }
+    AD2QueuedMessage batch[8];
+};
+
+/**
+ * Feed a stream through put() in chunks until at least target messages
+ * have been processed and print one result line.
+ */
+template <class Parser>
+static void run_parser(const char *name, Parser *parser, const std::string &stream,
+                       size_t chunk, uint64_t target) {
+  const uint8_t *data = (const uint8_t *)stream.data();
+  size_t len = stream.size();
+
+  // One pass to create partitions and size buffers.
+  for (size_t off = 0; off < len; off += chunk) {
+    parser->put(data + off, len - off < chunk ? len - off : chunk);
+  }
+  parser->resetStats();
+
+  uint64_t a0 = allocs();
+  double t0 = now_sec();
+  AD2ParserStats st;
+  do {
+    for (size_t off = 0; off < len; off += chunk) {
+      parser->put(data + off, len - off < chunk ? len - off : chunk);
+    }
+    parser->getStats(&st);
+  } while (st.lines < target);
+  double t1 = now_sec();
+  uint64_t a1 = allocs();
+
+  double secs = t1 - t0;
+  printf("%-28s %10llu %12.0f %10.1f %10.3f %8.1f\n", name,
+         (unsigned long long)st.lines, st.lines / secs, secs * 1e9 / st.lines,
+         (double)(a1 - a0) / st.lines, st.bytes_in / secs / (1024 * 1024));
+}
+
+/**
+ * Run a stream through AlarmDecoderParser with runtime callbacks.
+ */
+static void run_stream(const char *name, const std::string &stream, size_t chunk,
+                       uint64_t target, int cb_mode) {
+  AlarmDecoderParser *parser = new AlarmDecoderParser();
+
+  if (cb_mode == CB_VIEW) {
+    parser->setCB_ON_RAW_MESSAGE(bench_view_cb);
+    parser->setCB_ON_MESSAGE(bench_view_cb);
+  }
+#if AD2_STRING_CALLBACKS
+  if (cb_mode == CB_STRING) {
+    parser->setCB_ON_RAW_MESSAGE(bench_string_cb);
+    parser->setCB_ON_MESSAGE(bench_string_cb);
+  }
+#endif
+  // Three consumers of ON_MESSAGE one limited to the first partition.
+  static uint32_t sub_ctx[3];
+  if (cb_mode == CB_SUBSCRIBERS) {
+    parser->subscribe(AD2_EVENT_MASK(AD2_EV_RAW_MESSAGE) | AD2_EVENT_MASK(AD2_EV_MESSAGE),
+                      bench_sub_cb, &sub_ctx[0]);
+    parser->subscribe(AD2_EVENT_MASK(AD2_EV_MESSAGE) | AD2_EVENT_TRANSITIONS,
+                      bench_sub_cb, &sub_ctx[1]);
+    parser->subscribe(AD2_EVENT_MASK(AD2_EV_MESSAGE), bench_sub_cb, &sub_ctx[2], 1UL << 1);
+  }
+
+  run_parser(name, parser, stream, chunk, target);
+
+  delete parser;
+}
+
+/**
+ * Run a stream through BenchStaticParser.
+ */
+static void run_static(const char *name, const std::string &stream, size_t chunk,
+                       uint64_t target) {
+  BenchStaticParser *parser = new BenchStaticParser();
+  run_parser(name, parser, stream, chunk, target);
+  delete parser;
+}
+
+/**
+ * Run a stream through BenchQueueParser.
+ */
+static void run_queue(const char *name, const std::string &stream, size_t chunk,
+                      uint64_t target, bool merge) {
+  BenchQueueParser *parser = new BenchQueueParser();
+  parser->setMerge(merge);
+  run_parser(name, parser, stream, chunk, target);
+  delete parser;
+}
+
+/**
+ * Build a keypad message for an address bit.
+ */
+static std::string keypad_line(int bit, bool ready, int numeric, const char *alpha) {
+  char line[128];
+  uint32_t mask = 1UL << bit;
+  snprintf(line, sizeof(line),
+           "[%d0000001000000003A--],%03d,[f7%02x%02x%02x%02x08001c08020000000000],\"%-32.32s\"\r\n",
+           ready ? 1 : 0, numeric,
+           (unsigned)(mask & 0xff), (unsigned)((mask >> 8) & 0xff),
+           (unsigned)((mask >> 16) & 0xff), (unsigned)((mask >> 24) & 0xff), alpha);
+  return line;
+}
+
+/**
+ * Synthetic stream of changing keypad messages for 8 partitions with
+ * !RFX, !EXP and !LRR messages mixed in. No message repeats.
+ */
+static std::string synthetic_partitions(int count) {
+  std::string s;
+  char alpha[40];
+  for (int i = 0; i < count; i++) {
+    int p = i % 8;
+    snprintf(alpha, sizeof(alpha), "FAULT %02d ZONE %06d", (i / 8) % 40 + 1, i);
+    s += keypad_line(p + 1, (i / 64) & 1, (i / 8) % 40 + 1, alpha);
+    if (i % 10 == 3) {
+      s += "!RFX:0180036,80\r\n";
+    } else
+    if (i % 10 == 6) {
+      s += "!EXP:07,01,01\r\n";
+    } else
+    if (i % 50 == 9) {
+      s += "!LRR:008,1,CID_3401,ff\r\n";
+    }
+  }
+  return s;
+}
+
+/**
+ * Synthetic stream where each partition repeats its message 16 times as
+ * panels do while nothing changes.
+ */
+static std::string synthetic_repeats(int count) {
+  std::string s;
+  for (int i = 0; i < count; i++) {
+    int p = (i / 16) % 8;
+    s += keypad_line(p + 1, true, 8, "****DISARMED****  Ready to Arm  ");
+  }
+  return s;
+}
+
+/**
+ * The original String based keypad decode kept to compare against.
+ */
+struct LegacyState {
+  uint32_t address_mask_filter;
+  bool ready, armed_away, armed_home, backlight_on, programming_mode;
+  bool zone_bypassed, ac_power, chime_on, alarm_event_occurred;
+  bool alarm_sounding, battery_low, entry_delay_off, fire_alarm;
+  bool system_issue, perimeter_only, system_specific, exit_now;
+  char beeps, panel_type;
+  String last_numeric_message;
+  String last_alpha_message;
+  uint8_t display_cursor_type, display_cursor_location;
+};
+
+static bool legacy_decode(String &msg, LegacyState *s) {
+  if (!(msg.length() == 94 && msg[93] == '"' && msg[22] == ',')) {
+    return false;
+  }
+  uint32_t amask = strtol(msg.substring(AMASK_START, AMASK_END).c_str(), nullptr, 16);
+  s->address_mask_filter = AD2_NTOHL(amask);
+  s->ready = is_bit_set(READY_BYTE, msg.c_str());
+  s->armed_away = is_bit_set(ARMED_AWAY_BYTE, msg.c_str());
+  s->armed_home = is_bit_set(ARMED_HOME_BYTE, msg.c_str());
+  s->backlight_on  = is_bit_set(BACKLIGHT_BYTE, msg.c_str());
+  s->programming_mode = is_bit_set(PROGMODE_BYTE, msg.c_str());
+  s->zone_bypassed = is_bit_set(BYPASS_BYTE, msg.c_str());
+  s->ac_power = is_bit_set(ACPOWER_BYTE, msg.c_str());
+  s->chime_on = is_bit_set(CHIME_BYTE, msg.c_str());
+  s->alarm_event_occurred = is_bit_set(ALARMSTICKY_BYTE, msg.c_str());
+  s->alarm_sounding = is_bit_set(ALARM_BYTE, msg.c_str());
+  s->battery_low = is_bit_set(LOWBATTERY_BYTE, msg.c_str());
+  s->entry_delay_off = is_bit_set(ENTRYDELAY_BYTE, msg.c_str());
+  s->fire_alarm = is_bit_set(FIRE_BYTE, msg.c_str());
+  s->system_issue = is_bit_set(SYSISSUE_BYTE, msg.c_str());
+  s->perimeter_only = is_bit_set(PERIMETERONLY_BYTE, msg.c_str());
+  s->system_specific = is_bit_set(SYSSPECIFIC_BYTE, msg.c_str());
+  s->beeps = msg[BEEPMODE_BYTE];
+  s->panel_type = msg[PANEL_TYPE_BYTE];
+  s->last_numeric_message = msg.substring(SECTION_2_START, SECTION_2_START + 3);
+  s->last_alpha_message = msg.substring(SECTION_4_START, SECTION_4_START + 32);
+  s->display_cursor_type = (uint8_t)strtol(msg.substring(CURSOR_TYPE_POS, CURSOR_TYPE_POS + 2).c_str(), 0, 16);
+  s->display_cursor_location = (uint8_t)strtol(msg.substring(CURSOR_POS, CURSOR_POS + 2).c_str(), 0, 16);
+  s->exit_now = s->last_alpha_message.indexOf("may exit now") >= 0;
+  return true;
+}
+
+/**
+ * Keypad decode only. The original String decode against
+ * ad2_decode_keypad() over the same messages.
+ */
+static void run_decode(int count, uint64_t target) {
+  std::vector<String> lines;
+  std::vector<std::string> raw;
+  char alpha[40];
+  for (int i = 0; i < count; i++) {
+    snprintf(alpha, sizeof(alpha), "FAULT %02d ZONE %06d", i % 40 + 1, i);
+    std::string l = keypad_line(i % 8 + 1, i & 1, i % 40 + 1, alpha);
+    l.resize(KEYPAD_MESSAGE_SIZE);
+    raw.push_back(l);
+    lines.push_back(String(l.c_str()));
+  }
+
+  LegacyState ls;
+  uint64_t n = 0;
+  uint64_t a0 = allocs();
+  uint64_t c0 = cycles();
+  while (n < target) {
+    for (size_t i = 0; i < lines.size(); i++) {
+      sink += legacy_decode(lines[i], &ls);
+    }
+    n += lines.size();
+  }
+  uint64_t c1 = cycles();
+  uint64_t a1 = allocs();
+  double legacy = (double)(c1 - c0) / n;
+  printf("%-28s %10llu %12s %10.1f %10.3f\n", "decode String(original)",
+         (unsigned long long)n, "", legacy, (double)(a1 - a0) / n);
+
+  AD2KeypadMessage km;
+  n = 0;
+  a0 = allocs();
+  c0 = cycles();
+  while (n < target) {
+    for (size_t i = 0; i < raw.size(); i++) {
+      sink += ad2_decode_keypad(raw[i].data(), KEYPAD_MESSAGE_SIZE, &km) + km.flags;
+    }
+    n += raw.size();
+  }
+  c1 = cycles();
+  a1 = allocs();
+  double fast = (double)(c1 - c0) / n;
+  printf("%-28s %10llu %12s %10.1f %10.3f\n", "decode ad2_decode_keypad",
+         (unsigned long long)n, "", fast, (double)(a1 - a0) / n);
+  printf("decode speedup %.1fx\n", legacy / fast);
+}
+
+static bool read_file(const char *path, std::string &out) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return false;
+  }
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    out.append(buf, n);
+  }
+  fclose(f);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  uint64_t target = 1000000;
+  size_t chunk = 64;
+  const char *path = AD2_TEST_DATA;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:c:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        target = strtoull(optarg, nullptr, 10);
+        break;
+      case 'c':
+        chunk = strtoul(optarg, nullptr, 10);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n messages] [-c chunk] [testmessage.txt]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind < argc) {
+    path = argv[optind];
+  }
+  if (!chunk) {
+    chunk = 1;
+  }
+
+  std::string testfile;
+  if (!read_file(path, testfile)) {
+    fprintf(stderr, "can not read %s\n", path);
+    return 1;
+  }
+  std::string partitions = synthetic_partitions(4096);
+  std::string repeats = synthetic_repeats(4096);
+
+  printf("chunk %zu bytes, %llu messages per run\n", chunk, (unsigned long long)target);
+  printf("%-28s %10s %12s %10s %10s %8s\n", "stream", "msgs", "msgs/sec", "ns/msg",
+         "allocs/msg", "MiB/s");
+  run_stream("testmessage.txt", testfile, chunk, target, CB_VIEW);
+  run_stream("partitions no callbacks", partitions, chunk, target, CB_NONE);
+  run_stream("partitions view cb", partitions, chunk, target, CB_VIEW);
+#if AD2_STRING_CALLBACKS
+  run_stream("partitions String cb", partitions, chunk, target, CB_STRING);
+#endif
+  run_static("partitions static handler", partitions, chunk, target);
+  run_stream("partitions 3 subscribers", partitions, chunk, target, CB_SUBSCRIBERS);
+  run_queue("partitions queue drain", partitions, chunk, target, false);
+  run_queue("partitions queue merged", partitions, chunk, target, true);
+  run_stream("repeats view cb", repeats, chunk, target, CB_VIEW);
+  run_stream("partitions 1 byte put()", partitions, 1, target / 4, CB_VIEW);
+
+  printf("\n%-28s %10s %12s %10s %10s\n", "keypad decode", "msgs", "",
+#if defined(__x86_64__) || defined(__i386__)
+         "cycles/msg",
+#else
+         "ns/msg",
+#endif
+         "allocs/msg");
+  run_decode(1024, target);
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("\npeak RSS %ld KiB\n", ru.ru_maxrss);
+
+  return 0;
+}
@@ -0,0 +1,178 @@
+/**
+ *  @file    ad2capture.cpp
+ *  @author  Sean Mathews <coder@f34r.com>
+ *  @date    01/15/2020
+ *  @version 1.0
+ *
+ *  @brief Record a raw AD2* stream to a capture file
+ *
+ *  @copyright Copyright (C) 2020 Nu Tech Software Solutions, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/**
+ * Reads an AD2* stream from stdin or a ser2sock server and writes each
+ * read as a timestamped record in the AD2_CAPTURE format. Stops at end of
+ * stream, after -m bytes or on ^C.
+ *
+ *  ad2capture [-o capture.ad2] [-m max_bytes] [host:port]
+ *
+ *  ser2sock -p 10000 -s /dev/ttyUSB0 &
+ *  ad2capture -o panel.ad2 localhost:10000
+ */
+
+#include <ArduinoAlarmDecoder.h>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <time.h>
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int) {
+  stop = 1;
+}
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Connect to host:port. Returns the socket or -1.
+ */
+static int connect_to(const char *target) {
+  char host[256];
+  const char *colon = strrchr(target, ':');
+  if (!colon || (size_t)(colon - target) >= sizeof(host)) {
+    fprintf(stderr, "expected host:port not '%s'\n", target);
+    return -1;
+  }
+  memcpy(host, target, colon - target);
+  host[colon - target] = 0;
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int err = getaddrinfo(host, colon + 1, &hints, &res);
+  if (err) {
+    fprintf(stderr, "%s: %s\n", target, gai_strerror(err));
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd < 0) {
+    fprintf(stderr, "%s: %s\n", target, strerror(errno));
+  }
+  return fd;
+}
+
+int main(int argc, char **argv) {
+  const char *path = "capture.ad2";
+  uint64_t max_bytes = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "o:m:h")) != -1) {
+    switch (opt) {
+      case 'o':
+        path = optarg;
+        break;
+      case 'm':
+        max_bytes = strtoull(optarg, nullptr, 0);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-o capture.ad2] [-m max_bytes] [host:port]\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  int fd = 0;
+  if (optind < argc && strcmp(argv[optind], "-")) {
+    fd = connect_to(argv[optind]);
+    if (fd < 0) {
+      return 1;
+    }
+  }
+
+  FILE *out = fopen(path, "wb");
+  if (!out) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  // No SA_RESTART so a blocked read returns on ^C.
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  uint8_t hdr[AD2_CAPTURE_HEADER_SIZE];
+  fwrite(hdr, 1, ad2_capture_header(hdr), out);
+
+  // Records hold at most a uint16_t of data.
+  uint8_t buf[4096];
+  uint64_t last = now_us();
+  uint64_t total = 0, records = 0;
+  while (!stop && (!max_bytes || total < max_bytes)) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n < 0) {
+        perror("read");
+      }
+      break;
+    }
+
+    uint64_t now = now_us();
+    uint64_t delta = now - last;
+    last = now;
+
+    uint8_t rec[AD2_CAPTURE_RECORD_SIZE];
+    ad2_capture_record(rec, delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta, (uint16_t)n);
+    fwrite(rec, 1, sizeof(rec), out);
+    fwrite(buf, 1, n, out);
+    total += n;
+    records++;
+  }
+
+  if (fclose(out) != 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  fprintf(stderr, "%s: %llu bytes in %llu records\n", path,
+          (unsigned long long)total, (unsigned long long)records);
+  return 0;
+}
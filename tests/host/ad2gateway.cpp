@@ -0,0 +1,793 @@
+/**
+ *  @file    ad2gateway.cpp
+ *  @author  Sean Mathews <coder@f34r.com>
+ *  @date    01/15/2020
+ *  @version 1.0
+ *
+ *  @brief Multi panel AD2* gateway for Linux
+ *
+ *  @copyright Copyright (C) 2020 Nu Tech Software Solutions, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/**
+ * Connects to any number of AD2* devices on ser2sock servers or serial
+ * ports and runs one AlarmDecoderParser per source. Sources are spread
+ * over -t worker threads that each wait on their own epoll set so a
+ * parser is only ever used by one thread. A source that fails or closes
+ * is reopened with exponential backoff.
+ *
+ * Partition state changes of all sources are written to stdout as one
+ * JSON object per line. Every -s seconds the last state of every known
+ * partition is written again as a SYNC event and per source counters go
+ * to stderr.
+ *
+ *  ad2gateway [-t threads] [-s status_secs] [-q] source...
+ *    source: host:port or /dev/ttyX[@baud]
+ *
+ * -B starts that many fake ser2sock servers on localhost sending a
+ * synthetic keypad stream, connects a source to each and reports how
+ * many messages the workers parsed per CPU second. -r paces each fake
+ * panel to that many messages per second(default as fast as possible),
+ * -x drops every connection each x seconds to exercise reconnects and
+ * -d sets the run time.
+ *
+ *  ad2gateway -B panels [-t threads] [-r msgs_per_sec] [-x secs] [-d secs] [-v]
+ */
+
+#include <ArduinoAlarmDecoder.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+// Reconnect backoff limits.
+#define GW_BACKOFF_MIN_MS 250
+#define GW_BACKOFF_MAX_MS 30000
+
+// Most bytes read from one source per wakeup so a busy source can not
+// starve the others on the same worker.
+#define GW_READ_BUDGET (64 * 1024)
+
+// Longest epoll wait. Bounds how late retries, zone timeouts and stop
+// are noticed.
+#define GW_TICK_MS 200
+
+// Panel message rate used for the panels per core estimate when the fake
+// panels are not paced.
+#define GW_PANEL_RATE 10
+
+enum { SRC_IDLE, SRC_CONNECTING, SRC_UP };
+
+static const char *event_names[AD2_EVENT_COUNT] = {
+  "RAW_MESSAGE", "ARM", "DISARM", "POWER_CHANGE", "READY_CHANGE", "ALARM",
+  "ALARM_RESTORED", "FIRE", "BYPASS", "BOOT", "CONFIG_RECEIVED", "ZONE_FAULT",
+  "ZONE_RESTORE", "LOW_BATTERY", "PANIC", "RELAY_CHANGED", "CHIME_CHANGED",
+  "MESSAGE", "EXPANDER_MESSAGE", "LRR", "RFX", "SENDING_RECEIVED", "AUI",
+  "KPM", "KPE", "CRC", "VER", "ERR"
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int) {
+  stop = 1;
+}
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static double thread_cpu_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * One AD2* device.
+ */
+struct Source {
+  int id;
+  std::string target;
+
+  // Resolved once at startup so a reconnect never blocks on DNS.
+  bool serial;
+  speed_t baud;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+
+  // Owned by the worker thread.
+  int fd;
+  int state;
+  uint32_t backoff_ms;
+  uint64_t retry_ms;
+  bool got_data;
+  AlarmDecoderParser parser;
+
+  // Read by the status report.
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint32_t> lines;
+  std::atomic<uint32_t> reconnects;
+  std::atomic<bool> up;
+
+  // Last published state of each partition. Guarded by publish_lock.
+  AD2VirtualPartitionState partitions[AD2_MAX_PARTITIONS];
+  uint8_t partition_count;
+};
+
+static std::vector<Source *> sources;
+static std::mutex publish_lock;
+static bool quiet = false;
+
+/**
+ * Write s as a JSON state line. publish_lock must be held.
+ */
+static void print_state(Source *src, const char *event, const AD2VirtualPartitionState *s) {
+  char alpha[2 * ALPHA_SIZE + 1];
+  char *o = alpha;
+  for (const char *a = s->last_alpha_message; *a; a++) {
+    if (*a == '"' || *a == '\\') {
+      *o++ = '\\';
+    }
+    *o++ = (*a >= ' ' && *a < 0x7f) ? *a : ' ';
+  }
+  *o = 0;
+
+  printf("{\"source\":\"%s\",\"event\":\"%s\",\"partition\":%u,\"ready\":%d,"
+         "\"armed_away\":%d,\"armed_home\":%d,\"ac_power\":%d,\"alarm_sounding\":%d,"
+         "\"fire_alarm\":%d,\"battery_low\":%d,\"zones_faulted\":%u,\"alpha\":\"%s\"}\n",
+         src->target.c_str(), event, s->partition,
+         s->isSet(AD2_FLAG_READY), s->isSet(AD2_FLAG_ARMED_AWAY),
+         s->isSet(AD2_FLAG_ARMED_HOME), s->isSet(AD2_FLAG_ACPOWER),
+         s->isSet(AD2_FLAG_ALARM), s->isSet(AD2_FLAG_FIRE),
+         s->isSet(AD2_FLAG_LOWBATTERY), s->zone_fault_count, alpha);
+}
+
+/**
+ * Subscriber for every source. Keeps the merged partition table and
+ * publishes the change.
+ * ctx: the Source.
+ */
+static void on_state(void *ctx, uint8_t event, const AD2MessageView *msg,
+                     AD2VirtualPartitionState *s) {
+  Source *src = (Source *)ctx;
+  std::lock_guard<std::mutex> guard(publish_lock);
+
+  if (!s) {
+    if (!quiet) {
+      printf("{\"source\":\"%s\",\"event\":\"%s\",\"message\":\"%s\"}\n",
+             src->target.c_str(), event_names[event], msg->data);
+      fflush(stdout);
+    }
+    return;
+  }
+
+  uint8_t i;
+  for (i = 0; i < src->partition_count; i++) {
+    if (src->partitions[i].partition == s->partition) {
+      break;
+    }
+  }
+  if (i == src->partition_count && src->partition_count < AD2_MAX_PARTITIONS) {
+    src->partition_count++;
+  }
+  if (i < src->partition_count) {
+    src->partitions[i] = *s;
+  }
+
+  if (!quiet) {
+    print_state(src, event_names[event], s);
+    fflush(stdout);
+  }
+}
+
+/**
+ * Parse host:port or /dev/ttyX[@baud] into src.
+ */
+static bool source_init(Source *src, int id, const char *target) {
+  src->id = id;
+  src->target = target;
+  src->fd = -1;
+  src->state = SRC_IDLE;
+  src->backoff_ms = GW_BACKOFF_MIN_MS;
+  src->retry_ms = 0;
+  src->got_data = false;
+  src->bytes = 0;
+  src->lines = 0;
+  src->reconnects = 0;
+  src->up = false;
+  src->partition_count = 0;
+
+  if (target[0] == '/') {
+    src->serial = true;
+    src->baud = B115200;
+    const char *at = strchr(target, '@');
+    if (at) {
+      src->target.resize(at - target);
+      switch (atoi(at + 1)) {
+        case 9600:   src->baud = B9600;   break;
+        case 19200:  src->baud = B19200;  break;
+        case 38400:  src->baud = B38400;  break;
+        case 57600:  src->baud = B57600;  break;
+        case 115200: src->baud = B115200; break;
+        default:
+          fprintf(stderr, "%s: unsupported baud rate\n", target);
+          return false;
+      }
+    }
+    return true;
+  }
+
+  src->serial = false;
+  const char *colon = strrchr(target, ':');
+  if (!colon) {
+    fprintf(stderr, "expected host:port or /dev/ttyX not '%s'\n", target);
+    return false;
+  }
+  std::string host(target, colon - target);
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int err = getaddrinfo(host.c_str(), colon + 1, &hints, &res);
+  if (err) {
+    fprintf(stderr, "%s: %s\n", target, gai_strerror(err));
+    return false;
+  }
+  memcpy(&src->addr, res->ai_addr, res->ai_addrlen);
+  src->addrlen = res->ai_addrlen;
+  freeaddrinfo(res);
+  return true;
+}
+
+/**
+ * Close the source and schedule a reopen after the backoff. The backoff
+ * doubles on each failure with up to 25% jitter so many panels behind one
+ * ser2sock host do not all retry at once. It resets once data arrives.
+ */
+static void source_fail(int epfd, Source *src, const char *why) {
+  if (src->fd >= 0) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, src->fd, nullptr);
+    close(src->fd);
+    src->fd = -1;
+  }
+  src->state = SRC_IDLE;
+  src->up = false;
+  if (stop) {
+    return;
+  }
+
+  if (src->got_data) {
+    src->backoff_ms = GW_BACKOFF_MIN_MS;
+  }
+  uint32_t wait = src->backoff_ms + rand() % (src->backoff_ms / 4 + 1);
+  fprintf(stderr, "%s: %s, retry in %u ms\n", src->target.c_str(), why, wait);
+  src->retry_ms = now_ms() + wait;
+  src->backoff_ms = src->backoff_ms * 2 > GW_BACKOFF_MAX_MS ? GW_BACKOFF_MAX_MS : src->backoff_ms * 2;
+  src->got_data = false;
+  src->reconnects++;
+}
+
+/**
+ * Open a serial port raw and non blocking.
+ */
+static int open_serial(Source *src) {
+  int fd = open(src->target.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  struct termios tio;
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, src->baud);
+    cfsetospeed(&tio, src->baud);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  return fd;
+}
+
+/**
+ * Start opening a source. TCP connects finish in source_event().
+ */
+static void source_open(int epfd, Source *src) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.data.ptr = src;
+
+  // A partial line from the last connection must not join the next one.
+  src->parser.reset_parser();
+
+  if (src->serial) {
+    src->fd = open_serial(src);
+    if (src->fd < 0) {
+      source_fail(epfd, src, strerror(errno));
+      return;
+    }
+    src->state = SRC_UP;
+    src->up = true;
+    ev.events = EPOLLIN;
+  } else {
+    src->fd = socket(src->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (src->fd < 0) {
+      source_fail(epfd, src, strerror(errno));
+      return;
+    }
+    if (connect(src->fd, (struct sockaddr *)&src->addr, src->addrlen) == 0) {
+      src->state = SRC_UP;
+      src->up = true;
+      ev.events = EPOLLIN | EPOLLRDHUP;
+    } else if (errno == EINPROGRESS) {
+      src->state = SRC_CONNECTING;
+      ev.events = EPOLLOUT;
+    } else {
+      source_fail(epfd, src, strerror(errno));
+      return;
+    }
+  }
+
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+    source_fail(epfd, src, strerror(errno));
+  }
+}
+
+/**
+ * Handle epoll events for a source.
+ */
+static void source_event(int epfd, Source *src, uint32_t events) {
+  if (src->state == SRC_CONNECTING) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(src->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+      source_fail(epfd, src, strerror(err));
+      return;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = src;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, src->fd, &ev);
+    src->state = SRC_UP;
+    src->up = true;
+    return;
+  }
+
+  uint8_t buf[4096];
+  size_t budget = GW_READ_BUDGET;
+  while (budget) {
+    ssize_t n = read(src->fd, buf, sizeof(buf));
+    if (n > 0) {
+      src->parser.put(buf, n);
+      src->bytes += n;
+      src->got_data = true;
+      budget = (size_t)n < budget ? budget - n : 0;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      break;
+    }
+    source_fail(epfd, src, n == 0 ? "closed" : strerror(errno));
+    break;
+  }
+
+  AD2ParserStats st;
+  src->parser.getStats(&st);
+  src->lines = st.lines;
+
+  if (src->fd >= 0 && (events & (EPOLLERR | EPOLLHUP))) {
+    source_fail(epfd, src, "hangup");
+  }
+}
+
+/**
+ * Worker thread. Owns the sources assigned to it.
+ */
+struct Worker {
+  std::vector<Source *> sources;
+  std::thread thread;
+  double cpu_sec;
+};
+
+static void worker_run(Worker *w) {
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    perror("epoll_create1");
+    stop = 1;
+    return;
+  }
+  double cpu0 = thread_cpu_sec();
+  uint64_t next_zone = now_ms() + 1000;
+
+  while (!stop) {
+    uint64_t now = now_ms();
+
+    // Reopen sources whose backoff has passed and find the next retry.
+    uint64_t wake = now + GW_TICK_MS;
+    for (Source *src : w->sources) {
+      if (src->state != SRC_IDLE) {
+        continue;
+      }
+      if (src->retry_ms <= now) {
+        source_open(epfd, src);
+      }
+      if (src->state == SRC_IDLE && src->retry_ms < wake) {
+        wake = src->retry_ms;
+      }
+    }
+
+    if (now >= next_zone) {
+      next_zone = now + 1000;
+      for (Source *src : w->sources) {
+        src->parser.checkZoneTimeouts();
+      }
+    }
+
+    struct epoll_event events[64];
+    int n = epoll_wait(epfd, events, 64, wake > now ? (int)(wake - now) : 0);
+    for (int i = 0; i < n; i++) {
+      source_event(epfd, (Source *)events[i].data.ptr, events[i].events);
+    }
+  }
+
+  for (Source *src : w->sources) {
+    if (src->fd >= 0) {
+      close(src->fd);
+      src->fd = -1;
+    }
+  }
+  close(epfd);
+  w->cpu_sec = thread_cpu_sec() - cpu0;
+}
+
+/**
+ * Print per source counters to stderr and resend the merged state.
+ */
+static void report(bool sync) {
+  std::lock_guard<std::mutex> guard(publish_lock);
+  for (Source *src : sources) {
+    fprintf(stderr, "%-24s %-4s bytes %llu lines %u reconnects %u partitions %u\n",
+            src->target.c_str(), src->up ? "up" : "down",
+            (unsigned long long)src->bytes.load(), src->lines.load(),
+            src->reconnects.load(), src->partition_count);
+    if (sync && !quiet) {
+      for (uint8_t i = 0; i < src->partition_count; i++) {
+        print_state(src, "SYNC", &src->partitions[i]);
+      }
+    }
+  }
+  fflush(stdout);
+}
+
+/**
+ * Fake ser2sock servers for the benchmark. One thread accepts on every
+ * listener and writes the same keypad stream to each connection.
+ */
+struct FakePanel {
+  int listen_fd;
+  int fd;
+  size_t pos;
+  double credit;
+};
+
+static std::string keypad_line(int bit, bool ready, int numeric, const char *alpha) {
+  char line[128];
+  uint32_t mask = 1UL << bit;
+  snprintf(line, sizeof(line),
+           "[%d0000001000000003A--],%03d,[f7%02x%02x%02x%02x08001c08020000000000],\"%-32.32s\"\r\n",
+           ready ? 1 : 0, numeric,
+           (unsigned)(mask & 0xff), (unsigned)((mask >> 8) & 0xff),
+           (unsigned)((mask >> 16) & 0xff), (unsigned)((mask >> 24) & 0xff), alpha);
+  return line;
+}
+
+/**
+ * A panel with two partitions cycling through zone faults with the
+ * repeats and !RFX/!LRR traffic a real panel sends.
+ */
+static std::string fake_stream(size_t *lines) {
+  std::string s;
+  char alpha[40];
+  *lines = 0;
+  for (int i = 0; i < 512; i++) {
+    int zone = (i / 4) % 12 + 1;
+    snprintf(alpha, sizeof(alpha), "FAULT %02d ZONE %02d", zone, zone);
+    s += keypad_line(1 + (i & 1), i % 128 >= 96, zone, alpha);
+    (*lines)++;
+    if (i % 16 == 5) {
+      s += "!RFX:0180036,80\r\n";
+      (*lines)++;
+    }
+    if (i % 128 == 77) {
+      s += "!LRR:008,1,CID_3401,ff\r\n";
+      (*lines)++;
+    }
+  }
+  return s;
+}
+
+static void fake_run(std::vector<FakePanel> *panels, const std::string *stream,
+                     double bytes_per_sec, int drop_secs) {
+  uint64_t last = now_ms();
+  uint64_t next_drop = drop_secs ? last + drop_secs * 1000ULL : UINT64_MAX;
+
+  while (!stop) {
+    uint64_t now = now_ms();
+    bool busy = false;
+
+    for (FakePanel &p : *panels) {
+      if (p.fd < 0) {
+        p.fd = accept4(p.listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        p.credit = 0;
+        continue;
+      }
+      if (now >= next_drop) {
+        close(p.fd);
+        p.fd = -1;
+        continue;
+      }
+
+      size_t want = 64 * 1024;
+      if (bytes_per_sec > 0) {
+        p.credit += bytes_per_sec * (now - last) / 1000.0;
+        want = p.credit < 64 * 1024 ? (size_t)p.credit : 64 * 1024;
+      }
+      while (want) {
+        size_t n = stream->size() - p.pos;
+        n = n < want ? n : want;
+        ssize_t w = send(p.fd, stream->data() + p.pos, n, MSG_NOSIGNAL);
+        if (w <= 0) {
+          if (w < 0 && errno != EAGAIN) {
+            close(p.fd);
+            p.fd = -1;
+          }
+          break;
+        }
+        busy = true;
+        p.pos = (p.pos + w) % stream->size();
+        want -= w;
+        if (bytes_per_sec > 0) {
+          p.credit -= w;
+        }
+      }
+    }
+    if (now >= next_drop) {
+      next_drop = now + drop_secs * 1000ULL;
+    }
+    last = now;
+
+    // Paced panels only need a 10ms tick. Flooding panels yield briefly
+    // when every socket is full.
+    if (bytes_per_sec > 0 || !busy) {
+      usleep(bytes_per_sec > 0 ? 10000 : 200);
+    }
+  }
+
+  for (FakePanel &p : *panels) {
+    if (p.fd >= 0) {
+      close(p.fd);
+    }
+    close(p.listen_fd);
+  }
+}
+
+/**
+ * Listen on a free localhost port. Returns the listener or -1.
+ */
+static int fake_listen(uint16_t *port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(sa);
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 16) < 0 ||
+      getsockname(fd, (struct sockaddr *)&sa, &len) < 0) {
+    close(fd);
+    return -1;
+  }
+  *port = ntohs(sa.sin_port);
+  return fd;
+}
+
+int main(int argc, char **argv) {
+  int threads = 1;
+  int status_secs = 10;
+  int bench = 0;
+  int rate = 0;
+  int drop_secs = 0;
+  int duration = 5;
+  bool verbose = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:s:qB:r:x:d:vh")) != -1) {
+    switch (opt) {
+      case 't':
+        threads = atoi(optarg);
+        break;
+      case 's':
+        status_secs = atoi(optarg);
+        break;
+      case 'q':
+        quiet = true;
+        break;
+      case 'B':
+        bench = atoi(optarg);
+        break;
+      case 'r':
+        rate = atoi(optarg);
+        break;
+      case 'x':
+        drop_secs = atoi(optarg);
+        break;
+      case 'd':
+        duration = atoi(optarg);
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr,
+                "usage: %s [-t threads] [-s status_secs] [-q] host:port|/dev/ttyX[@baud]...\n"
+                "       %s -B panels [-t threads] [-r msgs_per_sec] [-x drop_secs] [-d secs] [-v]\n",
+                argv[0], argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Fake panels for the benchmark.
+  std::vector<FakePanel> panels;
+  std::vector<std::string> targets;
+  std::string stream;
+  size_t stream_lines = 0;
+  std::thread fake;
+  if (bench > 0) {
+    quiet = !verbose;
+    stream = fake_stream(&stream_lines);
+    for (int i = 0; i < bench; i++) {
+      FakePanel p;
+      uint16_t port;
+      p.listen_fd = fake_listen(&port);
+      if (p.listen_fd < 0) {
+        perror("listen");
+        return 1;
+      }
+      p.fd = -1;
+      p.pos = (stream.size() / bench) * i;
+      p.credit = 0;
+      panels.push_back(p);
+      targets.push_back("127.0.0.1:" + std::to_string(port));
+    }
+    double bytes_per_sec = rate > 0 ? (double)rate * stream.size() / stream_lines : 0;
+    fake = std::thread(fake_run, &panels, &stream, bytes_per_sec, drop_secs);
+  } else {
+    for (int i = optind; i < argc; i++) {
+      targets.push_back(argv[i]);
+    }
+  }
+  if (targets.empty()) {
+    fprintf(stderr, "no sources\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < targets.size(); i++) {
+    Source *src = new Source();
+    if (!source_init(src, i, targets[i].c_str())) {
+      return 1;
+    }
+    src->parser.subscribe(AD2_EVENT_TRANSITIONS |
+                          AD2_EVENT_MASK(AD2_EV_ZONE_FAULT) |
+                          AD2_EVENT_MASK(AD2_EV_ZONE_RESTORE) |
+                          AD2_EVENT_MASK(AD2_EV_LRR),
+                          on_state, src);
+    sources.push_back(src);
+  }
+
+  // Sources are dealt round robin so each parser has a single owner.
+  if ((size_t)threads > sources.size()) {
+    threads = sources.size();
+  }
+  std::vector<Worker> workers(threads);
+  for (size_t i = 0; i < sources.size(); i++) {
+    workers[i % threads].sources.push_back(sources[i]);
+  }
+  for (Worker &w : workers) {
+    w.thread = std::thread(worker_run, &w);
+  }
+
+  uint64_t start = now_ms();
+  uint64_t next_status = start + status_secs * 1000ULL;
+  while (!stop) {
+    usleep(GW_TICK_MS * 1000);
+    uint64_t now = now_ms();
+    if (bench > 0 && now - start >= duration * 1000ULL) {
+      break;
+    }
+    if (status_secs > 0 && now >= next_status) {
+      next_status = now + status_secs * 1000ULL;
+      report(true);
+    }
+  }
+  double wall = (now_ms() - start) / 1000.0;
+
+  stop = 1;
+  for (Worker &w : workers) {
+    w.thread.join();
+  }
+  if (fake.joinable()) {
+    fake.join();
+  }
+  report(false);
+
+  if (bench > 0) {
+    uint64_t lines = 0, bytes = 0;
+    uint32_t reconnects = 0;
+    double cpu = 0;
+    for (Source *src : sources) {
+      lines += src->lines;
+      bytes += src->bytes;
+      reconnects += src->reconnects;
+    }
+    for (Worker &w : workers) {
+      cpu += w.cpu_sec;
+    }
+    double per_cpu = cpu > 0 ? lines / cpu : 0;
+    int panel_rate = rate > 0 ? rate : GW_PANEL_RATE;
+    printf("panels %d threads %d wall %.1f s worker cpu %.2f s reconnects %u\n",
+           bench, threads, wall, cpu, reconnects);
+    printf("messages %llu (%.0f/s) bytes %llu (%.1f MiB/s)\n",
+           (unsigned long long)lines, lines / wall, (unsigned long long)bytes,
+           bytes / wall / (1024 * 1024));
+    printf("messages per worker cpu second %.0f\n", per_cpu);
+    printf("panels per core at %d msgs/s each %.0f\n", panel_rate, per_cpu / panel_rate);
+  }
+
+  for (Source *src : sources) {
+    delete src;
+  }
+  return 0;
+}
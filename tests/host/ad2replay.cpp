@@ -0,0 +1,178 @@
+/**
+ *  @file    ad2replay.cpp
+ *  @author  Sean Mathews <coder@f34r.com>
+ *  @date    01/15/2020
+ *  @version 1.0
+ *
+ *  @brief Replay an AD2* capture file through the parser
+ *
+ *  @copyright Copyright (C) 2020 Nu Tech Software Solutions, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/**
+ * Memory maps a capture written by ad2capture or the AD2EmbeddedIoT
+ * sketch and feeds each record to put() either as fast as possible or at
+ * the recorded pace(-r) scaled by -s. Reports per chunk put() latency and
+ * in recorded pace mode how late each chunk was delivered.
+ *
+ *  ad2replay [-r] [-s speed] [-n loops] capture.ad2
+ */
+
+#include <ArduinoAlarmDecoder.h>
+#include <algorithm>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t t) {
+  struct timespec ts;
+  ts.tv_sec = t / 1000000000ULL;
+  ts.tv_nsec = t % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+  }
+}
+
+static volatile uint32_t sink;
+
+static void replay_view_cb(const AD2MessageView *msg, AD2VirtualPartitionState *s) {
+  sink += msg->len + (s ? s->flags : 0);
+}
+
+/**
+ * Print min/avg/percentiles/max of a set of ns samples in us.
+ */
+static void report(const char *name, std::vector<uint64_t> &v) {
+  if (v.empty()) {
+    return;
+  }
+  std::sort(v.begin(), v.end());
+  uint64_t sum = 0;
+  for (size_t i = 0; i < v.size(); i++) {
+    sum += v[i];
+  }
+  size_t n = v.size();
+  printf("%-12s min %9.3f  avg %9.3f  p50 %9.3f  p99 %9.3f  p99.9 %9.3f  max %9.3f us\n",
+         name, v[0] / 1e3, (double)sum / n / 1e3, v[n / 2] / 1e3,
+         v[n * 99 / 100] / 1e3, v[n * 999 / 1000] / 1e3, v[n - 1] / 1e3);
+}
+
+int main(int argc, char **argv) {
+  bool paced = false;
+  double speed = 1.0;
+  int loops = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "rs:n:h")) != -1) {
+    switch (opt) {
+      case 'r':
+        paced = true;
+        break;
+      case 's':
+        paced = true;
+        speed = atof(optarg);
+        break;
+      case 'n':
+        loops = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-r] [-s speed] [-n loops] capture.ad2\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind >= argc || speed <= 0 || loops < 1) {
+    fprintf(stderr, "usage: %s [-r] [-s speed] [-n loops] capture.ad2\n", argv[0]);
+    return 1;
+  }
+
+  const char *path = argv[optind];
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  size_t size = st.st_size;
+  const uint8_t *base = size ? (const uint8_t *)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                             : (const uint8_t *)MAP_FAILED;
+  close(fd);
+  if (base == MAP_FAILED || !ad2_capture_check(base, size)) {
+    fprintf(stderr, "%s: not an AD2 capture\n", path);
+    return 1;
+  }
+  madvise((void *)base, size, MADV_SEQUENTIAL);
+  const uint8_t *end = base + size;
+
+  AlarmDecoderParser parser;
+  parser.setCB_ON_MESSAGE(replay_view_cb);
+  Serial.setOutput(nullptr);
+
+  std::vector<uint64_t> latency, late;
+  uint64_t bytes = 0;
+  uint64_t start = now_ns();
+  uint64_t due = start;
+
+  for (int loop = 0; loop < loops; loop++) {
+    const uint8_t *p = base + AD2_CAPTURE_HEADER_SIZE;
+    uint32_t delta_us;
+    uint16_t len;
+    const uint8_t *chunk;
+    while ((chunk = ad2_capture_next(p, end, &delta_us, &len))) {
+      p = chunk + len;
+      if (paced) {
+        due += (uint64_t)(delta_us * 1000.0 / speed);
+        uint64_t now = now_ns();
+        if (now < due) {
+          sleep_until_ns(due);
+          now = now_ns();
+        }
+        late.push_back(now - due);
+      }
+
+      uint64_t t0 = now_ns();
+      parser.put((uint8_t *)chunk, len);
+      latency.push_back(now_ns() - t0);
+      bytes += len;
+    }
+    if (p != end) {
+      fprintf(stderr, "%s: capture truncated at offset %zu\n", path, (size_t)(p - base));
+    }
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  AD2ParserStats stats;
+  parser.getStats(&stats);
+  printf("%s: %zu chunks  %llu bytes  %u messages  %.3f s\n", path, latency.size(),
+         (unsigned long long)bytes, (unsigned)stats.lines, elapsed);
+  printf("%-12s %.0f msgs/s  %.2f MiB/s\n", paced ? "paced" : "max speed",
+         stats.lines / elapsed, bytes / elapsed / (1024.0 * 1024.0));
+  report("put()", latency);
+  report("late", late);
+
+  munmap((void *)base, size);
+  return 0;
+}
@@ -0,0 +1,234 @@
+/**
+ *  @file    ad2spsc.cpp
+ *  @author  Sean Mathews <coder@f34r.com>
+ *  @date    01/15/2020
+ *  @version 1.0
+ *
+ *  @brief Stress test AD2SpscQueue with a producer and consumer thread
+ *
+ *  @copyright Copyright (C) 2020 Nu Tech Software Solutions, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/**
+ * Runs the same split as the AD2EmbeddedIoT ingest task with std::thread.
+ *
+ * The sequence run pushes -n numbered records filled with a pattern
+ * through a small ring and the consumer checks every record arrives once,
+ * in order and intact.
+ *
+ * The parser run puts a synthetic multi partition stream through an
+ * AD2QueueParser on the producer thread and hands the records to the
+ * consumer thread through the ring. The consumer's hash of the records
+ * must match the same stream parsed on one thread.
+ *
+ * Exits 1 on any mismatch. Build with -fsanitize=thread to also check for
+ * data races.
+ *
+ *  ad2spsc [-n records]
+ */
+
+#include <ArduinoAlarmDecoder.h>
+#include <string>
+#include <thread>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Sequence run record. Filled from seq so a torn or stale slot shows.
+ */
+struct SeqRecord {
+  uint32_t seq;
+  uint32_t fill[15];
+};
+
+static AD2SpscQueue<SeqRecord, 64> seq_ring;
+
+static void seq_producer(uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    SeqRecord *r;
+    while (!(r = seq_ring.claim())) {
+      std::this_thread::yield();
+    }
+    r->seq = i;
+    for (int j = 0; j < 15; j++) {
+      r->fill[j] = i * 2654435761u + j;
+    }
+    seq_ring.push();
+  }
+}
+
+static uint32_t seq_consumer(uint32_t count) {
+  uint32_t errors = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    SeqRecord *r;
+    while (!(r = seq_ring.front())) {
+      std::this_thread::yield();
+    }
+    bool bad = r->seq != i;
+    for (int j = 0; j < 15; j++) {
+      bad |= r->fill[j] != i * 2654435761u + j;
+    }
+    if (bad && errors++ < 10) {
+      fprintf(stderr, "record %u: got seq %u\n", i, r->seq);
+    }
+    seq_ring.pop();
+  }
+  return errors;
+}
+
+/**
+ * Keypad message for an address bit.
+ */
+static std::string keypad_line(int bit, bool ready, int numeric, const char *alpha) {
+  char line[128];
+  uint32_t mask = 1UL << bit;
+  snprintf(line, sizeof(line),
+           "[%d0000001000000003A--],%03d,[f7%02x%02x%02x%02x08001c08020000000000],\"%-32.32s\"\r\n",
+           ready ? 1 : 0, numeric,
+           (unsigned)(mask & 0xff), (unsigned)((mask >> 8) & 0xff),
+           (unsigned)((mask >> 16) & 0xff), (unsigned)((mask >> 24) & 0xff), alpha);
+  return line;
+}
+
+/**
+ * Changing keypad messages for 8 partitions with !LRR mixed in.
+ */
+static std::string synthetic_stream(int count) {
+  std::string s;
+  char alpha[40];
+  for (int i = 0; i < count; i++) {
+    int zone = (i / 8) % 40 + 1;
+    snprintf(alpha, sizeof(alpha), "FAULT %02d ZONE %06d", zone, i);
+    s += keypad_line(i % 8 + 1, (i / 64) & 1, zone, alpha);
+    if (i % 50 == 9) {
+      s += "!LRR:008,1,CID_3401,ff\r\n";
+    }
+  }
+  return s;
+}
+
+static uint32_t record_hash(uint32_t h, const AD2QueuedMessage *m) {
+  h = (h ^ ad2_hash(m->data, m->len)) * 16777619u;
+  h = (h ^ m->events) * 16777619u;
+  h = (h ^ m->zone) * 16777619u;
+  return (h ^ (m->has_state ? m->state.flags : 0)) * 16777619u;
+}
+
+static AD2SpscQueue<AD2QueuedMessage, 16> msg_ring;
+
+/**
+ * Parse the stream in 64 byte chunks and move every record to the ring.
+ * The parser queue is emptied after each put() so nothing is dropped or
+ * merged and the records match a single thread run.
+ */
+static void parse_producer(const std::string *stream, int loops) {
+  AD2QueueParser parser;
+  const uint8_t *data = (const uint8_t *)stream->data();
+  size_t len = stream->size();
+
+  for (int l = 0; l < loops; l++) {
+    for (size_t off = 0; off < len; off += 64) {
+      parser.put(data + off, len - off < 64 ? len - off : 64);
+      while (parser.pending()) {
+        AD2QueuedMessage *m;
+        while (!(m = msg_ring.claim())) {
+          std::this_thread::yield();
+        }
+        parser.drain(m, 1);
+        msg_ring.push();
+      }
+    }
+  }
+}
+
+static void parse_consumer(uint64_t count, uint32_t *hash) {
+  uint32_t h = 2166136261u;
+  for (uint64_t i = 0; i < count; i++) {
+    AD2QueuedMessage *m;
+    while (!(m = msg_ring.front())) {
+      std::this_thread::yield();
+    }
+    h = record_hash(h, m);
+    msg_ring.pop();
+  }
+  *hash = h;
+}
+
+int main(int argc, char **argv) {
+  uint32_t count = 10000000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        count = strtoul(optarg, nullptr, 10);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n records]\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  // Sequence run.
+  uint32_t errors = 0;
+  double t0 = now_sec();
+  std::thread producer(seq_producer, count);
+  errors = seq_consumer(count);
+  producer.join();
+  double t1 = now_sec();
+  printf("sequence %u records %u errors %.1f M/s\n", count, errors,
+         count / (t1 - t0) / 1e6);
+
+  // Reference hash of the parser records on one thread.
+  std::string stream = synthetic_stream(4096);
+  int loops = count / 4096 / 8 + 1;
+  AD2QueueParser parser;
+  AD2QueuedMessage m;
+  uint64_t records = 0;
+  uint32_t expect = 2166136261u;
+  const uint8_t *data = (const uint8_t *)stream.data();
+  for (int l = 0; l < loops; l++) {
+    for (size_t off = 0; off < stream.size(); off += 64) {
+      parser.put(data + off, stream.size() - off < 64 ? stream.size() - off : 64);
+      while (parser.drain(&m, 1)) {
+        expect = record_hash(expect, &m);
+        records++;
+      }
+    }
+  }
+
+  // Same stream split over two threads.
+  uint32_t hash = 0;
+  t0 = now_sec();
+  producer = std::thread(parse_producer, &stream, loops);
+  parse_consumer(records, &hash);
+  producer.join();
+  t1 = now_sec();
+  bool match = hash == expect && msg_ring.size() == 0;
+  printf("parser %llu records hash %08x %s %08x %.1f K/s\n",
+         (unsigned long long)records, hash, match ? "==" : "!=", expect,
+         records / (t1 - t0) / 1e3);
+
+  return errors || !match ? 1 : 0;
+}
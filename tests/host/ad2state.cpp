@@ -0,0 +1,336 @@
+/**
+ *  @file    ad2state.cpp
+ *  @author  Sean Mathews <coder@f34r.com>
+ *  @date    01/15/2020
+ *  @version 1.0
+ *
+ *  @brief Compare the JSON and binary partition state encodings
+ *
+ *  @copyright Copyright (C) 2020 Nu Tech Software Solutions, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/**
+ * Encodes a set of partition states the way the AD2EmbeddedIoT /ad2ws
+ * WebSocket sends them, as the full JSON object and as the binary
+ * AD2_STATE_RECORD_SIZE record, and decodes them back the way a client
+ * would. Reports the average size and ns per state for each and exits 1
+ * if a decoded state does not match the original.
+ *
+ * The JSON side is read with a small flat object reader. A general JSON
+ * parser on the client is slower than that so the JSON decode numbers
+ * are a lower bound.
+ *
+ *  ad2state [-n states per run]
+ */
+
+#include <ArduinoAlarmDecoder.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STATE_COUNT 1024
+
+static double now_sec() {
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Keep the compiler from dropping work.
+static volatile uint32_t sink;
+
+/**
+ * Sketch of a busy panel. Mostly quiet states with a few faulted zones,
+ * some alarms and the odd character that needs escaping.
+ */
+static void make_states(std::vector<AD2VirtualPartitionState> &states) {
+  uint32_t seed = 12345;
+  for (int i = 0; i < STATE_COUNT; i++) {
+    AD2VirtualPartitionState s;
+    seed = seed * 1103515245 + 12345;
+    s.partition = i % 8 + 1;
+    s.address_mask_filter = 1UL << (s.partition - 1);
+    s.flags = (seed >> 8) & (AD2_FLAG_READY | AD2_FLAG_ARMED_AWAY | AD2_FLAG_ACPOWER |
+                             AD2_FLAG_CHIME | AD2_FLAG_EXIT_NOW | AD2_FLAG_BACKLIGHT);
+    if (i % 97 == 0) {
+      s.flags |= AD2_FLAG_ALARM | AD2_FLAG_ALARMSTICKY;
+    }
+    s.beeps = '0' + i % 4;
+    s.panel_type = 'A';
+    s.display_cursor_type = i % 3;
+    s.display_cursor_location = i % 32;
+    s.last_numeric_message = (seed >> 16) % 100;
+    if (i % 50 == 0) {
+      snprintf(s.last_alpha_message, sizeof(s.last_alpha_message), "\"DOOR\" \\ %05d", i);
+    } else {
+      snprintf(s.last_alpha_message, sizeof(s.last_alpha_message),
+               "FAULT %02u FRONT DOOR  %08d", s.last_numeric_message, i);
+    }
+    for (int f = 0; f < (int)(seed >> 28) % 4; f++) {
+      uint8_t z = (seed >> (f * 8)) % AD2_MAX_ZONES + 1;
+      if (!s.isZoneFaulted(z)) {
+        s.zone_faults[z >> 5] |= 1UL << (z & 31);
+        s.zone_fault_count++;
+      }
+    }
+    states.push_back(s);
+  }
+}
+
+/**
+ * The full state JSON as the example builds it.
+ */
+static size_t encode_json(char *buf, size_t size, const AD2VirtualPartitionState *s,
+                          uint32_t version) {
+  AD2JsonWriter w;
+  ad2_json_begin(&w, buf, size);
+  ad2_json_uint(&w, "partition", s->partition);
+  ad2_json_uint(&w, "version", version);
+  ad2_json_string(&w, "uptime", "0001d:10h:17m:36s", 17);
+  ad2_json_state(&w, s, nullptr);
+  return ad2_json_end(&w);
+}
+
+static const struct {
+  const char *key;
+  uint32_t flag;
+} json_flags[] = {
+  {"ready", AD2_FLAG_READY},
+  {"armed_away", AD2_FLAG_ARMED_AWAY},
+  {"armed_home", AD2_FLAG_ARMED_HOME},
+  {"backlight_on", AD2_FLAG_BACKLIGHT},
+  {"programming_mode", AD2_FLAG_PROGMODE},
+  {"zone_bypassed", AD2_FLAG_BYPASS},
+  {"ac_power", AD2_FLAG_ACPOWER},
+  {"chime_on", AD2_FLAG_CHIME},
+  {"alarm_event_occured", AD2_FLAG_ALARMSTICKY},
+  {"alarm_sounding", AD2_FLAG_ALARM},
+  {"battery_low", AD2_FLAG_LOWBATTERY},
+  {"entry_delay_off", AD2_FLAG_ENTRYDELAY},
+  {"fire_alarm", AD2_FLAG_FIRE},
+  {"system_issue", AD2_FLAG_SYSISSUE},
+  {"perimeter_only", AD2_FLAG_PERIMETERONLY},
+  {"exit_now", AD2_FLAG_EXIT_NOW},
+  {"system_specific", AD2_FLAG_SYSSPECIFIC},
+};
+
+/**
+ * Read a flat state object written by encode_json(). Strings are copied
+ * unescaped. Returns false on anything it does not expect.
+ */
+static bool decode_json(const char *p, AD2VirtualPartitionState *s, uint32_t *version) {
+  char key[32];
+  char str[ALPHA_SIZE + 1];
+
+  if (*p++ != '{') {
+    return false;
+  }
+  s->flags = 0;
+  while (*p == '"') {
+    const char *k = ++p;
+    while (*p && *p != '"') {
+      p++;
+    }
+    size_t klen = p - k;
+    if (!*p || klen >= sizeof(key) || p[1] != ':') {
+      return false;
+    }
+    memcpy(key, k, klen);
+    key[klen] = 0;
+    p += 2;
+
+    if (*p == '"') {
+      size_t n = 0;
+      for (p++; *p && *p != '"'; p++) {
+        if (*p == '\\' && p[1]) {
+          p++;
+        }
+        if (n < ALPHA_SIZE) {
+          str[n++] = *p;
+        }
+      }
+      if (!*p++) {
+        return false;
+      }
+      str[n] = 0;
+      if (!strcmp(key, "address_mask_filter")) {
+        s->address_mask_filter = 0;
+        for (size_t i = 0; i < n; i++) {
+          s->address_mask_filter |= (uint32_t)(str[i] == '1') << i;
+        }
+      } else if (!strcmp(key, "beeps")) {
+        s->beeps = str[0];
+      } else if (!strcmp(key, "panel_type")) {
+        s->panel_type = str[0];
+      } else if (!strcmp(key, "last_alpha_message")) {
+        memcpy(s->last_alpha_message, str, n + 1);
+      }
+    } else if (*p == '[') {
+      memset(s->zone_faults, 0, sizeof(s->zone_faults));
+      s->zone_fault_count = 0;
+      for (p++; *p && *p != ']'; ) {
+        char *e;
+        unsigned long z = strtoul(p, &e, 10);
+        if (e == p || z > AD2_MAX_ZONES) {
+          return false;
+        }
+        s->zone_faults[z >> 5] |= 1UL << (z & 31);
+        s->zone_fault_count++;
+        p = *e == ',' ? e + 1 : e;
+      }
+      if (!*p++) {
+        return false;
+      }
+    } else if (*p == 't' || *p == 'f') {
+      bool val = *p == 't';
+      p += val ? 4 : 5;
+      for (size_t i = 0; i < sizeof(json_flags) / sizeof(json_flags[0]); i++) {
+        if (!strcmp(key, json_flags[i].key)) {
+          s->setFlag(json_flags[i].flag, val);
+          break;
+        }
+      }
+    } else {
+      char *e;
+      unsigned long val = strtoul(p, &e, 10);
+      if (e == p) {
+        return false;
+      }
+      p = e;
+      if (!strcmp(key, "partition")) {
+        s->partition = val;
+      } else if (!strcmp(key, "version")) {
+        *version = val;
+      } else if (!strcmp(key, "display_cursor_type")) {
+        s->display_cursor_type = val;
+      } else if (!strcmp(key, "display_cursor_location")) {
+        s->display_cursor_location = val;
+      } else if (!strcmp(key, "last_numeric_message")) {
+        s->last_numeric_message = val;
+      }
+    }
+    if (*p == ',') {
+      p++;
+    }
+  }
+  return *p == '}';
+}
+
+/**
+ * Fields both encodings carry.
+ */
+static bool same_state(const AD2VirtualPartitionState *a, const AD2VirtualPartitionState *b) {
+  return a->partition == b->partition &&
+         a->address_mask_filter == b->address_mask_filter &&
+         a->flags == b->flags &&
+         a->display_cursor_type == b->display_cursor_type &&
+         a->display_cursor_location == b->display_cursor_location &&
+         a->beeps == b->beeps && a->panel_type == b->panel_type &&
+         a->last_numeric_message == b->last_numeric_message &&
+         !strcmp(a->last_alpha_message, b->last_alpha_message) &&
+         a->zone_fault_count == b->zone_fault_count &&
+         !memcmp(a->zone_faults, b->zone_faults, sizeof(a->zone_faults));
+}
+
+int main(int argc, char **argv) {
+  long count = 2000000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        count = strtol(optarg, nullptr, 10);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n states per run]\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  std::vector<AD2VirtualPartitionState> states;
+  make_states(states);
+
+  // Encode every state once and check both decode back to it.
+  std::vector<std::string> json(STATE_COUNT);
+  std::vector<uint8_t> records(STATE_COUNT * AD2_STATE_RECORD_SIZE);
+  size_t json_bytes = 0;
+  int errors = 0;
+  for (int i = 0; i < STATE_COUNT; i++) {
+    char buf[1024];
+    size_t len = encode_json(buf, sizeof(buf), &states[i], i);
+    json[i].assign(buf, len);
+    json_bytes += len;
+    ad2_encode_state(&records[i * AD2_STATE_RECORD_SIZE], &states[i], i);
+
+    AD2VirtualPartitionState js, bs;
+    uint32_t jv = 0, bv = 0;
+    bool jok = decode_json(json[i].c_str(), &js, &jv);
+    bool bok = ad2_decode_state(&records[i * AD2_STATE_RECORD_SIZE],
+                                AD2_STATE_RECORD_SIZE, &bs, &bv);
+    if (!jok || jv != (uint32_t)i || !same_state(&js, &states[i])) {
+      if (errors++ < 10) {
+        fprintf(stderr, "json state %d mismatch: %s\n", i, json[i].c_str());
+      }
+    }
+    if (!bok || bv != (uint32_t)i || !same_state(&bs, &states[i])) {
+      if (errors++ < 10) {
+        fprintf(stderr, "binary state %d mismatch\n", i);
+      }
+    }
+  }
+
+  printf("%-16s %8s %10s %10s\n", "format", "bytes", "encode ns", "decode ns");
+
+  // JSON
+  char buf[1024];
+  double t0 = now_sec();
+  for (long i = 0; i < count; i++) {
+    sink += encode_json(buf, sizeof(buf), &states[i % STATE_COUNT], i);
+  }
+  double t1 = now_sec();
+  AD2VirtualPartitionState s;
+  uint32_t version;
+  for (long i = 0; i < count; i++) {
+    decode_json(json[i % STATE_COUNT].c_str(), &s, &version);
+    sink += s.flags + version;
+  }
+  double t2 = now_sec();
+  printf("%-16s %8.1f %10.1f %10.1f\n", "json",
+         (double)json_bytes / STATE_COUNT, (t1 - t0) * 1e9 / count, (t2 - t1) * 1e9 / count);
+
+  // Binary record
+  uint8_t rec[AD2_STATE_RECORD_SIZE];
+  t0 = now_sec();
+  for (long i = 0; i < count; i++) {
+    sink += ad2_encode_state(rec, &states[i % STATE_COUNT], i);
+  }
+  t1 = now_sec();
+  for (long i = 0; i < count; i++) {
+    ad2_decode_state(&records[(i % STATE_COUNT) * AD2_STATE_RECORD_SIZE],
+                     AD2_STATE_RECORD_SIZE, &s, &version);
+    sink += s.flags + version;
+  }
+  t2 = now_sec();
+  printf("%-16s %8d %10.1f %10.1f\n", "binary",
+         AD2_STATE_RECORD_SIZE, (t1 - t0) * 1e9 / count, (t2 - t1) * 1e9 / count);
+
+  if (errors) {
+    printf("%d mismatches\n", errors);
+  }
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,439 @@
+/**
+ *  @file    ad2test.cpp
+ *  @author  Sean Mathews <coder@f34r.com>
+ *  @date    01/15/2020
+ *  @version 1.0
+ *
+ *  @brief Parser regression checks
+ *
+ *  @copyright Copyright (C) 2020 Nu Tech Software Solutions, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/**
+ * Replays tests/testmessage.txt through the parser and checks the
+ * results. Exits non zero on the first failed group. Run by ctest.
+ *
+ *  ad2test [testmessage.txt]
+ */
+
+#include <ArduinoAlarmDecoder.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef AD2_TEST_DATA
+#define AD2_TEST_DATA "tests/testmessage.txt"
+#endif
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+/**
+ * Read the non empty lines of a test file.
+ */
+static std::vector<std::string> load_lines(const char *path) {
+  std::vector<std::string> lines;
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return lines;
+  }
+  char buf[512];
+  while (fgets(buf, sizeof(buf), f)) {
+    std::string s(buf);
+    while (!s.empty() && (s.back() == '\n' || s.back() == '\r')) {
+      s.pop_back();
+    }
+    if (!s.empty()) {
+      lines.push_back(s);
+    }
+  }
+  fclose(f);
+  return lines;
+}
+
+/**
+ * Keypad messages seen by ON_MESSAGE as the address mask of the message
+ * -> partition.
+ */
+static std::multimap<uint32_t, uint8_t> seen;
+
+static void partition_cb(const AD2MessageView *msg, AD2VirtualPartitionState *s) {
+  uint32_t mask = AD2_NTOHL(ad2_parse_hex(msg->data + AMASK_START, AMASK_END - AMASK_START));
+  seen.insert(std::make_pair(mask, s->partition));
+}
+
+/**
+ * Feed lines to a new parser and return the partitions seen.
+ */
+static std::multimap<uint32_t, uint8_t> replay_partitions(const std::vector<std::string> &lines) {
+  AlarmDecoderParser parser;
+  parser.setCB_ON_MESSAGE(partition_cb);
+  seen.clear();
+  for (size_t i = 0; i < lines.size(); i++) {
+    std::string l = lines[i] + "\r\n";
+    parser.put((uint8_t *)l.data(), l.size());
+  }
+  return seen;
+}
+
+/**
+ * Every message is numbered by the lowest bit of its address mask + 1 and
+ * the system partition(mask 0) is 0. Returns mask -> partition.
+ */
+static std::map<uint32_t, uint8_t> check_partitions(const std::multimap<uint32_t, uint8_t> &m) {
+  std::map<uint32_t, uint8_t> numbers;
+  CHECK(!m.empty());
+  for (auto it = m.begin(); it != m.end(); ++it) {
+    CHECK(it->second == (it->first ? AD2_CTZ(it->first) + 1 : 0));
+    numbers[it->first] = it->second;
+  }
+  return numbers;
+}
+
+static void test_partition_numbers(const std::vector<std::string> &lines) {
+  std::vector<std::string> rev(lines.rbegin(), lines.rend());
+
+  // Every mask gets the same number in both orders.
+  std::map<uint32_t, uint8_t> fwd = check_partitions(replay_partitions(lines));
+  std::map<uint32_t, uint8_t> bwd = check_partitions(replay_partitions(rev));
+  CHECK(fwd.count(0) && fwd.count(0x2) && fwd.count(0x7));
+  CHECK(fwd == bwd);
+
+  // Address bit 0 must not alias the system partition in either order.
+  const char *p1 = "[10010001000100003A--],001,[f701000000fc805c080200002a2a20],"
+                   "\"PARTITION ONE                   \"";
+  const char *sys = "[10010001000100003A--],2fc,[f700000000fc805c080200002a2a20],"
+                    "\"SYSTEM                          \"";
+  std::vector<std::string> a = {p1, sys};
+  std::vector<std::string> b = {sys, p1};
+  std::map<uint32_t, uint8_t> ma = check_partitions(replay_partitions(a));
+  std::map<uint32_t, uint8_t> mb = check_partitions(replay_partitions(b));
+  CHECK(ma.size() == 2 && ma[0] == 0 && ma[1] == 1);
+  CHECK(ma == mb);
+}
+
+/**
+ * Build a keypad message. bits are the first 16 status bytes and
+ * the panel type is always Ademco.
+ */
+static std::string keypad(const char *bits, uint8_t numeric, uint32_t mask, const char *alpha) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "[%.16s0A--],%03u,[f7%02x%02x%02x%02xfc805c080200002a2a20],\"%-32.32s\"",
+           bits, numeric, (unsigned)(mask & 0xff), (unsigned)((mask >> 8) & 0xff),
+           (unsigned)((mask >> 16) & 0xff), (unsigned)(mask >> 24), alpha);
+  return buf;
+}
+
+static void put_line(AlarmDecoderParser &parser, const std::string &line) {
+  std::string l = line + "\r\n";
+  parser.put((uint8_t *)l.data(), l.size());
+}
+
+/**
+ * Partition events in the order fired as event and zone.
+ */
+static std::vector<std::pair<uint8_t, uint8_t> > events;
+
+static void event_sub(void *ctx, uint8_t event, const AD2MessageView *msg,
+                      AD2VirtualPartitionState *s) {
+  (void)ctx;
+  (void)msg;
+  bool zone = event == AD2_EV_ZONE_FAULT || event == AD2_EV_ZONE_RESTORE;
+  events.push_back(std::make_pair(event, zone ? s->last_zone_event : 0));
+}
+
+static bool events_are(const std::vector<std::pair<uint8_t, uint8_t> > &want) {
+  if (events == want) {
+    return true;
+  }
+  for (size_t i = 0; i < events.size(); i++) {
+    fprintf(stderr, "  event %u zone %u\n", events[i].first, events[i].second);
+  }
+  return false;
+}
+
+/**
+ * Repeats of a keypad message are counted and only passed on to
+ * ON_MESSAGE with setNotifyRepeats(true).
+ */
+static int message_calls = 0;
+
+static void message_cb(const AD2MessageView *msg, AD2VirtualPartitionState *s) {
+  (void)msg;
+  (void)s;
+  message_calls++;
+}
+
+static void test_repeats(const std::vector<std::string> &lines) {
+  uint32_t keypad_lines = 0;
+  for (size_t i = 0; i < lines.size(); i++) {
+    keypad_lines += lines[i][0] == '[';
+  }
+
+  for (int notify = 0; notify < 2; notify++) {
+    AlarmDecoderParser parser;
+    AD2ParserStats stats;
+    parser.setCB_ON_MESSAGE(message_cb);
+    parser.setNotifyRepeats(notify);
+    message_calls = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+      put_line(parser, lines[i]);
+    }
+    parser.getStats(&stats);
+    // "SYSTEM LOBAT 1" and the blank LOBAT are each sent twice in a row.
+    CHECK(stats.repeats == 2);
+    CHECK(stats.keypad + stats.repeats == keypad_lines);
+    CHECK(message_calls == (int)(notify ? keypad_lines : keypad_lines - 2));
+  }
+}
+
+/**
+ * State transitions fire once per change. The first message of a
+ * partition only sets its starting state.
+ */
+static void test_transitions() {
+  AlarmDecoderParser parser;
+  parser.subscribe(AD2_EVENT_MASK(AD2_EV_ARM) | AD2_EVENT_MASK(AD2_EV_DISARM) |
+                   AD2_EVENT_MASK(AD2_EV_READY_CHANGE) | AD2_EVENT_MASK(AD2_EV_POWER_CHANGE) |
+                   AD2_EVENT_MASK(AD2_EV_ALARM) | AD2_EVENT_MASK(AD2_EV_ALARM_RESTORED),
+                   event_sub);
+  events.clear();
+
+  //                        RAHBPBYCKSALEFIP
+  put_line(parser, keypad("1000000100000000", 8, 0x2, "READY TO ARM"));
+  put_line(parser, keypad("0100000100000000", 8, 0x2, "ARMED AWAY"));
+  put_line(parser, keypad("0100000100100000", 8, 0x2, "ALARM"));
+  put_line(parser, keypad("0100000100100000", 8, 0x2, "ALARM"));
+  put_line(parser, keypad("0000000000000000", 8, 0x2, "DISARMED"));
+
+  CHECK(events_are({
+    {AD2_EV_ARM, 0}, {AD2_EV_READY_CHANGE, 0}, {AD2_EV_ALARM, 0},
+    {AD2_EV_DISARM, 0}, {AD2_EV_POWER_CHANGE, 0}, {AD2_EV_ALARM_RESTORED, 0},
+  }));
+}
+
+/**
+ * Zones fault when shown, restore when skipped in the display cycle, when
+ * not shown again for AD2_ZONE_TIMEOUT_MS and when the partition is READY.
+ */
+static void test_zones() {
+  AlarmDecoderParser parser;
+  parser.subscribe(AD2_EVENT_MASK(AD2_EV_ZONE_FAULT) | AD2_EVENT_MASK(AD2_EV_ZONE_RESTORE),
+                   event_sub);
+  events.clear();
+
+  const char *faulted = "0000000100000000";
+  put_line(parser, keypad(faulted, 5, 0x2, "FAULT 05 FRONT DOOR"));
+  put_line(parser, keypad(faulted, 9, 0x2, "FAULT 09 BACK DOOR"));
+  put_line(parser, keypad(faulted, 12, 0x2, "FAULT 12 GARAGE"));
+  put_line(parser, keypad(faulted, 5, 0x2, "FAULT 05 FRONT DOOR"));
+  // 9 was skipped.
+  put_line(parser, keypad(faulted, 12, 0x2, "FAULT 12 GARAGE"));
+  CHECK(events_are({
+    {AD2_EV_ZONE_FAULT, 5}, {AD2_EV_ZONE_FAULT, 9}, {AD2_EV_ZONE_FAULT, 12},
+    {AD2_EV_ZONE_RESTORE, 9},
+  }));
+
+  // Nothing times out early. A repeat of the last zone keeps it faulted.
+  host_advance_ms(AD2_ZONE_TIMEOUT_MS - 2000);
+  parser.checkZoneTimeouts();
+  CHECK(events.size() == 4);
+  put_line(parser, keypad(faulted, 12, 0x2, "FAULT 12 GARAGE"));
+
+  // 5 was last shown AD2_ZONE_TIMEOUT_MS ago.
+  host_advance_ms(2000 + AD2_ZONE_TICK_MS);
+  parser.checkZoneTimeouts();
+  CHECK(events.size() == 5 && events.back() == std::make_pair((uint8_t)AD2_EV_ZONE_RESTORE,
+                                                              (uint8_t)5));
+
+  // READY restores the rest.
+  put_line(parser, keypad("1000000100000000", 8, 0x2, "READY TO ARM"));
+  CHECK(events.size() == 6 && events.back() == std::make_pair((uint8_t)AD2_EV_ZONE_RESTORE,
+                                                              (uint8_t)12));
+}
+
+/**
+ * A zone that faulted while every restore timer was in use gets a timer
+ * when it is shown again after timers were freed.
+ */
+static void test_zone_timer_overflow() {
+  AlarmDecoderParser parser;
+  parser.subscribe(AD2_EVENT_MASK(AD2_EV_ZONE_FAULT) | AD2_EVENT_MASK(AD2_EV_ZONE_RESTORE),
+                   event_sub);
+  events.clear();
+
+  const char *faulted = "0000000100000000";
+  const uint8_t last = AD2_MAX_ZONE_FAULTS + 1;
+  char alpha[33];
+  for (uint8_t z = 1; z <= last; z++) {
+    snprintf(alpha, sizeof(alpha), "FAULT %02u", z);
+    put_line(parser, keypad(faulted, z, 0x2, alpha));
+  }
+  CHECK(events.size() == last);
+
+  // Show 1 and 3 so 2 is skipped, then last so 4 to last - 1 are skipped
+  // and their timers are freed.
+  put_line(parser, keypad(faulted, 1, 0x2, "FAULT 01"));
+  put_line(parser, keypad(faulted, 3, 0x2, "FAULT 03"));
+  snprintf(alpha, sizeof(alpha), "FAULT %02u", last);
+  put_line(parser, keypad(faulted, last, 0x2, alpha));
+  CHECK(events.size() == (size_t)last + last - 3);
+
+  // last only has a timer if it got one when it was shown again.
+  events.clear();
+  host_advance_ms(AD2_ZONE_TIMEOUT_MS + AD2_ZONE_TICK_MS);
+  parser.checkZoneTimeouts();
+  // Timers that expire on the same tick restore in no set order.
+  std::sort(events.begin(), events.end());
+  CHECK(events_are({
+    {AD2_EV_ZONE_RESTORE, 1}, {AD2_EV_ZONE_RESTORE, 3}, {AD2_EV_ZONE_RESTORE, last},
+  }));
+}
+
+/**
+ * ON_KPM fires for every !KPM line with the partition or nullptr.
+ */
+static int kpm_calls = 0;
+static int kpm_null = 0;
+
+static void kpm_cb(const AD2MessageView *msg, AD2VirtualPartitionState *s) {
+  (void)msg;
+  kpm_calls++;
+  kpm_null += s == nullptr;
+}
+
+static void test_kpm() {
+  const char *lines[] = {
+    "!KPM:[10010001000100003A--],2fc,[f700000000fc805c080200002a2a20],"
+    "\"SYSTEM LOBAT                    \"\r\n",
+    "!KPM:[10010001000100003A--],2fc,[f700000000fc805c080200002a2a20],"
+    "\"SYSTEM LOBAT                    \"\r\n",
+    "!KPM:[10010001000100003A--],2fc,[f7000000\r\n",
+  };
+  AlarmDecoderParser parser;
+  parser.setCB_ON_KPM(kpm_cb);
+  for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+    parser.put((uint8_t *)lines[i], strlen(lines[i]));
+  }
+  CHECK(kpm_calls == 3);
+  CHECK(kpm_null == 1);
+}
+
+/**
+ * A command from another source is merged into the one just written only
+ * if it has the same bytes.
+ */
+static void test_commands() {
+  AD2CommandQueue q;
+  AD2CommandStats stats;
+  Print sink(nullptr);
+
+  CHECK(q.send("1234#", 5, 0));
+  CHECK(q.poll(sink) == 5);
+  CHECK(q.send("1234#", 5, 1));
+  CHECK(q.send("1235#", 5, 1));
+  q.getStats(&stats);
+  CHECK(stats.merged == 1 && stats.queued == 2 && q.pending() == 1);
+}
+
+/**
+ * ad2_json_state_changed() follows the members the JSON state shows.
+ */
+static void test_json_changed() {
+  AD2VirtualPartitionState a, b;
+  CHECK(!ad2_json_state_changed(&a, &b));
+  b.message_hash = 1;
+  b.repeat_count = 5;
+  CHECK(!ad2_json_state_changed(&a, &b));
+  b.setFlag(AD2_FLAG_READY, true);
+  CHECK(ad2_json_state_changed(&a, &b));
+  b = a;
+  strcpy(b.last_alpha_message, "READY");
+  CHECK(ad2_json_state_changed(&a, &b));
+  b = a;
+  b.zone_faults[AD2_ZONE_WORDS - 1] = 1;
+  CHECK(ad2_json_state_changed(&a, &b));
+}
+
+/**
+ * Output that takes at most room bytes per write.
+ */
+class ShortPrint : public Print
+{
+  public:
+    ShortPrint() : Print(nullptr) {}
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t size) {
+      size_t n = size < room ? size : room;
+      data.append((const char *)buf, n);
+      return n;
+    }
+    size_t room = 0;
+    std::string data;
+};
+
+/**
+ * A command the output takes only part of stays at the head and the
+ * rest is written by a later poll().
+ */
+static void test_command_short_write() {
+  AD2CommandQueue q;
+  AD2CommandStats stats;
+  ShortPrint out;
+
+  CHECK(q.send("1234#", 5, 0));
+  CHECK(q.poll(out) == 0);
+  host_advance_ms(AD2_CMD_GAP_MS);
+  out.room = 2;
+  CHECK(q.poll(out) == 2);
+  CHECK(q.pending() == 1);
+  host_advance_ms(AD2_CMD_GAP_MS);
+  out.room = 10;
+  CHECK(q.poll(out) == 3);
+  CHECK(q.pending() == 0 && out.data == "1234#");
+  q.getStats(&stats);
+  CHECK(stats.sent == 1 && stats.short_writes == 2 && stats.bytes == 5);
+}
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : AD2_TEST_DATA;
+  std::vector<std::string> lines = load_lines(path);
+  if (lines.empty()) {
+    fprintf(stderr, "%s: no test messages\n", path);
+    return 1;
+  }
+  Serial.setOutput(nullptr);
+
+  test_partition_numbers(lines);
+  test_repeats(lines);
+  test_transitions();
+  test_zones();
+  test_zone_timer_overflow();
+  test_kpm();
+  test_commands();
+  test_command_short_write();
+  test_json_changed();
+
+  printf("ad2test: %s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}